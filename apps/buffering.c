@@ -19,6 +19,7 @@
  *
  ****************************************************************************/
 #include "config.h"
+#include <stdio.h>
 #include <string.h>
 #include "strlcpy.h"
 #include "system.h"
@@ -28,6 +29,11 @@
 #include "panic.h"
 #include "debug.h"
 #include "file.h"
+#include "dir.h"
+#include "file_async.h"
+#ifdef HAVE_MULTIDRIVE
+#include "pathfuncs.h"
+#endif
 #include "appevents.h"
 #include "metadata.h"
 #include "bmp.h"
@@ -35,9 +41,22 @@
 #include "albumart.h"
 #include "jpeg_load.h"
 #include "playback.h"
+#include "crc32.h"
+#include "rbpaths.h"
+#include "misc.h"
 #endif
 #include "buffering.h"
 
+/* Hosted builds get real file descriptors, so audio files can be mapped
+   instead of being copied into the buffer */
+#if defined(APPLICATION) && !defined(WIN32)
+#define BUFFERING_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
 /* Define LOGF_ENABLE to enable logf output in this file */
 /* #define LOGF_ENABLE */
 #include "logf.h"
@@ -65,16 +84,45 @@
 
 #define GUARD_BUFSIZE   (32*1024)
 
-/* amount of data to read in one read() call */
+/* amount of data to read in one read() call until the storage throughput
+   is known */
 #define BUFFERING_DEFAULT_FILECHUNK      (1024*32)
 
+/* Limits of the adapted read size */
+#define BUFFERING_MIN_FILECHUNK          (1024*16)
+#if MEMORYSIZE > 32
+#define BUFFERING_MAX_FILECHUNK          (1024*512)
+#else
+#define BUFFERING_MAX_FILECHUNK          (1024*64)
+#endif
+
+/* Time one read() call should take at the measured throughput. Longer reads
+   mean less overhead but delay the response to queued requests. */
+#define BUFFERING_CHUNK_TIME             (HZ/20)
+
+/* Throughput is averaged over at least this much reading time... */
+#define BUFFERING_RATE_TICKS             (HZ/4)
+/* ...or this much data for storage so fast the reads don't register */
+#define BUFFERING_RATE_BYTES             (1024*1024*4)
+
+/* Bounds of the idle interval between two checks of the buffer level */
+#define BUFFERING_MIN_POLL               (HZ/2)
+#define BUFFERING_MAX_POLL               (4*HZ)
+
 #define BUF_HANDLE_MASK                  0x7FFFFFFF
 
+#ifdef BUFFERING_MMAP
+/* Limit on the address space taken by all file mappings together */
+#define BUFFERING_MMAP_MAX \
+    ((size_t)(sizeof (void *) > 4 ? 4096 : 256) * 1024*1024)
+#endif
+
 enum handle_flags
 {
     H_CANWRAP   = 0x1,   /* Handle data may wrap in buffer */
     H_ALLOCALL  = 0x2,   /* All data must be allocated up front */
     H_FIXEDDATA = 0x4,   /* Data is fixed in position */
+    H_MAPPED    = 0x8,   /* Data is read from a file mapping, not the buffer */
 };
 
 struct memory_handle {
@@ -92,6 +140,10 @@ struct memory_handle {
     off_t   start;          /* Offset at which we started reading the file */
     off_t   pos;            /* Read position in file */
     off_t volatile end;     /* Offset at which we stopped reading the file */
+#ifdef BUFFERING_MMAP
+    const char *map;        /* Mapping of the whole file (H_MAPPED) */
+    size_t  maplen;         /* Length of the mapping */
+#endif
     struct memory_handle *next;
 };
 
@@ -110,6 +162,29 @@ static size_t buffer_len;
 static size_t conf_watermark = 0; /* Level to trigger filebuf fill */
 static size_t high_watermark = 0; /* High watermark for rebuffer */
 
+/* Read throughput measured for each storage device. The read size follows
+   it so every read() takes about BUFFERING_CHUNK_TIME. */
+static struct storage_rate
+{
+    size_t chunk;            /* Current read size */
+    unsigned long bandwidth; /* Averaged throughput in bytes/s, 0 if unknown */
+    unsigned long bytes;     /* Bytes read in the current measurement */
+    long ticks;              /* Ticks spent reading them */
+} storage_rates[NUM_DRIVES];
+
+/* Storage the buffering thread read from last */
+static struct storage_rate *last_rate = &storage_rates[0];
+
+/* Consumption of the buffered data, measured while idle. It sets how long
+   the thread can sleep before the level has to be checked again. */
+static struct
+{
+    size_t useful;           /* Useful data at the last check */
+    long tick;               /* Time of the last check */
+    unsigned long rate;      /* Averaged consumption in bytes/s */
+    long poll;               /* Current idle interval */
+} drain;
+
 /* current memory handle in the linked list. NULL when the list is empty. */
 static struct memory_handle *cur_handle;
 /* first memory handle in the linked list. NULL when the list is empty. */
@@ -117,14 +192,37 @@ static struct memory_handle *first_handle;
 
 static int num_handles;  /* number of handles in the list */
 
+#ifdef BUFFERING_MMAP
+static size_t mapped_bytes; /* Size of all file mappings */
+
+/* The mappings of the mapped handles, for the SIGBUS handler */
+static struct
+{
+    const char * volatile start;
+    size_t len;
+} mappings[BUF_MAX_HANDLES];
+#endif
+
 static int base_handle_id;
 
 /* Main lock for adding / removing handles */
 static struct mutex llist_mutex SHAREDBSS_ATTR;
 
-/* Handle cache (makes find_handle faster).
-   This is global so that move_handle and rm_handle can invalidate it. */
-static struct memory_handle *cached_handle = NULL;
+/* Handle lookup table indexed by ID (makes find_handle O(1)).
+   Open addressing with linear probing, kept in sync with the linked list by
+   link_cur_handle, rm_handle and move_handle. IDs are handed out in sequence
+   so they rarely collide. find_handle reads it without the lock, from the
+   codec thread too, so it's shared between the cores. */
+#define HANDLE_TABLE_SIZE   (BUF_MAX_HANDLES*2) /* Must be a power of 2 */
+#define HANDLE_TABLE_MASK   (HANDLE_TABLE_SIZE-1)
+#if HANDLE_TABLE_SIZE & HANDLE_TABLE_MASK
+#error HANDLE_TABLE_SIZE must be a power of 2
+#endif
+static struct memory_handle * volatile handle_table[HANDLE_TABLE_SIZE]
+    SHAREDBSS_ATTR;
+/* Odd while handle_table_remove shifts entries back; find_handle looks
+   again if it missed while this changed */
+static volatile unsigned int handle_table_seq SHAREDBSS_ATTR;
 
 static struct data_counters
 {
@@ -148,8 +246,22 @@ enum
                             fill at its earliest convenience */
     Q_HANDLE_ADDED,      /* Inform the buffering thread that a handle was added,
                             (which means the disk is spinning) */
+
+    Q_DROP_READ,         /* Wait for the read in flight and forget it, the
+                            buffer is about to be reset */
+
+    /* Internal: */
+    Q_READ_DONE,         /* The read in flight has completed */
 };
 
+/* The read in flight, if any. Normal buffering submits one chunk at a time
+   and goes back to serving the queue until it's done; anything that would
+   move or drop the data under it waits for it first. */
+static struct file_async_req read_req;
+static bool read_pending = false;
+static int read_handle_id;   /* Handle the read is for */
+static bool read_stop;       /* It was the last chunk there was space for */
+
 /* Buffering thread */
 static void buffering_thread(void);
 static long buffering_stack[(DEFAULT_STACK_SIZE + 0x2000)/sizeof(long)];
@@ -167,6 +279,31 @@ static void close_fd(int *fd_p)
     }
 }
 
+#ifdef BUFFERING_MMAP
+static bool add_mapping(const char *map, size_t len)
+{
+    for (int i = 0; i < BUF_MAX_HANDLES; i++) {
+        if (!mappings[i].start) {
+            mappings[i].len = len;
+            mappings[i].start = map;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void remove_mapping(const char *map)
+{
+    for (int i = 0; i < BUF_MAX_HANDLES; i++) {
+        if (mappings[i].start == map) {
+            mappings[i].start = NULL;
+            break;
+        }
+    }
+}
+#endif /* BUFFERING_MMAP */
+
 /* Ring buffer helper functions */
 static inline void * ringbuf_ptr(uintptr_t p)
 {
@@ -219,6 +356,9 @@ rm_handle   : Remove a handle from the list
 find_handle : Get a handle pointer from an ID
 move_handle : Move a handle in the buffer (with or without its data)
 
+handle_table_slot   : Find the lookup table slot of an ID
+handle_table_remove : Remove a slot from the lookup table
+
 These functions only handle the linked list structure. They don't touch the
 contents of the struct memory_handle headers.
 
@@ -245,9 +385,59 @@ static int next_handle_id(void)
     return next_hid;
 }
 
+/* Return the lookup table slot holding the handle with the given ID.
+   -1 if the handle isn't in the table */
+static int handle_table_slot(int handle_id)
+{
+    int i = handle_id & HANDLE_TABLE_MASK;
+
+    while (handle_table[i]) {
+        if (handle_table[i]->id == handle_id)
+            return i;
+        i = (i + 1) & HANDLE_TABLE_MASK;
+    }
+
+    return -1;
+}
+
+/* Empty a lookup table slot, shifting back the following entries of the
+   probe sequence so no tombstones are needed. Each entry is copied into the
+   hole before its old slot becomes the hole, and only the slot vacated last
+   is cleared, so a live handle is always in the table. */
+static void handle_table_remove(int slot)
+{
+    int i = slot, j = slot;
+
+    handle_table_seq++;
+
+    while (1) {
+        j = (j + 1) & HANDLE_TABLE_MASK;
+        if (!handle_table[j])
+            break;
+
+        /* The entry stays if its home slot lies cyclically in (i, j] */
+        int k = handle_table[j]->id & HANDLE_TABLE_MASK;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        handle_table[i] = handle_table[j];
+        i = j;
+    }
+
+    handle_table[i] = NULL;
+    handle_table_seq++;
+}
+
 /* adds the handle to the linked list */
 static void link_cur_handle(struct memory_handle *h)
 {
+    int i = h->id & HANDLE_TABLE_MASK;
+
+    /* The table is never more than half full */
+    while (handle_table[i])
+        i = (i + 1) & HANDLE_TABLE_MASK;
+    handle_table[i] = h;
+
     h->next = NULL;
 
     if (first_handle)
@@ -281,7 +471,9 @@ add_handle(unsigned int flags, size_t data_size, size_t *data_out)
         /* Buffer is not empty */
         ridx = ringbuf_offset(first_handle);
         widx = cur_handle->data;
-        cur_total = cur_handle->filesize - cur_handle->start;
+        /* A mapped handle doesn't take any buffer space for its data */
+        if (!(cur_handle->flags & H_MAPPED))
+            cur_total = cur_handle->filesize - cur_handle->start;
     }
 
     if (cur_total > 0) {
@@ -369,9 +561,14 @@ static bool rm_handle(const struct memory_handle *h)
         }
     }
 
-    /* Invalidate the cache to prevent it from keeping the old location of h */
-    if (h == cached_handle)
-        cached_handle = NULL;
+    int slot = handle_table_slot(h->id);
+    if (slot < 0) {
+        /* The table and the list disagree, just as bad as above */
+        panicf("rm_handle fail: %d not in table", h->id);
+        return false;
+    }
+
+    handle_table_remove(slot);
 
     num_handles--;
     return true;
@@ -384,31 +581,20 @@ static struct memory_handle *find_handle(int handle_id)
     if (handle_id < 0 || !first_handle)
         return NULL;
 
-    /* Simple caching because most of the time the requested handle
-       will either be the same as the last, or the one after the last */
-    struct memory_handle *cached = cached_handle;
-    if (cached) {
-        if (cached->id == handle_id) {
-            return cached;
-        } else {
-            cached = cached->next;
-            if (cached && cached->id == handle_id) {
-                cached_handle = cached;
-                return cached;
-            }
-        }
-    }
+    struct memory_handle *h;
+    unsigned int seq;
 
-    struct memory_handle *m = first_handle;
-    while (m && m->id != handle_id) {
-        m = m->next;
-    }
+    /* A handle may be shifted back past the probe while it runs; only a miss
+       can be wrong then */
+    do {
+        seq = handle_table_seq;
 
-    /* This condition can only be reached with !m or m->id == handle_id */
-    if (m)
-        cached_handle = m;
+        int i = handle_id & HANDLE_TABLE_MASK;
+        while ((h = handle_table[i]) && h->id != handle_id)
+            i = (i + 1) & HANDLE_TABLE_MASK;
+    } while (!h && ((seq & 1) || seq != handle_table_seq));
 
-    return m;
+    return h;
 }
 
 /* Move a memory handle and data_size of its data delta bytes along the buffer.
@@ -471,6 +657,10 @@ static bool move_handle(struct memory_handle **h, size_t *delta,
         }
     }
 
+    int slot = handle_table_slot(src->id);
+    if (slot < 0)
+        return false;
+
     struct memory_handle *dest = ringbuf_ptr(newpos);
 
     if (src == first_handle) {
@@ -487,9 +677,8 @@ static bool move_handle(struct memory_handle **h, size_t *delta,
         }
     }
 
-    /* Update the cache to prevent it from keeping the old location of h */
-    if (src == cached_handle)
-        cached_handle = dest;
+    /* Update the lookup table to the new location of h */
+    handle_table[slot] = dest;
 
     /* the cur_handle pointer might need updating */
     if (src == cur_handle)
@@ -599,17 +788,144 @@ static int update_data_counters(struct data_counters *dc)
     return num;
 }
 
+/* Return the throughput record of the storage a handle is read from */
+static struct storage_rate *handle_storage_rate(const struct memory_handle *h)
+{
+#ifdef HAVE_MULTIDRIVE
+    int drive = volume_drive(path_strip_volume(h->path, NULL, false));
+    if ((unsigned int)drive < NUM_DRIVES)
+        return &storage_rates[drive];
+#else
+    (void)h;
+#endif
+    return &storage_rates[0];
+}
+
+/* Account for a read of size bytes that took ticks and adapt the read size
+   once enough was measured. Ticks are coarse, but reads start at random
+   points of a tick so the error averages out over many of them. */
+static void storage_rate_update(struct storage_rate *rate, size_t size,
+                                long ticks)
+{
+    rate->bytes += size;
+    rate->ticks += ticks;
+
+    if (rate->ticks < BUFFERING_RATE_TICKS &&
+        rate->bytes < BUFFERING_RATE_BYTES)
+        return;
+
+    unsigned long bandwidth =
+        (uint64_t)rate->bytes * HZ / MAX(rate->ticks, 1);
+
+    if (rate->bandwidth)
+        bandwidth = (3*rate->bandwidth + bandwidth) / 4;
+
+    rate->bandwidth = bandwidth;
+    rate->bytes = 0;
+    rate->ticks = 0;
+
+    /* Keep it a power of 2 so reads stay storage aligned */
+    size_t chunk = BUFFERING_MIN_FILECHUNK;
+    while (chunk < BUFFERING_MAX_FILECHUNK &&
+           chunk * 2 <= bandwidth / (HZ / BUFFERING_CHUNK_TIME))
+        chunk *= 2;
+
+    if (chunk != rate->chunk)
+        logf("read size: %lu (%lu B/s)", (unsigned long)chunk, bandwidth);
+
+    rate->chunk = chunk;
+}
+
+/* Account for a chunk read to widx. Return false if the read failed and
+   buffering of the handle has to stop. */
+static bool read_apply(struct memory_handle *h, uintptr_t widx, ssize_t rc,
+                       long ticks)
+{
+    if (rc <= 0) {
+        /* Some kind of filesystem error, maybe recoverable if not codec */
+        if (h->type == TYPE_CODEC) {
+            logf("Partial codec");
+            return false;
+        }
+
+        logf("File ended %lu bytes early\n",
+             (unsigned long)(h->filesize - h->end));
+        h->filesize = h->end;
+        return false;
+    }
+
+    storage_rate_update(handle_storage_rate(h), rc, ticks);
+
+    /* Advance buffer and make data available to users */
+    h->widx = ringbuf_add(widx, rc);
+    h->end += rc;
+    return true;
+}
+
+static void read_end(struct memory_handle *h)
+{
+    if (h->end >= h->filesize) {
+        /* finished buffering the file */
+        int handle_id = h->id;
+        close_fd(&h->fd);
+        send_event(BUFFER_EVENT_FINISHED, &handle_id);
+    }
+}
+
+/* Wait for the read in flight, if any, and account for it. Return whether
+   or not the buffering should continue, like buffer_handle(). */
+static bool finish_read(void)
+{
+    if (!read_pending)
+        return true;
+
+    file_async_wait(&read_req);
+    read_pending = false;
+
+    struct memory_handle *h = find_handle(read_handle_id);
+    if (h) {
+        read_apply(h, ringbuf_offset(read_req.buf), read_req.result,
+                   read_req.ticks);
+        read_end(h);
+    }
+
+    return !read_stop;
+}
+
+/* Forget the read in flight for a handle that is going away */
+static void drop_read(int handle_id)
+{
+    if (read_pending && read_handle_id == handle_id) {
+        file_async_wait(&read_req);
+        read_pending = false;
+    }
+}
+
 /* Q_BUFFER_HANDLE event and buffer data for the given handle.
-   Return whether or not the buffering should continue explicitly.  */
+   Return whether or not the buffering should continue explicitly.
+   With to_buffer == 0, this only starts the read of the next chunk and
+   the Q_READ_DONE event carries on from there. */
 static bool buffer_handle(int handle_id, size_t to_buffer)
 {
     logf("buffer_handle(%d, %lu)", handle_id, (unsigned long)to_buffer);
+
+    /* Only one read at a time: the space check below needs the current
+       write position */
+    finish_read();
+
     struct memory_handle *h = find_handle(handle_id);
     if (!h)
         return true;
 
     logf("  type: %d", (int)h->type);
 
+    if (h->flags & H_MAPPED) {
+        /* All the data was available from the start. Only tell about it
+           from here, like for any other handle. */
+        send_event(BUFFER_EVENT_FINISHED, &handle_id);
+        return true;
+    }
+
     if (h->end >= h->filesize) {
         /* nothing left to buffer */
         return true;
@@ -643,6 +959,9 @@ static bool buffer_handle(int handle_id, size_t to_buffer)
         return true;
     }
 
+    struct storage_rate *rate = handle_storage_rate(h);
+    last_rate = rate;
+
     bool stop = false;
     while (h->end < h->filesize && !stop)
     {
@@ -650,7 +969,7 @@ static bool buffer_handle(int handle_id, size_t to_buffer)
         size_t widx = h->widx;
 
         ssize_t copy_n = h->filesize - h->end;
-        copy_n = MIN(copy_n, BUFFERING_DEFAULT_FILECHUNK);
+        copy_n = MIN(copy_n, (ssize_t)rate->chunk);
         copy_n = MIN(copy_n, (off_t)(buffer_len - widx));
 
         uintptr_t offset = ringbuf_offset(h->next ?: first_handle);
@@ -670,44 +989,35 @@ static bool buffer_handle(int handle_id, size_t to_buffer)
         if (copy_n <= 0)
             return false; /* no space for read */
 
+        if (to_buffer == 0) {
+            /* Normal buffering - keep serving the queue during the read */
+            read_req.fd = h->fd;
+            read_req.buf = ringbuf_ptr(widx);
+            read_req.count = copy_n;
+            read_req.queue = &buffering_queue;
+            read_req.id = Q_READ_DONE;
+            read_handle_id = handle_id;
+            read_stop = stop;
+            read_pending = true;
+            file_read_async(&read_req);
+            return !stop;
+        }
+
         /* rc is the actual amount read */
+        long start = current_tick;
         ssize_t rc = read(h->fd, ringbuf_ptr(widx), copy_n);
 
-        if (rc <= 0) {
-            /* Some kind of filesystem error, maybe recoverable if not codec */
-            if (h->type == TYPE_CODEC) {
-                logf("Partial codec");
-                break;
-            }
-
-            logf("File ended %lu bytes early\n",
-                 (unsigned long)(h->filesize - h->end));
-            h->filesize = h->end;
+        if (!read_apply(h, widx, rc, current_tick - start))
             break;
-        }
-
-        /* Advance buffer and make data available to users */
-        h->widx = ringbuf_add(widx, rc);
-        h->end += rc;
 
         yield();
 
-        if (to_buffer == 0) {
-            /* Normal buffering - check queue */
-            if (!queue_empty(&buffering_queue))
-                break;
-        } else {
-            if (to_buffer <= (size_t)rc)
-                break; /* Done */
-            to_buffer -= rc;
-        }
+        if (to_buffer <= (size_t)rc)
+            break; /* Done */
+        to_buffer -= rc;
     }
 
-    if (h->end >= h->filesize) {
-        /* finished buffering the file */
-        close_fd(&h->fd);
-        send_event(BUFFER_EVENT_FINISHED, &handle_id);
-    }
+    read_end(h);
 
     return !stop;
 }
@@ -718,12 +1028,21 @@ static bool close_handle(int handle_id)
 {
     bool retval = true;
 
+    drop_read(handle_id);
+
     mutex_lock(&llist_mutex);
     struct memory_handle *h = find_handle(handle_id);
 
     /* If the handle is not found, it is closed */
     if (h) {
         close_fd(&h->fd);
+#ifdef BUFFERING_MMAP
+        if (h->flags & H_MAPPED) {
+            remove_mapping(h->map);
+            munmap((void *)h->map, h->maplen);
+            mapped_bytes -= h->maplen;
+        }
+#endif
         /* rm_handle returns true unless the handle somehow persists after
            exit */
         retval = rm_handle(h);
@@ -737,8 +1056,8 @@ static bool close_handle(int handle_id)
    part of its data buffer or by moving all the data. */
 static void shrink_handle(struct memory_handle *h)
 {
-    if (!h)
-        return;
+    if (!h || (h->flags & H_MAPPED))
+        return; /* Mapped data takes no buffer space */
 
     if (h->type == TYPE_PACKET_AUDIO) {
         /* only move the handle struct */
@@ -800,14 +1119,23 @@ static void shrink_handle(struct memory_handle *h)
 static bool fill_buffer(void)
 {
     logf("fill_buffer()");
+
+    if (read_pending)
+        return true; /* Q_READ_DONE goes on with it */
+
     struct memory_handle *m = first_handle;
 
     shrink_handle(m);
 
     while (queue_empty(&buffering_queue) && m) {
-        if (m->end < m->filesize && !buffer_handle(m->id, 0)) {
-            m = NULL;
-            break;
+        if (m->end < m->filesize) {
+            bool more = buffer_handle(m->id, 0);
+            if (read_pending)
+                return true;
+            if (!more) {
+                m = NULL;
+                break;
+            }
         }
         m = m->next;
     }
@@ -823,12 +1151,166 @@ static bool fill_buffer(void)
 }
 
 #ifdef HAVE_ALBUMART
+/* Decoded and scaled album art is kept on disk in the native lcd format so
+   the next time the same art is wanted at the same size it is simply read
+   back. The thumbnails are stored in a fixed number of slots picked by a
+   hash of the source, so the cache can't grow without bounds. A new one is
+   written from the buffered handle once buffering is idle, not while the
+   caller of bufopen() waits. */
+#define THUMB_MAGIC     (0x41415400 | LCD_DEPTH) /* "AAT" + depth */
+#define THUMB_SLOTS     256
+
+struct thumb_header
+{
+    uint32_t magic;
+    char     path[MAX_PATH];    /* source file */
+    off_t    filesize;          /* ...its size */
+    time_t   mtime;             /* ...and modification time */
+    off_t    aa_pos;            /* embedded art position or -1 */
+    int      aa_size;           /* embedded art size */
+    int      dim_width;         /* requested size */
+    int      dim_height;
+    int      width;             /* the bitmap as decoded */
+    int      height;
+#if (LCD_DEPTH > 1) || defined(HAVE_REMOTE_LCD) && (LCD_REMOTE_DEPTH > 1)
+    int      format;
+#endif
+#ifdef HAVE_LCD_COLOR
+    int      alpha_offset;
+#endif
+    int      data_size;         /* bytes of pixel data following */
+};
+
+static void thumb_init_header(struct thumb_header *hdr, int fd,
+                              const char *path,
+                              const struct bufopen_bitmap_data *data)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = THUMB_MAGIC;
+    strlcpy(hdr->path, path, sizeof(hdr->path));
+    hdr->filesize = filesize(fd);
+    hdr->mtime = file_mtime(path);
+    hdr->aa_pos = data->embedded_albumart ? data->embedded_albumart->pos : -1;
+    hdr->aa_size = data->embedded_albumart ? data->embedded_albumart->size : 0;
+    hdr->dim_width = data->dim->width;
+    hdr->dim_height = data->dim->height;
+}
+
+static void thumb_get_path(char *buf, size_t bufsize,
+                           const struct thumb_header *hdr)
+{
+    uint32_t crc = crc_32(hdr->path, strlen(hdr->path), 0xffffffff);
+    crc = crc_32(&hdr->aa_pos, sizeof(hdr->aa_pos), crc);
+    crc = crc_32(&hdr->dim_width, sizeof(int) * 2, crc);
+    snprintf(buf, bufsize, ALBUMART_THUMB_DIR "/%02x.bmt",
+             (unsigned int)(crc % THUMB_SLOTS));
+}
+
+/* Read a cached thumbnail matching hdr into bmp, return the size of its
+   data or 0 if there is none */
+static int thumb_load(const struct thumb_header *hdr, struct bitmap *bmp,
+                      int free)
+{
+    char thumbpath[MAX_PATH];
+    struct thumb_header cached;
+    int rc = 0;
+
+    thumb_get_path(thumbpath, sizeof(thumbpath), hdr);
+    int fd = open(thumbpath, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (read(fd, &cached, sizeof(cached)) == (ssize_t)sizeof(cached) &&
+        cached.magic == hdr->magic &&
+        !strcmp(cached.path, hdr->path) &&
+        cached.filesize == hdr->filesize &&
+        cached.mtime == hdr->mtime &&
+        cached.aa_pos == hdr->aa_pos &&
+        cached.aa_size == hdr->aa_size &&
+        cached.dim_width == hdr->dim_width &&
+        cached.dim_height == hdr->dim_height &&
+        cached.data_size > 0 && cached.data_size <= free &&
+        read(fd, bmp->data, cached.data_size) == cached.data_size)
+    {
+        bmp->width = cached.width;
+        bmp->height = cached.height;
+#if (LCD_DEPTH > 1) || defined(HAVE_REMOTE_LCD) && (LCD_REMOTE_DEPTH > 1)
+        bmp->format = cached.format;
+#endif
+#ifdef HAVE_LCD_COLOR
+        bmp->alpha_offset = cached.alpha_offset;
+#endif
+        rc = cached.data_size;
+    }
+
+    close(fd);
+    return rc;
+}
+
+/* Store a freshly decoded bitmap in its slot */
+static void thumb_save(struct thumb_header *hdr, const struct bitmap *bmp,
+                       int size)
+{
+    char thumbpath[MAX_PATH];
+
+    hdr->width = bmp->width;
+    hdr->height = bmp->height;
+#if (LCD_DEPTH > 1) || defined(HAVE_REMOTE_LCD) && (LCD_REMOTE_DEPTH > 1)
+    hdr->format = bmp->format;
+#endif
+#ifdef HAVE_LCD_COLOR
+    hdr->alpha_offset = bmp->alpha_offset;
+#endif
+    hdr->data_size = size;
+
+    thumb_get_path(thumbpath, sizeof(thumbpath), hdr);
+    int fd = open(thumbpath, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0 && mkdir(ALBUMART_THUMB_DIR) == 0)
+        fd = open(thumbpath, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0)
+        return;
+
+    bool ok = write(fd, hdr, sizeof(*hdr)) == (ssize_t)sizeof(*hdr) &&
+              write(fd, bmp->data, size) == size;
+    close(fd);
+    if (!ok)
+        remove(thumbpath);
+}
+
+/* The last decoded bitmap that has no thumbnail yet; a newer one replaces
+   it if buffering wasn't idle in between. Protected by llist_mutex. */
+static struct
+{
+    int handle_id;
+    struct thumb_header hdr;
+} thumb_pending = { .handle_id = ERR_HANDLE_NOT_FOUND };
+
+/* Write the pending thumbnail if its handle is still around. Call only from
+   the buffering thread, which is the only one closing or moving handles. */
+static void thumb_save_pending(void)
+{
+    struct thumb_header hdr;
+    struct memory_handle *h = NULL;
+
+    mutex_lock(&llist_mutex);
+    if (thumb_pending.handle_id >= 0) {
+        h = find_handle(thumb_pending.handle_id);
+        hdr = thumb_pending.hdr;
+        thumb_pending.handle_id = ERR_HANDLE_NOT_FOUND;
+    }
+    mutex_unlock(&llist_mutex);
+
+    if (h && h->type == TYPE_BITMAP)
+        thumb_save(&hdr, ringbuf_ptr(h->data),
+                   h->filesize - sizeof(struct bitmap));
+}
+
 /* Given a file descriptor to a bitmap file, write the bitmap data to the
    buffer, with a struct bitmap and the actual data immediately following.
    Return value is the total size (struct + data). */
 static int load_image(int fd, const char *path,
                       struct bufopen_bitmap_data *data,
-                      size_t bufidx)
+                      size_t bufidx, int handle_id)
 {
     int rc;
     struct bitmap *bmp = ringbuf_ptr(bufidx);
@@ -846,6 +1328,12 @@ static int load_image(int fd, const char *path,
     int free = (int)MIN(buffer_len - buf_used(), buffer_len - bufidx)
                         - sizeof(struct bitmap);
 
+    struct thumb_header thumb;
+    thumb_init_header(&thumb, fd, path, data);
+    rc = thumb_load(&thumb, bmp, free);
+    if (rc > 0)
+        return rc + sizeof(struct bitmap);
+
 #ifdef HAVE_JPEG
     if (aa != NULL) {
         lseek(fd, aa->pos, SEEK_SET);
@@ -860,8 +1348,15 @@ static int load_image(int fd, const char *path,
         rc = read_bmp_fd(fd, bmp, free, FORMAT_NATIVE|FORMAT_DITHER|
                          FORMAT_RESIZE|FORMAT_KEEP_ASPECT, NULL);
 
+    if (rc > 0) {
+        /* bufopen holds the lock already; it nests */
+        mutex_lock(&llist_mutex);
+        thumb_pending.hdr = thumb;
+        thumb_pending.handle_id = handle_id;
+        mutex_unlock(&llist_mutex);
+    }
+
     return rc + (rc > 0 ? sizeof(struct bitmap) : 0);
-    (void)path;
 }
 #endif /* HAVE_ALBUMART */
 
@@ -884,6 +1379,141 @@ management functions for all the actual handle management work.
 */
 
 
+#ifdef BUFFERING_MMAP
+static struct sigaction old_sigbus;
+static uintptr_t page_mask;
+
+/* A file that is truncated while it's mapped faults with SIGBUS past its new
+   end. Zeros are mapped over the rest of a mapping that faults, so the codec
+   reads silence or garbage until check_mapped_size() notices the new size,
+   instead of taking the program down. Faults anywhere else go to whatever
+   handler there was before. */
+static void mapping_fault(int sig, siginfo_t *si, void *context)
+{
+    const char *addr = si->si_addr;
+
+    for (int i = 0; i < BUF_MAX_HANDLES; i++) {
+        const char *start = mappings[i].start;
+        if (!start || addr < start || addr >= start + mappings[i].len)
+            continue;
+
+        const char *page = (const char *)((uintptr_t)addr & ~page_mask);
+        if (mmap((void *)page, start + mappings[i].len - page, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+            return;
+
+        break;
+    }
+
+    /* Not ours: the access faults again with the old handler in place */
+    sigaction(SIGBUS, &old_sigbus, NULL);
+    (void)sig; (void)context;
+}
+
+static void mapping_fault_init(void)
+{
+    struct sigaction sa;
+
+    page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = mapping_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &old_sigbus);
+}
+
+/* Clip a mapped handle to the size of its file, if that shrank. Data that
+   isn't in the file anymore isn't handed out. */
+static void check_mapped_size(struct memory_handle *h)
+{
+    struct stat st;
+    if (h->fd < 0 || fstat(h->fd, &st) < 0 || st.st_size >= h->filesize)
+        return;
+
+    logf("mapped hdl %d truncated to %ld", h->id, (long)st.st_size);
+
+    h->filesize = st.st_size;
+    h->end = st.st_size;
+    if (h->pos > h->filesize)
+        h->pos = h->filesize;
+}
+
+/* Open a handle serving the data of a regular file straight from a mapping
+   of it. Nothing is copied and the buffering thread has no work to do for
+   it besides sending the finished event. The handle keeps the file open to
+   notice when it gets shorter.
+   Return the handle id, ERR_UNSUPPORTED_TYPE if the file can't be mapped or
+   any other error of bufopen. */
+static int bufopen_mapped(int fd, const char *file, size_t size,
+                          size_t offset, enum data_type type)
+{
+    struct stat st;
+    if (size == 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        (off_t)size != st.st_size || mapped_bytes + size > BUFFERING_MMAP_MAX ||
+        !page_mask)
+        return ERR_UNSUPPORTED_TYPE;
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        logf("bufopen: mmap failed");
+        return ERR_UNSUPPORTED_TYPE;
+    }
+
+    if (type == TYPE_PACKET_AUDIO)
+        posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    if (offset > size)
+        offset = 0;
+
+    int handle_id = ERR_BUFFER_FULL;
+    size_t data;
+
+    mutex_lock(&llist_mutex);
+
+    struct memory_handle *h = NULL;
+    if (add_mapping(map, size)) {
+        h = add_handle(H_MAPPED, 0, &data);
+        if (!h)
+            remove_mapping(map);
+    }
+
+    if (h) {
+        handle_id = h->id;
+
+        h->type     = type;
+        strlcpy(h->path, file, MAX_PATH);
+        h->fd       = fd;
+        h->map      = map;
+        h->maplen   = size;
+        h->data     = data;
+        h->ridx     = data;
+        h->widx     = data;
+        h->filesize = size;
+        h->start    = 0;
+        h->pos      = offset;
+        h->end      = size;
+
+        link_cur_handle(h);
+        mapped_bytes += size;
+    }
+
+    mutex_unlock(&llist_mutex);
+
+    if (handle_id < 0) {
+        munmap(map, size);
+        return handle_id;
+    }
+
+    /* Have the buffering thread send the finished event */
+    LOGFQUEUE("buffering > Q_BUFFER_HANDLE %d", handle_id);
+    queue_post(&buffering_queue, Q_BUFFER_HANDLE, handle_id);
+
+    logf("bufopen: new mapped hdl %d", handle_id);
+    return handle_id;
+}
+#endif /* BUFFERING_MMAP */
+
 /* Reserve space in the buffer for a file.
    filename: name of the file to open
    offset: offset at which to start buffering the file, useful when the first
@@ -959,6 +1589,21 @@ int bufopen(const char *file, size_t offset, enum data_type type,
     if (size == 0)
         size = filesize(fd);
 
+#ifdef BUFFERING_MMAP
+    if (type == TYPE_PACKET_AUDIO || type == TYPE_ATOMIC_AUDIO) {
+        handle_id = bufopen_mapped(fd, file, size, offset, type);
+        if (handle_id != ERR_UNSUPPORTED_TYPE) {
+            /* The mapped handle keeps the file open */
+            if (handle_id < 0)
+                close(fd);
+            return handle_id;
+        }
+
+        /* Buffer it the usual way */
+        handle_id = ERR_BUFFER_FULL;
+    }
+#endif /* BUFFERING_MMAP */
+
     unsigned int hflags = 0;
     if (type == TYPE_PACKET_AUDIO || type == TYPE_CODEC)
         hflags = H_CANWRAP;
@@ -1006,7 +1651,7 @@ int bufopen(const char *file, size_t offset, enum data_type type,
 #ifdef HAVE_ALBUMART
     if (type == TYPE_BITMAP) {
         /* Bitmap file: we load the data instead of the file */
-        int rc = load_image(fd, file, user_data, data);
+        int rc = load_image(fd, file, user_data, data, handle_id);
         if (rc <= 0) {
             handle_id = ERR_FILE_ERROR;
         } else {
@@ -1202,6 +1847,12 @@ static void rebuffer_handle(int handle_id, off_t newpos)
 /* Backend to bufseek and bufadvance */
 static int seek_handle(struct memory_handle *h, off_t newpos)
 {
+    if (h->flags & H_MAPPED) {
+        /* All of the file is there */
+        h->pos = newpos;
+        return 0;
+    }
+
     if ((newpos < h->start || newpos >= h->end) &&
         (newpos < h->filesize || h->end < h->filesize)) {
         /* access before or after buffered data and not to end of file or file
@@ -1279,6 +1930,11 @@ static struct memory_handle *prep_bufdata(int handle_id, size_t *size,
     if (!h)
         return NULL;
 
+#ifdef BUFFERING_MMAP
+    if (h->flags & H_MAPPED)
+        check_mapped_size(h);
+#endif
+
     if (h->pos >= h->filesize) {
         /* File is finished reading */
         *size = 0;
@@ -1291,7 +1947,8 @@ static struct memory_handle *prep_bufdata(int handle_id, size_t *size,
     if (realsize <= 0 || realsize > filerem)
         realsize = filerem; /* clip to eof */
 
-    if (guardbuf_limit && realsize > GUARD_BUFSIZE) {
+    if (guardbuf_limit && realsize > GUARD_BUFSIZE &&
+        !(h->flags & H_MAPPED)) {
         logf("data request > guardbuf");
         /* If more than the size of the guardbuf is requested and this is a
          * bufgetdata, limit to guard_bufsize over the end of the buffer */
@@ -1358,6 +2015,13 @@ ssize_t bufread(int handle_id, size_t size, void *dest)
     if (!h)
         return ERR_HANDLE_NOT_FOUND;
 
+#ifdef BUFFERING_MMAP
+    if (h->flags & H_MAPPED) {
+        memcpy(dest, h->map + h->pos, size);
+        return size;
+    }
+#endif
+
     if (h->ridx + size > buffer_len) {
         /* the data wraps around the end of the buffer */
         size_t read = buffer_len - h->ridx;
@@ -1386,6 +2050,16 @@ ssize_t bufgetdata(int handle_id, size_t size, void **data)
     if (!h)
         return ERR_HANDLE_NOT_FOUND;
 
+#ifdef BUFFERING_MMAP
+    if (h->flags & H_MAPPED) {
+        /* The mapping is linear, no need for the guard buffer */
+        if (data)
+            *data = (void *)(h->map + h->pos);
+
+        return size;
+    }
+#endif
+
     if (h->ridx + size > buffer_len) {
         /* the data wraps around the end of the buffer :
            use the guard buffer to provide the requested amount of data. */
@@ -1411,10 +2085,21 @@ ssize_t bufgettail(int handle_id, size_t size, void **data)
     if (size > GUARD_BUFSIZE)
         return ERR_INVALID_VALUE;
 
-    const struct memory_handle *h = find_handle(handle_id);
+    struct memory_handle *h = find_handle(handle_id);
     if (!h)
         return ERR_HANDLE_NOT_FOUND;
 
+#ifdef BUFFERING_MMAP
+    if (h->flags & H_MAPPED) {
+        check_mapped_size(h);
+        if ((off_t)size > h->filesize)
+            return ERR_INVALID_VALUE;
+
+        *data = (void *)(h->map + h->filesize - size);
+        return size;
+    }
+#endif
+
     if (h->end >= h->filesize) {
         size_t tidx = ringbuf_sub(h->widx, size);
 
@@ -1447,7 +2132,8 @@ ssize_t bufcuttail(int handle_id, size_t size)
         if (available < size)
             size = available;
 
-        h->widx = ringbuf_sub(h->widx, size);
+        if (!(h->flags & H_MAPPED))
+            h->widx = ringbuf_sub(h->widx, size);
         h->filesize -= size;
         h->end -= size;
     } else {
@@ -1579,9 +2265,42 @@ static void shrink_buffer_inner(struct memory_handle *h)
 static void shrink_buffer(void)
 {
     logf("shrink_buffer()");
+    finish_read();
     shrink_buffer_inner(first_handle);
 }
 
+/* Measure how fast the buffered data is consumed and set the idle interval
+   so the level is checked again about halfway to the watermark. This saves
+   wakeups while the buffer is comfortably full. */
+static void update_drain_rate(bool filling)
+{
+    long now = current_tick;
+    size_t useful = data_counters.useful;
+    long ticks = now - drain.tick;
+
+    if (filling || useful >= drain.useful) {
+        /* Data was added or playback is paused, start over */
+        drain.useful = useful;
+        drain.tick = now;
+    } else if (ticks >= HZ/2 && useful < drain.useful) {
+        unsigned long rate = (uint64_t)(drain.useful - useful) * HZ / ticks;
+        drain.rate = drain.rate ? (drain.rate + rate) / 2 : rate;
+        drain.useful = useful;
+        drain.tick = now;
+    }
+
+    long poll = BUFFERING_MIN_POLL;
+    size_t watermark = BUF_WATERMARK;
+
+    if (drain.rate && useful > watermark) {
+        uint64_t ahead = (uint64_t)(useful - watermark) * HZ / drain.rate;
+        poll = MIN(ahead / 2, BUFFERING_MAX_POLL);
+        poll = MAX(poll, BUFFERING_MIN_POLL);
+    }
+
+    drain.poll = poll;
+}
+
 static void NORETURN_ATTR buffering_thread(void)
 {
     bool filling = false;
@@ -1593,7 +2312,10 @@ static void NORETURN_ATTR buffering_thread(void)
             if (!filling) {
                 cancel_cpu_boost();
             }
-            queue_wait_w_tmo(&buffering_queue, &ev, filling ? 1 : HZ/2);
+            /* A read in flight always ends with Q_READ_DONE */
+            queue_wait_w_tmo(&buffering_queue, &ev,
+                             read_pending ? TIMEOUT_BLOCK :
+                             (filling ? 1 : drain.poll));
         } else {
             filling = false;
             cancel_cpu_boost();
@@ -1629,6 +2351,7 @@ static void NORETURN_ATTR buffering_thread(void)
                     (struct buf_message_data *)ev.data;
                 LOGFQUEUE("buffering < Q_REBUFFER_HANDLE %d %ld",
                           parm->handle_id, parm->data);
+                finish_read();
                 rebuffer_handle(parm->handle_id, parm->data);
                 break;
                 }
@@ -1638,12 +2361,41 @@ static void NORETURN_ATTR buffering_thread(void)
                 queue_reply(&buffering_queue, close_handle((int)ev.data));
                 break;
 
+            case Q_DROP_READ:
+                LOGFQUEUE("buffering < Q_DROP_READ");
+                drop_read(read_handle_id);
+                queue_reply(&buffering_queue, 1);
+                break;
+
             case Q_HANDLE_ADDED:
                 LOGFQUEUE("buffering < Q_HANDLE_ADDED %d", (int)ev.data);
                 /* A handle was added: the disk is spinning, so we can fill */
                 filling = true;
                 break;
 
+            case Q_READ_DONE:
+            {
+                LOGFQUEUE("buffering < Q_READ_DONE");
+                /* It may have been waited for and accounted already */
+                if (!read_pending || !read_req.done)
+                    break;
+
+                int handle_id = read_handle_id;
+                bool more = finish_read();
+
+                /* Read the next chunk unless there is something else to
+                   do first, like the read loop did */
+                if (more && queue_empty(&buffering_queue))
+                    more = buffer_handle(handle_id, 0) || read_pending;
+
+                if (!more && filling) {
+                    /* No space left: end the fill like fill_buffer() */
+                    storage_sleep();
+                    filling = false;
+                }
+                break;
+                }
+
             case SYS_TIMEOUT:
                 LOGFQUEUE_SYS_TIMEOUT("buffering < SYS_TIMEOUT");
                 break;
@@ -1653,6 +2405,7 @@ static void NORETURN_ATTR buffering_thread(void)
             continue;
 
         update_data_counters(NULL);
+        update_drain_rate(filling);
 #if 0
         /* TODO: This needs to be fixed to use the idle callback, disable it
          * for simplicity until its done right */
@@ -1689,6 +2442,10 @@ static void NORETURN_ATTR buffering_thread(void)
                     filling = fill_buffer();
                 }
             }
+#ifdef HAVE_ALBUMART
+            if (!filling && !read_pending)
+                thumb_save_pending();
+#endif
         }
     }
 }
@@ -1697,6 +2454,17 @@ void INIT_ATTR buffering_init(void)
 {
     mutex_init(&llist_mutex);
 
+    for (int i = 0; i < NUM_DRIVES; i++)
+        storage_rates[i].chunk = BUFFERING_DEFAULT_FILECHUNK;
+
+    drain.poll = BUFFERING_MIN_POLL;
+
+    file_async_init();
+
+#ifdef BUFFERING_MMAP
+    mapping_fault_init();
+#endif
+
     /* Thread should absolutely not respond to USB because if it waits first,
        then it cannot properly service the handles and leaks will happen -
        this is a worker thread and shouldn't need to care about any system
@@ -1738,13 +2506,22 @@ bool buffering_reset(char *buf, size_t buflen)
     while (num_handles != 0)
         bufclose(first_handle->id);
 
+    /* Closing a handle drops its read, but don't let anything land in the
+       buffer once it's handed over. With no handles left, no new read can
+       start. */
+    if (read_pending) {
+        LOGFQUEUE("buffering >| Q_DROP_READ");
+        queue_send(&buffering_queue, Q_DROP_READ, 0);
+    }
+
     buffer = buf;
     buffer_len = buflen;
     guard_buffer = buf + buflen;
 
     first_handle = NULL;
     cur_handle = NULL;
-    cached_handle = NULL;
+    for (int i = 0; i < HANDLE_TABLE_SIZE; i++)
+        handle_table[i] = NULL;
     num_handles = 0;
     base_handle_id = -1;
 
@@ -1769,4 +2546,8 @@ void buffering_get_debugdata(struct buffering_debug *dbgdata)
     dbgdata->buffered_data = dc.buffered;
     dbgdata->useful_data = dc.useful;
     dbgdata->watermark = BUF_WATERMARK;
+    dbgdata->chunk_size = last_rate->chunk;
+    dbgdata->bandwidth = last_rate->bandwidth;
+    dbgdata->drain_rate = drain.rate;
+    dbgdata->poll_ticks = drain.poll;
 }
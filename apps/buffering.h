@@ -123,6 +123,10 @@ struct buffering_debug {
     size_t data_rem;
     size_t useful_data;
     size_t watermark;
+    size_t chunk_size;          /* Current read size */
+    unsigned long bandwidth;    /* Measured storage throughput in bytes/s */
+    unsigned long drain_rate;   /* Measured data consumption in bytes/s */
+    long poll_ticks;            /* Interval between idle level checks */
 };
 void buffering_get_debugdata(struct buffering_debug *dbgdata);
 
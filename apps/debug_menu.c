@@ -48,6 +48,9 @@
 #include "splash.h"
 #include "shortcuts.h"
 #include "dircache.h"
+#ifdef HAVE_ALBUMART
+#include "albumart.h"
+#endif
 #include "viewport.h"
 #ifdef HAVE_TAGCACHE
 #include "tagcache.h"
@@ -64,6 +67,7 @@
 #include "rtc.h"
 #include "storage.h"
 #include "fat.h"
+#include "disk_cache.h"
 #include "eeprom_24cxx.h"
 #if (CONFIG_STORAGE & STORAGE_MMC) || (CONFIG_STORAGE & STORAGE_SD)
 #include "sdmmc.h"
@@ -483,6 +487,10 @@ static bool dbg_buffering_thread(void)
                              pcmbuf_used_descs(), pcmbufdescs);
             screens[i].putsf(0, line++, "watermark: %6d",
                              (int)(d.watermark));
+            screens[i].putsf(0, line++, "chunk: %dK rate: %ldK/s",
+                             (int)(d.chunk_size / 1024), d.bandwidth / 1024);
+            screens[i].putsf(0, line++, "drain: %ldK/s poll: %ldms",
+                             d.drain_rate / 1024, d.poll_ticks * 1000 / HZ);
 
             screens[i].update();
         }
@@ -540,6 +548,42 @@ static bool dbg_buflib_allocs(void)
     return simplelist_show_list(&info);
 }
 
+static int bf_compact_cb(int action, struct gui_synclist* list)
+{
+    (void)list;
+    const struct buflib_compact_stats *stats = core_get_compact_stats();
+
+    if (action == ACTION_STD_OK)
+    {
+        splash(HZ/2, "Compacting a slice");
+        core_compact_slice();
+    }
+
+    simplelist_set_line_count(0);
+    simplelist_addline("Full runs: %lu", stats->runs);
+    simplelist_addline("Slices: %lu", stats->slices);
+    simplelist_addline("Blocks moved: %lu", stats->blocks_moved);
+    simplelist_addline("Bytes moved: %lu KiB", stats->bytes_moved >> 10);
+    simplelist_addline("Worst pause: %lu B", (unsigned long)stats->max_pause);
+    simplelist_addline("Free: %lu KiB",
+                       (unsigned long)core_available() >> 10);
+
+    if (action == ACTION_NONE)
+        action = ACTION_REDRAW;
+    return action;
+}
+
+static bool dbg_buflib_compaction(void)
+{
+    struct simplelist_info info;
+    simplelist_info_init(&info, "buflib compaction", 0, NULL);
+    info.action_callback = bf_compact_cb;
+    info.hide_selection = true;
+    info.scroll_all = true;
+    info.timeout = HZ;
+    return simplelist_show_list(&info);
+}
+
 #if (CONFIG_PLATFORM & PLATFORM_NATIVE)
 static const char* dbg_partitions_getname(int selected_item, void *data,
                                           char *buffer, size_t buffer_len)
@@ -1771,6 +1815,43 @@ static bool dbg_disk_info(void)
     info.scroll_all = true;
     return simplelist_show_list(&info);
 }
+
+static int disk_cache_callback(int btn, struct gui_synclist *lists)
+{
+    struct dc_stats stats;
+    dc_get_stats(&stats);
+
+    simplelist_set_line_count(0);
+
+    unsigned long probes = stats.hits + stats.misses;
+    unsigned int hitrate = probes ? 1000ull*stats.hits / probes : 0;
+    simplelist_addline("Entries: %u (%u free)", stats.entries,
+                       stats.lru_entries);
+    simplelist_addline("Buckets: %u", stats.buckets);
+    simplelist_addline("Hits: %lu (%u.%u%%)", stats.hits,
+                       hitrate / 10, hitrate % 10);
+    simplelist_addline("Misses: %lu", stats.misses);
+    simplelist_addline("Evictions: %lu", stats.evictions);
+    simplelist_addline("Writebacks: %lu", stats.writebacks);
+    simplelist_addline("Read ahead: %lu (%lu used)", stats.readahead,
+                       stats.readahead_hits);
+
+    if (btn == ACTION_NONE)
+        btn = ACTION_REDRAW;
+
+    return btn;
+    (void)lists;
+}
+
+static bool dbg_disk_cache(void)
+{
+    struct simplelist_info info;
+    simplelist_info_init(&info, "Disk Cache", 7, NULL);
+    info.action_callback = disk_cache_callback;
+    info.hide_selection = true;
+    info.scroll_all = true;
+    return simplelist_show_list(&info);
+}
 #endif /* PLATFORM_NATIVE */
 
 #ifdef HAVE_DIRCACHE
@@ -1821,6 +1902,13 @@ static int dircache_callback(int btn, struct gui_synclist *lists)
     simplelist_addline("Scanning took: %ld.%ld s",
                        ticks / HZ, (ticks*10 / HZ) % 10);
     simplelist_addline("Entry count: %u", info.entry_count);
+#ifdef HAVE_ALBUMART
+    struct albumart_cache_stats aa_stats;
+    albumart_get_cache_stats(&aa_stats);
+    simplelist_addline("Album art dirs: %lu hits, %lu misses",
+                       aa_stats.hits, aa_stats.misses);
+    simplelist_addline("Album art probes saved: %lu", aa_stats.probes_saved);
+#endif /* HAVE_ALBUMART */
 
     if (btn == ACTION_NONE)
         btn = ACTION_REDRAW;
@@ -1867,6 +1955,12 @@ static int database_callback(int btn, struct gui_synclist *lists)
              stat->commit_step);
     simplelist_addline("Commit delayed: %s",
              stat->commit_delayed ? "Yes" : "No");
+    simplelist_addline("Last commit: %ld ms (%d merged)",
+             stat->commit_ticks * 1000 / HZ, stat->commit_merged);
+    simplelist_addline(" Tags/Numeric/Hash: %ld/%ld/%ld ms",
+             stat->commit_index_ticks * 1000 / HZ,
+             stat->commit_numeric_ticks * 1000 / HZ,
+             stat->commit_hash_ticks * 1000 / HZ);
 
     simplelist_addline("Queue length: %d",
              stat->queue_length);
@@ -2510,6 +2604,8 @@ static bool dbg_skin_engine(void)
                         stats->images_size);
                 simplelist_addline("\tTotal: %d bytes",
                         stats->tree_size + stats->images_size);
+                simplelist_addline("\tLines: %lu drawn, %lu skipped",
+                        stats->lines_drawn, stats->lines_skipped);
                 total += stats->tree_size + stats->images_size;
             }
         }
@@ -2592,6 +2688,7 @@ static const struct {
 #endif
 #if (CONFIG_PLATFORM & PLATFORM_NATIVE)
         { "View disk info", dbg_disk_info },
+        { "View disk cache", dbg_disk_cache },
 #if (CONFIG_STORAGE & STORAGE_ATA)
         { "Dump ATA identify info", dbg_identify_info},
 #ifdef HAVE_ATA_SMART
@@ -2617,6 +2714,7 @@ static const struct {
 #endif /* PM_DEBUG */
 #endif /* HAVE_LCD_BITMAP */
         { "View buflib allocs", dbg_buflib_allocs },
+        { "View buflib compaction", dbg_buflib_compaction },
 #ifndef SIMULATOR
 #if CONFIG_TUNER
         { "FM Radio", dbg_fm_radio },
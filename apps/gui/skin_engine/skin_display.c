@@ -74,7 +74,8 @@
 #include "statusbar-skinned.h"
 #include "skin_display.h"
 
-void skin_render(struct gui_wps *gwps, unsigned refresh_mode);
+void skin_render(struct gui_wps *gwps, unsigned refresh_mode,
+                 struct skin_stats *stats);
 
 /* update a skinned screen, update_type is WPS_REFRESH_* values.
  * Usually it should only be WPS_REFRESH_NON_STATIC
@@ -92,7 +93,8 @@ void skin_update(enum skinnable_screens skin, enum screen_type screen,
         skin_request_full_update(skin);
  
     skin_render(gwps, skin_do_full_update(skin, screen) ? 
-                        SKIN_REFRESH_ALL : update_type);
+                        SKIN_REFRESH_ALL : update_type,
+                skin_get_stats(skin, screen));
 }
 
 #ifdef HAVE_LCD_BITMAP
@@ -51,6 +51,8 @@
 #else
 #include "debug.h"
 #include "language.h"
+#include "crc32.h"
+#include "version.h"
 #endif /*__PCTOOL__*/
 
 #include <ctype.h>
@@ -2389,6 +2391,7 @@ static int skin_element_callback(struct skin_element* element, void* data)
         {
             curr_line = skin_buffer_alloc(sizeof(*curr_line));
             curr_line->update_mode = SKIN_REFRESH_STATIC;
+            curr_line->drawn_crc = 0;
             element->data = PTRTOSKINOFFSET(skin_buffer, curr_line);
         }
         break;
@@ -2423,12 +2426,347 @@ static int skin_element_callback(struct skin_element* element, void* data)
     return CALLBACK_OK;
 }
 
+#if defined(HAVE_LCD_BITMAP) && (CONFIG_PLATFORM & PLATFORM_NATIVE) \
+    && !defined(__PCTOOL__)
+/*
+ * Parsed skins are cached in SKIN_CACHE_DIR as an image of the skin buffer
+ * taken straight after the parse, in a file named after a crc of the skin's
+ * path. Everything in the buffer refers to the rest of it by offset, so the
+ * image is loaded with a single read and the text parse is skipped. The
+ * only absolute pointers left point into the firmware image (tag table,
+ * settings list), which is pinned by the version and anchor checks in the
+ * header. Hosted builds may be loaded at a different address every time, so
+ * they always parse.
+ */
+#include "dir.h"
+
+#define SKIN_CACHE
+#define SKIN_CACHE_MAGIC    0x534b4302 /* "SKC" + version */
+/* Skins kept at most, the ones saved longest ago are removed first */
+#define SKIN_CACHE_MAX_FILES 16
+
+#define SKIN_CACHE_BACKDROP_NONE    (-1)
+#define SKIN_CACHE_BACKDROP_DEFAULT (-2)
+#define SKIN_CACHE_BACKDROP_BUFFER  (-3)
+
+struct skin_cache_header {
+    uint32_t magic;
+    char path[MAX_PATH];    /* the skin file */
+    uint32_t version_crc;   /* crc of rbversion */
+    uintptr_t anchor;       /* address of settings[] in this build */
+    uint32_t source_crc;    /* crc of the skin text */
+    uint32_t context_crc;   /* crc of everything else the parse reads */
+    uint32_t size;          /* bytes of skin buffer following the header */
+    struct wps_data data;
+    long font_names[MAXUSERFONTS];
+    int font_glyphs[MAXUSERFONTS];
+#ifdef HAVE_BACKDROP_IMAGE
+    long backdrop;
+#endif
+};
+
+/* settings and state that the parse results depend on besides the text */
+static uint32_t skin_cache_context_crc(enum screen_type screen)
+{
+    struct {
+        struct viewport vp;
+        int screen;
+        int glyphs;
+        bool rtl;
+        /* progress bars in UI font viewports take its height while parsing */
+        char font[NB_SCREENS][MAX_FILENAME+1];
+        int font_height[NB_SCREENS];
+#ifdef HAVE_LCD_COLOR
+        unsigned lss, lse, lst;
+#endif
+#if CONFIG_TUNER
+        bool radio;
+#endif
+    } ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    viewport_set_defaults(&ctx.vp, screen);
+    ctx.vp.font = 0; /* assigned after loading, not while parsing */
+    ctx.screen = screen;
+    ctx.glyphs = global_settings.glyphs_to_cache;
+    ctx.rtl = lang_is_rtl();
+    strlcpy(ctx.font[SCREEN_MAIN], global_settings.font_file,
+            sizeof(ctx.font[SCREEN_MAIN]));
+#ifdef HAVE_REMOTE_LCD
+    strlcpy(ctx.font[SCREEN_REMOTE], global_settings.remote_font_file,
+            sizeof(ctx.font[SCREEN_REMOTE]));
+#endif
+    FOR_NB_SCREENS(i)
+        ctx.font_height[i] = font_get(screens[i].getuifont())->height;
+#ifdef HAVE_LCD_COLOR
+    ctx.lss = global_settings.lss_color;
+    ctx.lse = global_settings.lse_color;
+    ctx.lst = global_settings.lst_color;
+#endif
+#if CONFIG_TUNER
+    ctx.radio = radio_hardware_present();
+#endif
+    return crc_32(&ctx, sizeof(ctx), 0xffffffff);
+}
+
+/* bm.data holds the image filename until the bitmaps are loaded */
+static void skin_cache_fixup_images(struct wps_data *wps_data, bool to_offsets)
+{
+    struct skin_token_list *list = SKINOFFSETTOPTR(skin_buffer, wps_data->images);
+    while (list)
+    {
+        struct wps_token *token = SKINOFFSETTOPTR(skin_buffer, list->token);
+        struct gui_img *img = (struct gui_img*)SKINOFFSETTOPTR(skin_buffer, token->value.data);
+        if (to_offsets)
+            img->bm.data = (void *)PTRTOSKINOFFSET(skin_buffer, img->bm.data);
+        else
+            img->bm.data = SKINOFFSETTOPTR(skin_buffer, (long)img->bm.data);
+        list = SKINOFFSETTOPTR(skin_buffer, list->next);
+    }
+}
+
+/* line alternators keep the tick they were created at */
+static void skin_cache_reset_ticks(struct skin_element *element)
+{
+    for (; element; element = SKINOFFSETTOPTR(skin_buffer, element->next))
+    {
+        OFFSETTYPE(struct skin_element*) *children =
+                SKINOFFSETTOPTR(skin_buffer, element->children);
+        int i;
+
+        if (element->type == LINE_ALTERNATOR)
+        {
+            struct line_alternator *alternator =
+                    SKINOFFSETTOPTR(skin_buffer, element->data);
+            alternator->next_change_tick = current_tick;
+        }
+        for (i = 0; i < element->children_count; i++)
+            skin_cache_reset_ticks(SKINOFFSETTOPTR(skin_buffer, children[i]));
+    }
+}
+
+/* mute regions remember the volume to go back to, starting at the current */
+static void skin_cache_reset_touchregions(struct wps_data *wps_data)
+{
+#ifdef HAVE_TOUCHSCREEN
+    struct skin_token_list *regions =
+            SKINOFFSETTOPTR(skin_buffer, wps_data->touchregions);
+    while (regions)
+    {
+        struct wps_token *token = SKINOFFSETTOPTR(skin_buffer, regions->token);
+        struct touchregion *region = SKINOFFSETTOPTR(skin_buffer, token->value.data);
+        if (region->action == ACTION_TOUCH_MUTE)
+            region->value = global_settings.volume;
+        regions = SKINOFFSETTOPTR(skin_buffer, regions->next);
+    }
+#else
+    (void)wps_data;
+#endif
+}
+
+static void skin_cache_get_path(char *buf, size_t bufsize, const char *path)
+{
+    snprintf(buf, bufsize, SKIN_CACHE_DIR "/%08lx.bin",
+             (unsigned long)crc_32(path, strlen(path), 0xffffffff));
+}
+
+static void skin_cache_init_header(struct skin_cache_header *hdr,
+                                   enum screen_type screen, const char *path,
+                                   const char *text, size_t len)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = SKIN_CACHE_MAGIC;
+    strlcpy(hdr->path, path, sizeof(hdr->path));
+    hdr->version_crc = crc_32(rbversion, strlen(rbversion), 0xffffffff);
+    hdr->anchor = (uintptr_t)settings;
+    hdr->source_crc = crc_32(text, len, 0xffffffff);
+    hdr->context_crc = skin_cache_context_crc(screen);
+}
+
+/* make room for cachefile by removing the cache files saved longest ago,
+ * leaving cachefile itself to be overwritten */
+static void skin_cache_prune(const char *cachefile)
+{
+    const char *name = strrchr(cachefile, '/') + 1;
+    char oldest[MAX_PATH];
+
+    while (1)
+    {
+        DIR *dir = opendir(SKIN_CACHE_DIR);
+        struct dirent *entry;
+        time_t oldest_mtime = 0;
+        int count = 0;
+
+        if (!dir)
+            return;
+
+        while ((entry = readdir(dir)))
+        {
+            struct dirinfo info = dir_get_info(dir, entry);
+            if ((info.attribute & ATTR_DIRECTORY) ||
+                !strcmp(entry->d_name, name))
+                continue;
+
+            if (count++ == 0 || info.mtime < oldest_mtime)
+            {
+                oldest_mtime = info.mtime;
+                snprintf(oldest, sizeof(oldest), SKIN_CACHE_DIR "/%s",
+                         entry->d_name);
+            }
+        }
+        closedir(dir);
+
+        if (count < SKIN_CACHE_MAX_FILES || remove(oldest) < 0)
+            return;
+    }
+}
+
+/* write the freshly parsed skin buffer, before any images or fonts are
+ * loaded into it */
+static void skin_cache_save(struct skin_cache_header *hdr,
+                            struct wps_data *wps_data)
+{
+    char cachefile[MAX_PATH];
+    int i, fd;
+    bool ok;
+
+    skin_cache_get_path(cachefile, sizeof(cachefile), hdr->path);
+
+    hdr->size = skin_buffer_usage();
+    hdr->data = *wps_data;
+    for (i = 0; i < MAXUSERFONTS; i++)
+    {
+        hdr->font_names[i] = PTRTOSKINOFFSET(skin_buffer, skinfonts[i].name);
+        hdr->font_glyphs[i] = skinfonts[i].glyphs;
+    }
+#ifdef HAVE_BACKDROP_IMAGE
+    if (!backdrop_filename)
+        hdr->backdrop = SKIN_CACHE_BACKDROP_NONE;
+    else if (!strcmp(backdrop_filename, "-"))
+        hdr->backdrop = SKIN_CACHE_BACKDROP_DEFAULT;
+    else if (!strcmp(backdrop_filename, BACKDROP_BUFFERNAME))
+        hdr->backdrop = SKIN_CACHE_BACKDROP_BUFFER;
+    else
+        hdr->backdrop = PTRTOSKINOFFSET(skin_buffer, backdrop_filename);
+#endif
+
+    skin_cache_prune(cachefile);
+
+    fd = open(cachefile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0 && mkdir(SKIN_CACHE_DIR) == 0)
+        fd = open(cachefile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0)
+        return;
+
+    skin_cache_fixup_images(wps_data, true);
+    ok = write(fd, hdr, sizeof(*hdr)) == (ssize_t)sizeof(*hdr) &&
+         write(fd, skin_buffer, hdr->size) == (ssize_t)hdr->size;
+    skin_cache_fixup_images(wps_data, false);
+
+    close(fd);
+    if (!ok)
+        remove(cachefile);
+}
+
+/* read a cached skin buffer matching hdr, returns false if there is none
+ * or it is stale so the text gets parsed instead */
+static bool skin_cache_load(const struct skin_cache_header *hdr,
+                            struct wps_data *wps_data, size_t buffersize)
+{
+    char cachefile[MAX_PATH];
+    struct skin_cache_header cached;
+    bool ok = false;
+    int i, fd;
+
+    skin_cache_get_path(cachefile, sizeof(cachefile), hdr->path);
+
+    fd = open(cachefile, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    if (read(fd, &cached, sizeof(cached)) == (ssize_t)sizeof(cached) &&
+        cached.magic == hdr->magic &&
+        !strcmp(cached.path, hdr->path) &&
+        cached.version_crc == hdr->version_crc &&
+        cached.anchor == hdr->anchor &&
+        cached.source_crc == hdr->source_crc &&
+        cached.context_crc == hdr->context_crc &&
+        cached.size <= buffersize &&
+        read(fd, skin_buffer, cached.size) == (ssize_t)cached.size)
+    {
+        ok = true;
+    }
+    close(fd);
+    if (!ok)
+        return false;
+
+    /* claim the cached bytes so later allocations go after them */
+    skin_buffer_alloc(cached.size);
+
+    wps_data->tree = cached.data.tree;
+    wps_data->images = cached.data.images;
+#ifdef HAVE_TOUCHSCREEN
+    wps_data->touchregions = cached.data.touchregions;
+#endif
+#ifdef HAVE_SKIN_VARIABLES
+    wps_data->skinvars = cached.data.skinvars;
+#endif
+#ifdef HAVE_BACKDROP_IMAGE
+    wps_data->use_extra_framebuffer = cached.data.use_extra_framebuffer;
+#endif
+    wps_data->peak_meter_enabled = cached.data.peak_meter_enabled;
+    wps_data->wps_sb_tag = cached.data.wps_sb_tag;
+    wps_data->show_sb_on_wps = cached.data.show_sb_on_wps;
+
+    for (i = 0; i < MAXUSERFONTS; i++)
+    {
+        skinfonts[i].id = -1;
+        skinfonts[i].name = SKINOFFSETTOPTR(skin_buffer, cached.font_names[i]);
+        skinfonts[i].glyphs = cached.font_glyphs[i];
+    }
+#ifdef HAVE_BACKDROP_IMAGE
+    if (cached.backdrop == SKIN_CACHE_BACKDROP_NONE)
+        backdrop_filename = NULL;
+    else if (cached.backdrop == SKIN_CACHE_BACKDROP_DEFAULT)
+        backdrop_filename = "-";
+    else if (cached.backdrop == SKIN_CACHE_BACKDROP_BUFFER)
+        backdrop_filename = BACKDROP_BUFFERNAME;
+    else
+        backdrop_filename = SKINOFFSETTOPTR(skin_buffer, cached.backdrop);
+#endif
+#ifdef HAVE_ALBUMART
+    wps_data->albumart = cached.data.albumart;
+    struct skin_albumart *aa = SKINOFFSETTOPTR(skin_buffer, wps_data->albumart);
+    if (aa)
+    {
+        struct dim dimensions;
+        int albumart_slot;
+
+        dimensions.width = aa->width;
+        dimensions.height = aa->height;
+        albumart_slot = playback_claim_aa_slot(&dimensions);
+        if (0 <= albumart_slot)
+            wps_data->playback_aa_slot = albumart_slot;
+    }
+#endif
+
+    skin_cache_fixup_images(wps_data, false);
+    skin_cache_reset_ticks(SKINOFFSETTOPTR(skin_buffer, wps_data->tree));
+    skin_cache_reset_touchregions(wps_data);
+    return true;
+}
+#endif /* HAVE_LCD_BITMAP && !__PCTOOL__ */
+
 /* to setup up the wps-data from a format-buffer (isfile = false)
    from a (wps-)file (isfile = true)*/
 bool skin_data_load(enum screen_type screen, struct wps_data *wps_data,
                     const char *buf, bool isfile, struct skin_stats *stats)
 {
     char *wps_buffer = NULL;
+#ifdef SKIN_CACHE
+    struct skin_cache_header cache_hdr;
+    bool cached = false;
+#endif
     if (!wps_data || !buf)
         return false;
 #ifdef HAVE_LCD_BITMAP
@@ -2484,6 +2822,9 @@ bool skin_data_load(enum screen_type screen, struct wps_data *wps_data,
         close(fd);
         if (start <= 0)
             return false;
+#ifdef SKIN_CACHE
+        skin_cache_init_header(&cache_hdr, screen, buf, wps_buffer, start);
+#endif
         start++;
         skin_buffer = &wps_buffer[start];
         buffersize -= start;
@@ -2501,15 +2842,26 @@ bool skin_data_load(enum screen_type screen, struct wps_data *wps_data,
 #endif
     /* parse the skin source */
     skin_buffer_init(skin_buffer, buffersize);
-    struct skin_element *tree = skin_parse(wps_buffer, skin_element_callback, wps_data);
-    wps_data->tree = PTRTOSKINOFFSET(skin_buffer, tree);
-    if (!SKINOFFSETTOPTR(skin_buffer, wps_data->tree)) {
+#ifdef SKIN_CACHE
+    if (isfile)
+        cached = skin_cache_load(&cache_hdr, wps_data, buffersize);
+    if (!cached)
+#endif
+    {
+        struct skin_element *tree = skin_parse(wps_buffer, skin_element_callback, wps_data);
+        wps_data->tree = PTRTOSKINOFFSET(skin_buffer, tree);
+        if (!SKINOFFSETTOPTR(skin_buffer, wps_data->tree)) {
 #ifdef DEBUG_SKIN_ENGINE
-        if (isfile && debug_wps)
-            skin_error_format_message();
+            if (isfile && debug_wps)
+                skin_error_format_message();
+#endif
+            skin_data_reset(wps_data);
+            return false;
+        }
+#ifdef SKIN_CACHE
+        if (isfile)
+            skin_cache_save(&cache_hdr, wps_data);
 #endif
-        skin_data_reset(wps_data);
-        return false;
     }
 
 #ifdef HAVE_LCD_BITMAP
@@ -50,6 +50,7 @@
 #include "root_menu.h"
 #include "misc.h"
 #include "list.h"
+#include "crc32.h"
 
 
 #define MAX_LINE 1024
@@ -67,6 +68,7 @@ struct skin_draw_info {
     bool line_scrolls;
     bool force_redraw;
     bool viewport_change;
+    bool drew_graphics; /* a bar, image or rectangle was drawn or cleared */
     
     char *buf;
     size_t buf_size;
@@ -86,6 +88,39 @@ static void skin_render_playlistviewer(struct playlistviewer* viewer,
 
 static char* skin_buffer;
 
+/* State of the current skin_render() pass. skin_render_viewport() is also
+ * used by the skinned lists, which leave stats NULL and redraw everything. */
+static struct {
+    struct skin_stats *stats;
+#ifdef HAVE_LCD_BITMAP
+    bool full_update;
+    int x1, y1, x2, y2;     /* damaged area in screen coordinates */
+#endif
+} render_pass;
+
+#ifdef HAVE_LCD_BITMAP
+static void add_damage(const struct viewport *vp,
+                       int x, int y, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    x += vp->x;
+    y += vp->y;
+    if (render_pass.x2 <= render_pass.x1)
+    {
+        render_pass.x1 = x;
+        render_pass.y1 = y;
+        render_pass.x2 = x + width;
+        render_pass.y2 = y + height;
+        return;
+    }
+    render_pass.x1 = MIN(render_pass.x1, x);
+    render_pass.y1 = MIN(render_pass.y1, y);
+    render_pass.x2 = MAX(render_pass.x2, x + width);
+    render_pass.y2 = MAX(render_pass.y2, y + height);
+}
+#endif
+
 static inline struct skin_element*
 get_child(OFFSETTYPE(struct skin_element**) children, int child)
 {
@@ -196,11 +231,15 @@ static bool do_non_text_tags(struct gui_wps *gwps, struct skin_draw_info *info,
         case SKIN_TOKEN_PEAKMETER:
             data->peak_meter_enabled = true;
             if (do_refresh)
+            {
                 draw_peakmeters(gwps, info->line_number, vp);
+                info->drew_graphics = true;
+            }
             break;
         case SKIN_TOKEN_DRAWRECTANGLE:
             if (do_refresh)
             {
+                info->drew_graphics = true;
                 struct draw_rectangle *rect =
                         SKINOFFSETTOPTR(skin_buffer, token->value.data);
 #ifdef HAVE_LCD_COLOR
@@ -240,7 +279,10 @@ static bool do_non_text_tags(struct gui_wps *gwps, struct skin_draw_info *info,
         {
             struct progressbar *bar = (struct progressbar*)SKINOFFSETTOPTR(skin_buffer, token->value.data);
             if (do_refresh)
+            {
                 draw_progressbar(gwps, info->line_number, bar);
+                info->drew_graphics = true;
+            }
         }
 #endif
         break;
@@ -284,6 +326,7 @@ static bool do_non_text_tags(struct gui_wps *gwps, struct skin_draw_info *info,
 
                     /* Clear the image, as in conditionals */
                     clear_image_pos(gwps, img);
+                    info->drew_graphics = true;
 
                     /* If the token returned a value which is higher than
                      * the amount of subimages, don't draw it. */
@@ -311,6 +354,7 @@ static bool do_non_text_tags(struct gui_wps *gwps, struct skin_draw_info *info,
                 }
 #endif
                 aa->draw_handle = handle;
+                info->drew_graphics = true;
             }
             break;
         }
@@ -319,11 +363,15 @@ static bool do_non_text_tags(struct gui_wps *gwps, struct skin_draw_info *info,
             gui_statusbar_draw(&(statusbars.statusbars[gwps->display->screen_type]),
                                info->refresh_type == SKIN_REFRESH_ALL,
                                SKINOFFSETTOPTR(skin_buffer, token->value.data));
+            info->drew_graphics = true;
             break;
         case SKIN_TOKEN_VIEWPORT_CUSTOMLIST:
             if (do_refresh)
+            {
                 skin_render_playlistviewer(SKINOFFSETTOPTR(skin_buffer, token->value.data), gwps,
                                            info->skin_vp, info->refresh_type);
+                info->drew_graphics = true;
+            }
             break;
         
 #endif /* HAVE_LCD_BITMAP */
@@ -368,6 +416,10 @@ static void do_tags_in_hidden_conditional(struct skin_element* branch,
 #endif
     /* Tags here are ones which need to be "turned off" or cleared 
      * if they are in a conditional branch which isnt being used */
+#ifdef HAVE_LCD_BITMAP
+    /* this can clear images and other viewports anywhere on the screen */
+    render_pass.full_update = true;
+#endif
     if (branch->type == LINE_ALTERNATOR)
     {
         int i;
@@ -719,6 +771,67 @@ bool skin_render_alternator(struct skin_element* element, struct skin_draw_info
     return changed_lines || ret;
 }
 
+/* The line data of the LINE that was just rendered for a top level line */
+static struct line *get_drawn_line(struct skin_element *line)
+{
+    if (line->type == LINE_ALTERNATOR)
+    {
+        struct line_alternator *alternator = SKINOFFSETTOPTR(skin_buffer, line->data);
+        line = get_child(line->children, alternator->current_line);
+    }
+    return SKINOFFSETTOPTR(skin_buffer, line->data);
+}
+
+/* crc of everything write_line() is about to put on the screen.
+ * The tokens of a line due for a refresh are still evaluated; only the
+ * drawing is skipped when the result is the same. Caching the token values
+ * themselves would need every source (id3, settings, battery, ...) to tell
+ * when a value changes, the update_mode of the line is all there is. */
+static uint32_t get_line_crc(struct skin_draw_info *info,
+                             struct skin_viewport *skin_viewport)
+{
+    struct align_pos *align = &info->align;
+    struct {
+        int line_number;
+        bool scrolls;
+        int16_t line, nlines;
+        enum line_styles style;
+        unsigned text_color, line_color, line_end_color;
+#ifdef HAVE_LCD_BITMAP
+        unsigned fg, bg;
+        int font;
+#endif
+    } attr;
+    uint32_t crc;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.line_number = info->line_number;
+    attr.scrolls = info->line_scrolls;
+    attr.line = info->line_desc.line;
+    attr.nlines = info->line_desc.nlines;
+    attr.style = info->line_desc.style;
+    attr.text_color = info->line_desc.text_color;
+    attr.line_color = info->line_desc.line_color;
+    attr.line_end_color = info->line_desc.line_end_color;
+#ifdef HAVE_LCD_BITMAP
+    attr.fg = skin_viewport->vp.fg_pattern;
+    attr.bg = skin_viewport->vp.bg_pattern;
+    attr.font = skin_viewport->vp.font;
+#else
+    (void)skin_viewport;
+#endif
+
+    crc = crc_32(&attr, sizeof(attr), 0xffffffff);
+    if (align->left)
+        crc = crc_32(align->left, strlen(align->left) + 1, crc);
+    if (align->center)
+        crc = crc_32(align->center, strlen(align->center) + 1, crc);
+    if (align->right)
+        crc = crc_32(align->right, strlen(align->right) + 1, crc);
+    /* 0 is kept to mean "not known" */
+    return crc ? crc : 1;
+}
+
 void skin_render_viewport(struct skin_element* viewport, struct gui_wps *gwps,
                         struct skin_viewport* skin_viewport, unsigned long refresh_type)
 {
@@ -766,6 +879,7 @@ void skin_render_viewport(struct skin_element* viewport, struct gui_wps *gwps,
         info.no_line_break = false;
         info.line_scrolls = false;
         info.force_redraw = false;
+        info.drew_graphics = false;
 #if (LCD_DEPTH > 1) || (defined(HAVE_REMOTE_LCD) && (LCD_REMOTE_DEPTH > 1))
         skin_viewport->fgbg_changed = false;
 #ifdef HAVE_LCD_COLOR
@@ -800,27 +914,68 @@ void skin_render_viewport(struct skin_element* viewport, struct gui_wps *gwps,
             if (needs_update)
                 update_all = true;
         }
+#endif
+#ifdef HAVE_LCD_BITMAP
+        if (info.drew_graphics)
+            add_damage(&skin_viewport->vp, 0, 0,
+                       skin_viewport->vp.width, skin_viewport->vp.height);
 #endif
         /* only update if the line needs to be, and there is something to write */
         if (refresh_type && (needs_update || update_all))
         {
-            if (info.force_redraw)
-                display->scroll_stop_viewport_rect(&skin_viewport->vp,
-                    0, info.line_number*display->getcharheight(),
-                    skin_viewport->vp.width, display->getcharheight());
-            write_line(display, align, info.line_number,
-                    info.line_scrolls, &info.line_desc);
+            struct line *drawn = get_drawn_line(line);
+            uint32_t crc = render_pass.stats ?
+                           get_line_crc(&info, skin_viewport) : 0;
+
+            /* lines whose text did not change since they were last
+             * written are left alone, unless the area was cleared */
+            if (crc && crc == drawn->drawn_crc && !info.force_redraw &&
+                !update_all && !info.drew_graphics &&
+                (refresh_type&SKIN_REFRESH_ALL) != SKIN_REFRESH_ALL)
+            {
+                render_pass.stats->lines_skipped++;
+            }
+            else
+            {
+                if (info.force_redraw)
+                    display->scroll_stop_viewport_rect(&skin_viewport->vp,
+                        0, info.line_number*display->getcharheight(),
+                        skin_viewport->vp.width, display->getcharheight());
+                write_line(display, align, info.line_number,
+                        info.line_scrolls, &info.line_desc);
+#ifdef HAVE_LCD_BITMAP
+                add_damage(&skin_viewport->vp,
+                           0, info.line_number*display->getcharheight(),
+                           skin_viewport->vp.width, display->getcharheight());
+#endif
+                if (render_pass.stats)
+                    render_pass.stats->lines_drawn++;
+            }
+            drawn->drawn_crc = crc;
         }
         if (!info.no_line_break)
             info.line_number++;
         line = SKINOFFSETTOPTR(skin_buffer, line->next);
     }
 #ifdef HAVE_LCD_BITMAP
+    /* images are drawn wherever they are, whatever viewport asked for them */
+    imglist = SKINOFFSETTOPTR(skin_buffer, gwps->data->images);
+    while (imglist)
+    {
+        struct wps_token *token = SKINOFFSETTOPTR(skin_buffer, imglist->token);
+        struct gui_img *img = (struct gui_img *)SKINOFFSETTOPTR(skin_buffer, token->value.data);
+        struct viewport *img_vp = SKINOFFSETTOPTR(skin_buffer, img->vp);
+        if (img->display >= 0 && img_vp)
+            add_damage(img_vp, img->x, img->y, img->bm.width,
+                       img->subimage_height);
+        imglist = SKINOFFSETTOPTR(skin_buffer, imglist->next);
+    }
     wps_display_images(gwps, &skin_viewport->vp);
 #endif
 }
 
-void skin_render(struct gui_wps *gwps, unsigned refresh_mode)
+void skin_render(struct gui_wps *gwps, unsigned refresh_mode,
+                 struct skin_stats *stats)
 {
     struct wps_data *data = gwps->data;
     struct screen *display = gwps->display;
@@ -831,6 +986,12 @@ void skin_render(struct gui_wps *gwps, unsigned refresh_mode)
     
     int old_refresh_mode = refresh_mode;
     skin_buffer = get_skin_buffer(gwps->data);
+    render_pass.stats = stats;
+#ifdef HAVE_LCD_BITMAP
+    render_pass.full_update = false;
+    render_pass.x1 = render_pass.x2 = 0;
+    render_pass.y1 = render_pass.y2 = 0;
+#endif
     
 #ifdef HAVE_LCD_CHARCELLS
     int i;
@@ -860,6 +1021,9 @@ void skin_render(struct gui_wps *gwps, unsigned refresh_mode)
 #if (LCD_DEPTH > 1) || (defined(HAVE_REMOTE_LCD) && LCD_REMOTE_DEPTH > 1)
         if (skin_viewport->output_to_backdrop_buffer)
         {
+            /* shows up through the backdrop, anywhere on the screen */
+            if (vp_refresh_mode)
+                render_pass.full_update = true;
             display->set_framebuffer(skin_backdrop_get_buffer(data->backdrop_id));
             skin_backdrop_show(-1);
         }
@@ -892,6 +1056,10 @@ void skin_render(struct gui_wps *gwps, unsigned refresh_mode)
         if ((vp_refresh_mode&SKIN_REFRESH_ALL) == SKIN_REFRESH_ALL)
         {
             display->clear_viewport();
+#ifdef HAVE_LCD_BITMAP
+            add_damage(&skin_viewport->vp, 0, 0,
+                       skin_viewport->vp.width, skin_viewport->vp.height);
+#endif
         }
         /* render */
         if (viewport->children_count)
@@ -912,7 +1080,26 @@ void skin_render(struct gui_wps *gwps, unsigned refresh_mode)
     }
     /* Restore the default viewport */
     display->set_viewport(NULL);
+#ifdef HAVE_LCD_BITMAP
+    /* push only the damaged area to the lcd, unless something may have
+     * drawn outside of the viewport being rendered */
+    if (render_pass.full_update ||
+        ((refresh_mode&SKIN_REFRESH_ALL) == SKIN_REFRESH_ALL))
+    {
+        display->update();
+    }
+    else if (render_pass.x2 > render_pass.x1)
+    {
+        int x1 = MAX(render_pass.x1, 0), y1 = MAX(render_pass.y1, 0);
+        int x2 = MIN(render_pass.x2, display->lcdwidth);
+        int y2 = MIN(render_pass.y2, display->lcdheight);
+        if (x2 > x1 && y2 > y1)
+            display->update_rect(x1, y1, x2 - x1, y2 - y1);
+    }
+#else
     display->update();
+#endif
+    render_pass.stats = NULL;
 }
 
 #ifdef HAVE_LCD_BITMAP
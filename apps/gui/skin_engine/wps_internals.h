@@ -35,6 +35,8 @@ struct skin_stats {
     size_t buflib_handles;
     size_t tree_size;
     size_t images_size;
+    unsigned long lines_drawn;   /* lines written by skin_render() */
+    unsigned long lines_skipped; /* lines left alone as they had not changed */
 };
 
 int skin_get_num_skins(void);
@@ -280,6 +282,7 @@ struct skin_albumart {
 
 struct line {
     unsigned update_mode;
+    uint32_t drawn_crc; /* crc of what was last written, 0 if unknown */
 };
 
 struct line_alternator {
@@ -216,17 +216,14 @@ static int INIT_ATTR init_dircache(bool preinit)
 
     int result = -1;
 
-#ifdef HAVE_EEPROM_SETTINGS
-    if (firmware_settings.initialized &&
-        firmware_settings.disk_clean &&
-        preinit)
+#ifdef DIRCACHE_SNAPSHOT
+    if (preinit)
     {
+        /* start from the last snapshot, if any; the build verifies it */
         result = dircache_load();
-        if (result < 0)
-            firmware_settings.disk_clean = false;
     }
     else
-#endif /* HAVE_EEPROM_SETTINGS */
+#endif /* DIRCACHE_SNAPSHOT */
     if (!preinit)
     {
         result = dircache_enable();
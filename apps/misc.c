@@ -192,20 +192,17 @@ int fast_readline(int fd, char *buf, int buf_size, void *parameters,
         next = NULL;
 
         rc = read(fd, &buf[pos], buf_size - pos - 1);
-        if (rc >= 0)
-            buf[pos+rc] = '\0';
+        if (rc > 0)
+            pos += rc;
+        buf[pos] = '\0';
 
-        if ( (p = strchr(buf, '\n')) != NULL)
+        /* one pass finds the end of the line however it's marked */
+        if ( (p = memeol(buf, pos)) != NULL)
         {
+            next = p + 1;
+            if (*p == '\r' && *next == '\n')
+                next++;
             *p = '\0';
-            next = ++p;
-        }
-
-        if ( (p = strchr(buf, '\r')) != NULL)
-        {
-            *p = '\0';
-            if (!next)
-                next = ++p;
         }
 
         rc = callback(count, buf, parameters);
@@ -215,7 +212,7 @@ int fast_readline(int fd, char *buf, int buf_size, void *parameters,
         count++;
         if (next)
         {
-            pos = buf_size - ((long)next - (long)buf) - 1;
+            pos -= next - buf;
             memmove(buf, next, pos);
         }
         else
@@ -368,6 +365,12 @@ static bool clean_shutdown(void (*callback)(void *), void *parameter)
 #endif
             }
 
+#if defined(HAVE_DIRCACHE) && defined(DIRCACHE_SNAPSHOT)
+            /* what's written after this is caught when the snapshot is
+               verified at the next boot */
+            if (global_settings.dircache)
+                dircache_save();
+#endif
             system_flush();
 #ifdef HAVE_EEPROM_SETTINGS
             if (firmware_settings.initialized)
@@ -1015,20 +1018,42 @@ int read_line(int fd, char* buffer, int buffer_size)
 
     while (count < buffer_size)
     {
-        unsigned char c;
+        char *start = &buffer[count];
+        int rc = read(fd, start, buffer_size - count);
 
-        if (1 != read(fd, &c, 1))
+        if (rc <= 0)
             break;
 
-        num_read++;
+        /* give back whatever follows the end of the line */
+        char *eol = memchr(start, '\n', rc);
+        if (eol)
+        {
+            lseek(fd, eol + 1 - (start + rc), SEEK_CUR);
+            rc = eol - start;
+            num_read++;
+        }
 
-        if ( c == '\n' )
-            break;
+        num_read += rc;
 
-        if ( c == '\r' )
-            continue;
+        /* CR chars are dropped */
+        char *p = memchr(start, '\r', rc);
+        if (p)
+        {
+            count = p - buffer;
+
+            for (; p < start + rc; p++)
+            {
+                if (*p != '\r')
+                    buffer[count++] = *p;
+            }
+        }
+        else
+        {
+            count += rc;
+        }
 
-        buffer[count++] = c;
+        if (eol)
+            break;
     }
 
     buffer[MIN(count, buffer_size - 1)] = 0;
@@ -1141,6 +1166,43 @@ int open_utf8(const char* pathname, int flags)
     return ret >= 0 ? fd : -1;
 }
 
+#ifndef __PCTOOL__
+/* Return the last-modified time of a file as found in its directory entry,
+ * or 0 if there's no such entry. The directory is read from dircache when
+ * it is enabled. */
+time_t file_mtime(const char *path)
+{
+    char dirpath[MAX_PATH];
+    const char *dir, *name;
+    size_t dirlen = path_dirname(path, &dir);
+    size_t namelen = path_basename(path, &name);
+    time_t mtime = 0;
+
+    if (namelen == 0 || dirlen >= sizeof (dirpath))
+        return 0;
+
+    strmemcpy(dirpath, dir, dirlen);
+
+    DIR *dirp = opendir(dirpath);
+    if (!dirp)
+        return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dirp)))
+    {
+        if (!strncasecmp(entry->d_name, name, namelen) &&
+            entry->d_name[namelen] == '\0')
+        {
+            mtime = dir_get_info(dirp, entry).mtime;
+            break;
+        }
+    }
+
+    closedir(dirp);
+    return mtime;
+}
+#endif /* !__PCTOOL__ */
+
 
 #ifdef HAVE_LCD_COLOR
 /*
@@ -23,6 +23,7 @@
 
 #include <stdbool.h>
 #include <inttypes.h>
+#include <time.h>
 #include "config.h"
 #include "screen_access.h"
 
@@ -75,6 +76,7 @@ extern int show_logo(void);
 
 int split_string(char *str, const char needle, char *vector[], int vector_length);
 int open_utf8(const char* pathname, int flags);
+time_t file_mtime(const char *path);
 
 #ifdef BOOTFILE
 #if !defined(USB_NONE) && !defined(USB_HANDLED_BY_OF) \
@@ -65,6 +65,18 @@
       exactly the same as before shutdown.  To avoid unnecessary disk
       accesses, the shuffle mode settings are also saved in settings and only
       flushed to disk when required.
+
+      At shutdown, the indices and the state they were left in are also
+      written to a checkpoint file along with the size and a crc of the
+      control file at that point.  If the control file still begins with
+      the same data, resuming loads the checkpoint and only reapplies the
+      commands added after it.
+
+  Index file:
+      The track offsets of a large playlist file are kept in an index file
+      once it has been scanned.  Its size and a crc of its beginning and end
+      are stored along with them and, when those still match, the offsets
+      are loaded from there instead of scanning the playlist again.
  */
 
 #include <stdio.h>
@@ -514,6 +526,359 @@ static void update_playlist_filename(struct playlist_info* playlist,
         "%s%s%s", dir, sep, file);
 }
 
+/* index and checkpoint files */
+#define PLAYLIST_INDEX_MAGIC        0x504c4932 /* "PLI2" */
+#define PLAYLIST_CHECKPOINT_MAGIC   0x504c4332 /* "PLC2" */
+/* smaller playlists are quick enough to scan */
+#define PLAYLIST_INDEX_MIN_TRACKS   500
+/* bytes at each end of the playlist file that go into its stamp */
+#define PLAYLIST_STAMP_SAMPLE       1024
+
+/* identifies the contents of a playlist file */
+struct playlist_stamp
+{
+    uint32_t size;
+    uint32_t crc;
+    uint32_t mtime;             /* from the directory entry */
+};
+
+struct playlist_index_header
+{
+    uint32_t magic;
+    struct playlist_stamp stamp;
+    uint32_t start;             /* offset at which the scan started */
+    int32_t  amount;
+    char     filename[MAX_PATH];
+};
+
+struct playlist_checkpoint_header
+{
+    uint32_t magic;
+    uint32_t control_size;      /* bytes of the control file covered */
+    uint32_t control_crc;       /* crc of those bytes */
+    struct playlist_stamp stamp;
+    int32_t  amount;
+    int32_t  first_index;
+    int32_t  last_insert_pos;
+    int32_t  seed;
+    int32_t  num_inserted_tracks;
+    int32_t  dirlen;
+    bool     utf8;
+    bool     shuffle_modified;
+    bool     deleted;
+    bool     shuffled;          /* last shuffle command was not undone */
+    char     filename[MAX_PATH];
+};
+
+/*
+ * update crc with the bytes from start to end of the file; if shuffledp is
+ * given, it's set to whether the last shuffle command in that range of a
+ * control file is a shuffle rather than an unshuffle
+ */
+static int crc_file_range(int fd, off_t start, off_t end, uint32_t *crcp,
+                          bool *shuffledp, char *buf, size_t buflen)
+{
+    char last = '\n';
+
+    if (lseek(fd, start, SEEK_SET) != start)
+        return -1;
+
+    while (start < end)
+    {
+        ssize_t nread = read(fd, buf, MIN((off_t)buflen, end - start));
+        if (nread <= 0)
+            return -1;
+
+        *crcp = crc_32(buf, nread, *crcp);
+
+        for (ssize_t i = 0; shuffledp && i < nread; i++)
+        {
+            if (last == '\n' && (buf[i] == 'S' || buf[i] == 'U'))
+                *shuffledp = buf[i] == 'S';
+            last = buf[i];
+        }
+
+        start += nread;
+    }
+
+    return 0;
+}
+
+/*
+ * get the stamp of the playlist file at path opened as fd; the file position
+ * is kept
+ *
+ * Only the ends of the file are checksummed, as reading all of it would take
+ * as long as indexing it again. An edit in the middle that keeps the size is
+ * still caught by the modification time.
+ */
+static int get_playlist_stamp(int fd, const char *path,
+                              struct playlist_stamp *stamp,
+                              char *buf, size_t buflen)
+{
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    off_t size = filesize(fd);
+    time_t mtime = file_mtime(path);
+    if (pos < 0 || size < 0 || mtime == 0)
+        return -1;
+
+    stamp->size = size;
+    stamp->crc = 0xffffffff;
+    stamp->mtime = mtime;
+
+    off_t tail = MAX(size - PLAYLIST_STAMP_SAMPLE, PLAYLIST_STAMP_SAMPLE);
+    if (crc_file_range(fd, 0, MIN(size, PLAYLIST_STAMP_SAMPLE), &stamp->crc,
+                       NULL, buf, buflen) < 0 ||
+        crc_file_range(fd, MIN(size, tail), size, &stamp->crc,
+                       NULL, buf, buflen) < 0)
+        return -1;
+
+    lseek(fd, pos, SEEK_SET);
+    return 0;
+}
+
+/*
+ * read amount indices from fd; the indices are copied through buf since
+ * they may move while reading; missing tracks are looked for again
+ */
+static int read_indices(int fd, struct playlist_info* playlist, int amount,
+                        char *buf, size_t buflen)
+{
+    const int per_read = buflen / sizeof (uint32_t);
+    const uint32_t *p = (const uint32_t *)buf;
+
+    for (int i = 0; i < amount;)
+    {
+        int count = MIN(per_read, amount - i);
+        ssize_t size = count * sizeof (uint32_t);
+
+        if (read(fd, buf, size) != size)
+            return -1;
+
+        for (int j = 0; j < count; j++, i++)
+        {
+            playlist->indices[i] = p[j] & ~PLAYLIST_SKIPPED;
+#ifdef HAVE_DIRCACHE
+            if (playlist->filenames)
+                playlist->filenames[i] = -1;
+#endif
+        }
+    }
+
+    playlist->amount = amount;
+    return 0;
+}
+
+/*
+ * write all indices to fd, copied through buf like read_indices() does
+ */
+static int write_indices(int fd, const struct playlist_info* playlist,
+                         char *buf, size_t buflen)
+{
+    const int per_write = buflen / sizeof (uint32_t);
+    uint32_t *p = (uint32_t *)buf;
+
+    for (int i = 0; i < playlist->amount;)
+    {
+        int count = MIN(per_write, playlist->amount - i);
+        ssize_t size = count * sizeof (uint32_t);
+
+        for (int j = 0; j < count; j++, i++)
+            p[j] = playlist->indices[i];
+
+        if (write(fd, buf, size) != size)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * load the track offsets of the playlist file from the index file if they
+ * are there and still correct
+ */
+static int load_playlist_index(struct playlist_info* playlist, off_t start,
+                               char *buf, size_t buflen)
+{
+    struct playlist_index_header hdr;
+    struct playlist_stamp stamp;
+    int result = -1;
+
+    int fd = open(PLAYLIST_INDEX_FILE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (read(fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+        hdr.magic != PLAYLIST_INDEX_MAGIC ||
+        hdr.start != start ||
+        hdr.amount <= 0 || hdr.amount > playlist->max_playlist_size ||
+        strncmp(hdr.filename, playlist->filename, MAX_PATH))
+        goto out;
+
+    if (get_playlist_stamp(playlist->fd, playlist->filename, &stamp,
+                           buf, buflen) < 0 ||
+        memcmp(&stamp, &hdr.stamp, sizeof (stamp)))
+        goto out;
+
+    result = read_indices(fd, playlist, hdr.amount, buf, buflen);
+out:
+    close(fd);
+    return result;
+}
+
+/*
+ * write the track offsets of the freshly scanned playlist file to the
+ * index file
+ */
+static void save_playlist_index(struct playlist_info* playlist, off_t start,
+                                char *buf, size_t buflen)
+{
+    struct playlist_index_header hdr;
+    memset(&hdr, 0, sizeof (hdr));
+
+    if (get_playlist_stamp(playlist->fd, playlist->filename, &hdr.stamp,
+                           buf, buflen) < 0)
+        return;
+
+    hdr.start = start;
+    hdr.amount = playlist->amount;
+    strlcpy(hdr.filename, playlist->filename, MAX_PATH);
+
+    int fd = open(PLAYLIST_INDEX_FILE, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+    if (fd < 0)
+        return;
+
+    /* the magic goes in last so that an incomplete file is never used */
+    if (write(fd, &hdr, sizeof (hdr)) == sizeof (hdr) &&
+        write_indices(fd, playlist, buf, buflen) >= 0 &&
+        lseek(fd, 0, SEEK_SET) == 0)
+    {
+        hdr.magic = PLAYLIST_INDEX_MAGIC;
+        write(fd, &hdr.magic, sizeof (hdr.magic));
+    }
+
+    close(fd);
+}
+
+/*
+ * write the state of the playlist to the checkpoint file; called with the
+ * control file flushed
+ */
+static void save_playlist_checkpoint(struct playlist_info* playlist)
+{
+    uint32_t buf[128];
+    struct playlist_checkpoint_header hdr;
+    memset(&hdr, 0, sizeof (hdr));
+
+    /* dirplay playlists live in ram and are rebuilt anyway */
+    if (!playlist->started || playlist->in_ram || playlist->fd < 0)
+        return;
+
+    off_t control_size = filesize(playlist->control_fd);
+    if (control_size <= 0)
+        return;
+
+    hdr.control_size = control_size;
+    hdr.control_crc = 0xffffffff;
+
+    if (crc_file_range(playlist->control_fd, 0, control_size,
+                       &hdr.control_crc, &hdr.shuffled,
+                       (char *)buf, sizeof (buf)) < 0 ||
+        get_playlist_stamp(playlist->fd, playlist->filename, &hdr.stamp,
+                           (char *)buf, sizeof (buf)) < 0)
+        return;
+
+    hdr.amount              = playlist->amount;
+    hdr.first_index         = playlist->first_index;
+    hdr.last_insert_pos     = playlist->last_insert_pos;
+    hdr.seed                = playlist->seed;
+    hdr.num_inserted_tracks = playlist->num_inserted_tracks;
+    hdr.dirlen              = playlist->dirlen;
+    hdr.utf8                = playlist->utf8;
+    hdr.shuffle_modified    = playlist->shuffle_modified;
+    hdr.deleted             = playlist->deleted;
+    strlcpy(hdr.filename, playlist->filename, MAX_PATH);
+
+    int fd = open(PLAYLIST_CHECKPOINT_FILE, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+    if (fd < 0)
+        return;
+
+    if (write(fd, &hdr, sizeof (hdr)) == sizeof (hdr) &&
+        write_indices(fd, playlist, (char *)buf, sizeof (buf)) >= 0 &&
+        lseek(fd, 0, SEEK_SET) == 0)
+    {
+        hdr.magic = PLAYLIST_CHECKPOINT_MAGIC;
+        write(fd, &hdr.magic, sizeof (hdr.magic));
+    }
+
+    close(fd);
+}
+
+/*
+ * restore the playlist from the checkpoint file if it was taken of the
+ * control file being resumed; returns the control file offset to continue
+ * from or < 0 if the whole control file must be replayed
+ */
+static int load_playlist_checkpoint(struct playlist_info* playlist,
+                                    off_t control_file_size, bool *sortedp,
+                                    char *buf, size_t buflen)
+{
+    struct playlist_checkpoint_header hdr;
+    struct playlist_stamp stamp;
+    uint32_t crc = 0xffffffff;
+    int result = -1;
+
+    int fd = open(PLAYLIST_CHECKPOINT_FILE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (read(fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+        hdr.magic != PLAYLIST_CHECKPOINT_MAGIC ||
+        hdr.control_size > control_file_size ||
+        hdr.amount < 0 || hdr.amount > playlist->max_playlist_size ||
+        hdr.dirlen <= 0 || hdr.dirlen >= MAX_PATH ||
+        !memchr(hdr.filename, '\0', MAX_PATH))
+        goto out;
+
+    /* inserted tracks point into the control file so all of it has to be
+       the same */
+    if (crc_file_range(playlist->control_fd, 0, hdr.control_size, &crc,
+                       NULL, buf, buflen) < 0 ||
+        crc != hdr.control_crc)
+        goto out;
+
+    playlist->fd = open_utf8(hdr.filename, O_RDONLY);
+    if (playlist->fd < 0)
+        goto out;
+
+    if (get_playlist_stamp(playlist->fd, hdr.filename, &stamp,
+                           buf, buflen) < 0 ||
+        memcmp(&stamp, &hdr.stamp, sizeof (stamp)) ||
+        read_indices(fd, playlist, hdr.amount, buf, buflen) < 0)
+    {
+        close(playlist->fd);
+        playlist->fd = -1;
+        playlist->amount = 0;
+        goto out;
+    }
+
+    strlcpy(playlist->filename, hdr.filename, sizeof (playlist->filename));
+    playlist->dirlen              = hdr.dirlen;
+    playlist->utf8                = hdr.utf8;
+    playlist->first_index         = hdr.first_index;
+    playlist->last_insert_pos     = hdr.last_insert_pos;
+    playlist->seed                = hdr.seed;
+    playlist->num_inserted_tracks = hdr.num_inserted_tracks;
+    playlist->shuffle_modified    = hdr.shuffle_modified;
+    playlist->deleted             = hdr.deleted;
+    *sortedp = !hdr.shuffled;
+
+    result = hdr.control_size;
+out:
+    close(fd);
+    return result;
+}
+
 /*
  * calculate track offsets within a playlist file
  */
@@ -522,10 +887,11 @@ static int add_indices_to_playlist(struct playlist_info* playlist,
 {
     unsigned int nread;
     unsigned int i = 0;
-    unsigned int count = 0;
+    unsigned int start;
     bool store_index;
-    unsigned char *p;
+    unsigned char *p, *end;
     int result = 0;
+    bool indexed;
     /* get emergency buffer so we don't fail horribly */
     if (!buflen)
         buffer = alloca((buflen = 64));
@@ -539,6 +905,12 @@ static int add_indices_to_playlist(struct playlist_info* playlist,
 
     splash(0, ID2P(LANG_WAIT));
 
+    /* the index file only describes the playlist file on its own */
+    indexed = playlist->amount == 0;
+    if (indexed && load_playlist_index(playlist, i, buffer, buflen) >= 0)
+        goto exit;
+
+    start = i;
     store_index = true;
 
     while(1)
@@ -549,16 +921,19 @@ static int add_indices_to_playlist(struct playlist_info* playlist,
             break;
 
         p = (unsigned char *)buffer;
+        end = p + nread;
 
-        for(count=0; count < nread; count++,p++) {
-
-            /* Are we on a new line? */
-            if((*p == '\n') || (*p == '\r'))
-            {
-                store_index = true;
-            }
-            else if(store_index)
+        while(p < end)
+        {
+            if(store_index)
             {
+                /* skip empty lines */
+                if((*p == '\n') || (*p == '\r'))
+                {
+                    p++;
+                    continue;
+                }
+
                 store_index = false;
 
                 if(*p != '#')
@@ -570,7 +945,8 @@ static int add_indices_to_playlist(struct playlist_info* playlist,
                     }
 
                     /* Store a new entry */
-                    playlist->indices[ playlist->amount ] = i+count;
+                    playlist->indices[ playlist->amount ] =
+                        i + (p - (unsigned char *)buffer);
 #ifdef HAVE_DIRCACHE
                     if (playlist->filenames)
                         playlist->filenames[ playlist->amount ] = -1;
@@ -578,11 +954,22 @@ static int add_indices_to_playlist(struct playlist_info* playlist,
                     playlist->amount++;
                 }
             }
+
+            /* the rest of the line is of no interest */
+            p = memeol(p, end - p);
+            if(!p)
+                break;
+
+            store_index = true;
+            p++;
         }
 
-        i+= count;
+        i+= nread;
     }
 
+    if (indexed && playlist->amount >= PLAYLIST_INDEX_MIN_TRACKS)
+        save_playlist_index(playlist, start, buffer, buflen);
+
 exit:
 #ifdef HAVE_DIRCACHE
     queue_post(&playlist_queue, PLAYLIST_LOAD_POINTERS, 0);
@@ -2008,6 +2395,8 @@ void playlist_shutdown(void)
         if (playlist->num_cached > 0)
             flush_cached_control(playlist);
 
+        save_playlist_checkpoint(playlist);
+
         close(playlist->control_fd);
         playlist->control_fd = -1;
 
@@ -2095,18 +2484,35 @@ int playlist_resume(void)
         goto out;
     }
 
-    /* read a small amount first to get the header */
-    nread = read(playlist->control_fd, buffer,
-        PLAYLIST_COMMAND_SIZE<buflen?PLAYLIST_COMMAND_SIZE:buflen);
-    if(nread <= 0)
+    /* pick up where the checkpoint was taken if possible */
+    int checkpoint = load_playlist_checkpoint(playlist, control_file_size,
+                                              &sorted, buffer, buflen);
+    if (checkpoint > 0)
+    {
+        first = false;
+        total_read = checkpoint;
+        result = 0;
+        lseek(playlist->control_fd, checkpoint, SEEK_SET);
+        nread = read(playlist->control_fd, buffer, buflen);
+    }
+    else
+    {
+        /* read a small amount first to get the header */
+        lseek(playlist->control_fd, 0, SEEK_SET);
+        nread = read(playlist->control_fd, buffer,
+            PLAYLIST_COMMAND_SIZE<buflen?PLAYLIST_COMMAND_SIZE:buflen);
+    }
+
+    if(nread < 0 || (nread == 0 && checkpoint <= 0))
     {
         splash(HZ*2, ID2P(LANG_PLAYLIST_CONTROL_ACCESS_ERROR));
+        result = -1;
         goto out;
     }
 
     playlist->started = true;
 
-    while (1)
+    while (nread > 0)
     {
         result = 0;
         int count;
@@ -39,6 +39,41 @@
 #define USE_JPEG_COVER
 #endif
 
+#if defined(HAVE_DIRCACHE) && !defined(PLUGIN)
+/* Remember which art the shared files of a directory resolved to, found or
+ * not, so consecutive tracks of an album don't probe the same names again.
+ * An entry is dropped once dircache sees a name change in one of the
+ * directories that were searched, or a mount. */
+#define ALBUMART_DIR_CACHE
+#include "crc32.h"
+
+#define ALBUMART_DIR_CACHE_SIZE 4
+
+static struct albumart_dir_cache
+{
+    unsigned long clock;        /* last .lastuse handed out */
+    unsigned long probes;       /* files probed so far */
+    struct albumart_cache_stats stats;
+    struct albumart_dir_entry
+    {
+        uint32_t key;           /* crc of dir, album, artist and size */
+        unsigned long changes;  /* dircache change count when resolved */
+        unsigned long lastuse;  /* for replacement, 0 = free */
+        unsigned short probes;  /* files probed to resolve it */
+        bool found;
+        char path[MAX_PATH];
+    } entries[ALBUMART_DIR_CACHE_SIZE];
+} albumart_dir_cache;
+
+static bool probe_file(const char *path)
+{
+    albumart_dir_cache.probes++;
+    return file_exists(path);
+}
+#else
+#define probe_file(path) file_exists(path)
+#endif /* HAVE_DIRCACHE && !PLUGIN */
+
 /* Strip filename from a full path
  *
  * buf      - buffer to extract directory to.
@@ -111,7 +146,7 @@ static bool try_exts(char *path, int len)
         if (extension_lens[i] + len > MAX_PATH)
             continue;
         strcpy(path + len, extensions[i]);
-        if (file_exists(path))
+        if (probe_file(path))
             return true;
     }
     return false;
@@ -119,79 +154,93 @@ static bool try_exts(char *path, int len)
 #define EXT
 #else
 #define EXT "bmp"
-#define try_exts(path, len) file_exists(path)
+#define try_exts(path, len) probe_file(path)
 #endif
 
-/* Look for the first matching album art bitmap in the following list:
- *  ./<trackname><size>.{jpeg,jpg,bmp}
- *  ./<albumname><size>.{jpeg,jpg,bmp}
- *  ./cover<size>.bmp
- *  ../<albumname><size>.{jpeg,jpg,bmp}
- *  ../cover<size>.{jpeg,jpg,bmp}
- *  ROCKBOX_DIR/albumart/<artist>-<albumname><size>.{jpeg,jpg,bmp}
- * <size> is the value of the size_string parameter, <trackname> and
- * <albumname> are read from the ID3 metadata.
- * If a matching bitmap is found, its filename is stored in buf.
- * Return value is true if a bitmap was found, false otherwise.
- *
- * If the first symbol in size_string is a colon (e.g. ":100x100")
- * then the colon is skipped ("100x100" will be used) and the track
- * specific image (./<trackname><size>.bmp) is tried last instead of first.
- */
-bool search_albumart_files(const struct mp3entry *id3, const char *size_string,
-                           char *buf, int buflen)
+/* Look for ./<trackname><size>.{jpeg,jpg,bmp} */
+static bool search_track_file(const char *trackname, const char *size_string,
+                              char *path, int pathsize)
+{
+    strip_extension(path, pathsize - strlen(size_string) - 4, trackname);
+    strcat(path, size_string);
+    strcat(path, "." EXT);
+    return try_exts(path, strlen(path));
+}
+
+/* Look for the album art files shared by the tracks of a directory, see
+ * search_albumart_files() */
+static bool search_dir_files(const struct mp3entry *id3,
+                             const char *size_string, char *path, int pathsize)
 {
-    char path[MAX_PATH + 1];
     char dir[MAX_PATH + 1];
     bool found = false;
-    int track_first = 1;
-    int pass;
-    const char *trackname;
     const char *artist;
     int dirlen;
     int albumlen;
     int pathlen;
 
-    if (!id3 || !buf)
-        return false;
+    strip_filename(dir, sizeof(dir), id3->path);
+    dirlen = strlen(dir);
+    albumlen = id3->album ? strlen(id3->album) : 0;
 
-    trackname = id3->path;
+    if (albumlen > 0)
+    {
+        /* if it doesn't exist,
+        * we look for a file specific to the track's album name */
+        pathlen = snprintf(path, pathsize,
+                        "%s%s%s." EXT, dir, id3->album, size_string);
+        fix_path_part(path, dirlen, albumlen);
+        found = try_exts(path, pathlen);
+    }
 
-    if (strcmp(trackname, "No file!") == 0)
-        return false;
+    if (!found)
+    {
+        /* if it still doesn't exist, we look for a generic file */
+        pathlen = snprintf(path, pathsize,
+                        "%scover%s." EXT, dir, size_string);
+        found = try_exts(path, pathlen);
+    }
 
-    if (*size_string == ':')
+#ifdef USE_JPEG_COVER
+    if (!found && !*size_string)
     {
-        size_string++;
-        track_first = 0;
+        snprintf (path, pathsize, "%sfolder.jpg", dir);
+        found = probe_file(path);
     }
+#endif
 
-    strip_filename(dir, sizeof(dir), trackname);
-    dirlen = strlen(dir);
-    albumlen = id3->album ? strlen(id3->album) : 0;
+    artist = id3->albumartist != NULL ? id3->albumartist : id3->artist;
 
-    for(pass = 0; pass < 2 - track_first; pass++)
+    if (!found && artist && id3->album)
+    {
+        /* look in the albumart subdir of .rockbox */
+        pathlen = snprintf(path, pathsize,
+                        ROCKBOX_DIR "/albumart/%s-%s%s." EXT,
+                        artist,
+                        id3->album,
+                        size_string);
+        fix_path_part(path, strlen(ROCKBOX_DIR "/albumart/"), MAX_PATH);
+        found = try_exts(path, pathlen);
+    }
+
+    if (!found)
+    {
+        /* if it still doesn't exist,
+        * we continue to search in the parent directory */
+        strcpy(path, dir);
+        path[dirlen - 1] = 0;
+        strip_filename(dir, sizeof(dir), path);
+        dirlen = strlen(dir);
+    }
+
+    /* only try parent if there is one */
+    if (dirlen > 0)
     {
-        if (track_first || pass)
-        {
-            /* the first file we look for is one specific to the
-               current track */
-            strip_extension(path, sizeof(path) - strlen(size_string) - 4,
-                            trackname);
-            strcat(path, size_string);
-            strcat(path, "." EXT);
-#ifdef USE_JPEG_COVER
-            pathlen = strlen(path);
-#endif
-            found = try_exts(path, pathlen);
-        }
-        if (pass)
-            break;
         if (!found && albumlen > 0)
         {
-            /* if it doesn't exist,
-            * we look for a file specific to the track's album name */
-            pathlen = snprintf(path, sizeof(path),
+            /* we look in the parent directory
+            * for a file specific to the track's album name */
+            pathlen = snprintf(path, pathsize,
                             "%s%s%s." EXT, dir, id3->album, size_string);
             fix_path_part(path, dirlen, albumlen);
             found = try_exts(path, pathlen);
@@ -199,69 +248,174 @@ bool search_albumart_files(const struct mp3entry *id3, const char *size_string,
 
         if (!found)
         {
-            /* if it still doesn't exist, we look for a generic file */
-            pathlen = snprintf(path, sizeof(path),
+            /* if it still doesn't exist, we look in the parent directory
+            * for a generic file */
+            pathlen = snprintf(path, pathsize,
                             "%scover%s." EXT, dir, size_string);
             found = try_exts(path, pathlen);
         }
+    }
 
-#ifdef USE_JPEG_COVER
-        if (!found && !*size_string)
-        {
-            snprintf (path, sizeof(path), "%sfolder.jpg", dir);
-            found = file_exists(path);
-        }
-#endif
+    return found;
+}
 
-        artist = id3->albumartist != NULL ? id3->albumartist : id3->artist;
+#ifdef ALBUMART_DIR_CACHE
+static uint32_t albumart_dir_key(const struct mp3entry *id3,
+                                 const char *size_string)
+{
+    const char *sep = strrchr(id3->path, '/');
+    const char *artist = id3->albumartist != NULL ?
+                         id3->albumartist : id3->artist;
+    uint32_t crc = 0xffffffff;
+
+    crc = crc_32(id3->path, sep ? sep - id3->path + 1 : 0, crc);
+    if (id3->album)
+        crc = crc_32(id3->album, strlen(id3->album) + 1, crc);
+    crc = crc_32("/", 1, crc);
+    if (artist)
+        crc = crc_32(artist, strlen(artist) + 1, crc);
+    crc = crc_32("/", 1, crc);
+    return crc_32(size_string, strlen(size_string) + 1, crc);
+}
 
-        if (!found && artist && id3->album)
-        {
-            /* look in the albumart subdir of .rockbox */
-            pathlen = snprintf(path, sizeof(path),
-                            ROCKBOX_DIR "/albumart/%s-%s%s." EXT,
-                            artist,
-                            id3->album,
-                            size_string);
-            fix_path_part(path, strlen(ROCKBOX_DIR "/albumart/"), MAX_PATH);
-            found = try_exts(path, pathlen);
-        }
+/* The dircache change count as of the last name change in any directory
+ * search_dir_files() looks in for the track */
+static unsigned long albumart_dir_changes(const char *trackpath)
+{
+    char dir[MAX_PATH];
+    const char *p;
+    unsigned long changes, c;
+    size_t len;
+
+    len = path_dirname(trackpath, &p);
+    strmemcpy(dir, p, MIN(len, sizeof(dir) - 1));
+    changes = dircache_get_dir_change_count(dir);
+
+    len = path_dirname(dir, &p);
+    dir[len] = '\0';
+    c = dircache_get_dir_change_count(dir);
+    changes = MAX(changes, c);
+
+    c = dircache_get_dir_change_count(ROCKBOX_DIR "/albumart");
+    return MAX(changes, c);
+}
 
-        if (!found)
+/* search_dir_files() with the results remembered per directory */
+static bool search_dir_files_cached(const struct mp3entry *id3,
+                                    const char *size_string,
+                                    char *path, int pathsize)
+{
+    struct albumart_dir_cache *cache = &albumart_dir_cache;
+    struct albumart_dir_entry *e, *victim = &cache->entries[0];
+    unsigned long changes = dircache_get_change_count();
+    uint32_t key = albumart_dir_key(id3, size_string);
+    unsigned long probes;
+    bool found;
+    int i;
+
+    for (i = 0; i < ALBUMART_DIR_CACHE_SIZE; i++)
+    {
+        e = &cache->entries[i];
+        if (e->lastuse && e->key == key &&
+            albumart_dir_changes(id3->path) > e->changes)
         {
-            /* if it still doesn't exist,
-            * we continue to search in the parent directory */
-            strcpy(path, dir);
-            path[dirlen - 1] = 0;
-            strip_filename(dir, sizeof(dir), path);
-            dirlen = strlen(dir);
+            /* its directories changed since */
+            e->lastuse = 0;
         }
 
-        /* only try parent if there is one */
-        if (dirlen > 0)
+        if (e->lastuse && e->key == key)
         {
-            if (!found && albumlen > 0)
+            e->lastuse = ++cache->clock;
+            if (!e->found)
             {
-                /* we look in the parent directory
-                * for a file specific to the track's album name */
-                pathlen = snprintf(path, sizeof(path),
-                                "%s%s%s." EXT, dir, id3->album, size_string);
-                fix_path_part(path, dirlen, albumlen);
-                found = try_exts(path, pathlen);
+                cache->stats.hits++;
+                cache->stats.probes_saved += e->probes;
+                return false;
             }
-
-            if (!found)
+            strlcpy(path, e->path, pathsize);
+            if (probe_file(path))
             {
-                /* if it still doesn't exist, we look in the parent directory
-                * for a generic file */
-                pathlen = snprintf(path, sizeof(path),
-                                "%scover%s." EXT, dir, size_string);
-                found = try_exts(path, pathlen);
+                cache->stats.hits++;
+                cache->stats.probes_saved += e->probes - 1;
+                return true;
             }
+            /* gone behind our back, look again */
+            e->lastuse = 0;
+            victim = e;
+            break;
         }
+        if (e->lastuse < victim->lastuse)
+            victim = e;
+    }
+
+    cache->stats.misses++;
+    probes = cache->probes;
+    found = search_dir_files(id3, size_string, path, pathsize);
+
+    /* don't keep what might have changed while searching */
+    if (albumart_dir_changes(id3->path) <= changes)
+    {
+        victim->key = key;
+        victim->changes = changes;
+        victim->lastuse = ++cache->clock;
+        victim->probes = cache->probes - probes;
+        victim->found = found;
         if (found)
-            break;
+            strlcpy(victim->path, path, sizeof(victim->path));
     }
+    return found;
+}
+
+void albumart_get_cache_stats(struct albumart_cache_stats *stats)
+{
+    *stats = albumart_dir_cache.stats;
+}
+#else
+#define search_dir_files_cached search_dir_files
+#endif /* ALBUMART_DIR_CACHE */
+
+/* Look for the first matching album art bitmap in the following list:
+ *  ./<trackname><size>.{jpeg,jpg,bmp}
+ *  ./<albumname><size>.{jpeg,jpg,bmp}
+ *  ./cover<size>.bmp
+ *  ../<albumname><size>.{jpeg,jpg,bmp}
+ *  ../cover<size>.{jpeg,jpg,bmp}
+ *  ROCKBOX_DIR/albumart/<artist>-<albumname><size>.{jpeg,jpg,bmp}
+ * <size> is the value of the size_string parameter, <trackname> and
+ * <albumname> are read from the ID3 metadata.
+ * If a matching bitmap is found, its filename is stored in buf.
+ * Return value is true if a bitmap was found, false otherwise.
+ *
+ * If the first symbol in size_string is a colon (e.g. ":100x100")
+ * then the colon is skipped ("100x100" will be used) and the track
+ * specific image (./<trackname><size>.bmp) is tried last instead of first.
+ */
+bool search_albumart_files(const struct mp3entry *id3, const char *size_string,
+                           char *buf, int buflen)
+{
+    char path[MAX_PATH + 1];
+    bool found = false;
+    bool track_first = true;
+
+    if (!id3 || !buf)
+        return false;
+
+    if (strcmp(id3->path, "No file!") == 0)
+        return false;
+
+    if (*size_string == ':')
+    {
+        size_string++;
+        track_first = false;
+    }
+
+    /* the first file we look for is one specific to the current track */
+    if (track_first)
+        found = search_track_file(id3->path, size_string, path, sizeof(path));
+    if (!found)
+        found = search_dir_files_cached(id3, size_string, path, sizeof(path));
+    if (!found && !track_first)
+        found = search_track_file(id3->path, size_string, path, sizeof(path));
 
     if (!found)
         return false;
@@ -44,6 +44,17 @@ void draw_album_art(struct gui_wps *gwps, int handle_id, bool clear);
 bool search_albumart_files(const struct mp3entry *id3, const char *size_string,
                            char *buf, int buflen);
 
+#if defined(HAVE_DIRCACHE) && !defined(PLUGIN)
+struct albumart_cache_stats
+{
+    unsigned long hits;         /* directories answered from the cache */
+    unsigned long misses;       /* directories that had to be searched */
+    unsigned long probes_saved; /* file probes not done thanks to hits */
+};
+
+void albumart_get_cache_stats(struct albumart_cache_stats *stats);
+#endif
+
 void get_albumart_size(struct bitmap *bmp);
 
 #endif /* HAVE_ALBUMART */
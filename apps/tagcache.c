@@ -91,9 +91,22 @@
 #undef HAVE_DIRCACHE
 
 #ifdef __PCTOOL__
+#include <sys/time.h>
 #define yield() do { } while(0)
 #define sim_sleep(timeout) do { } while(0)
 #define do_timed_yield() do { } while(0)
+#define current_tick pctool_current_tick()
+
+static long pctool_current_tick(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * HZ + tv.tv_usec / (1000000 / HZ);
+}
+
+/* Metadata the database tool has parsed in advance, see
+ * tagcache_set_metadata_hook(). */
+static int (*metadata_hook)(struct mp3entry *id3, const char *path);
 #endif
 
 #ifndef __PCTOOL__
@@ -203,6 +216,26 @@ static const char * const index_entry_ec     = "lllllllllllllllllllllll";
 static const char * const tagcache_header_ec = "lll";
 static const char * const master_header_ec   = "llllll";
 
+/**
+ * Filename hash index. An open addressed table mapping the crc32 of a path
+ * to its entry in the filename tag file, so lookups don't have to walk the
+ * whole tag file. It is rebuilt on every commit and only trusted while the
+ * filename tag file header still matches the one it was built for.
+ */
+struct filehash_header {
+    struct tagcache_header tch; /* entry_count is the number of slots */
+    int32_t tag_entry_count;    /* Filename tag file entry count at build */
+    int32_t tag_datasize;       /* Filename tag file data size at build */
+};
+
+struct filehash_entry {
+    int32_t crc;                /* crc32 of the full path */
+    int32_t seek;               /* Filename tag file offset, < 0 if unused */
+};
+
+static const char * const filehash_header_ec = "lllll";
+static const char * const filehash_entry_ec  = "ll";
+
 static struct master_header current_tcmh;
 
 #ifdef HAVE_TC_RAMCACHE
@@ -258,6 +291,8 @@ static struct tempbuf_searchidx **lookup;
 
 /* Used when building the temporary file. */
 static int cachefd = -1, filenametag_fd;
+static int filehash_fd;
+static struct filehash_header filehash_hdr;
 static int total_entry_count = 0;
 static int data_size = 0;
 static int processed_dir_count;
@@ -289,6 +324,127 @@ static ssize_t ecwrite_index_entry(int fd, struct index_entry *buf)
     return ecwrite(fd, buf, 1, index_entry_ec, tc_stat.econ);
 }
 
+/**
+ * Read-ahead blocks for the disk search path. Index entries and tag
+ * strings are served from memory, so walking through the database files
+ * costs one read() per block instead of a seek and read per record.
+ * Blocks are keyed by file descriptor and must be dropped with
+ * readahead_invalidate() before a descriptor is closed or the files
+ * are written to.
+ */
+struct readahead_block {
+    int fd;     /* Owner of the data, -1 if unused */
+    long pos;   /* File offset of data[0] */
+    long len;   /* Valid bytes in data */
+    long age;   /* Last use, the oldest block is refilled first */
+    char data[TAGCACHE_READAHEAD_SIZE];
+};
+
+static struct readahead_block readahead[TAGCACHE_READAHEAD_COUNT];
+static long readahead_age;
+static struct mutex readahead_mutex SHAREDBSS_ATTR;
+
+static void readahead_invalidate(int fd)
+{
+    int i;
+
+    mutex_lock(&readahead_mutex);
+    for (i = 0; i < TAGCACHE_READAHEAD_COUNT; i++)
+    {
+        if (fd < 0 || readahead[i].fd == fd)
+            readahead[i].fd = -1;
+    }
+    mutex_unlock(&readahead_mutex);
+}
+
+static void readahead_close(int fd)
+{
+    readahead_invalidate(fd);
+    close(fd);
+}
+
+/* Positional read through the read-ahead blocks. */
+static ssize_t readahead_read(int fd, long pos, void *buf, long size)
+{
+    struct readahead_block *ra = NULL;
+    long len;
+    int i;
+
+    /* Records larger than this would not fit a block after aligning. */
+    if (size > TAGCACHE_READAHEAD_SIZE / 2)
+    {
+        lseek(fd, pos, SEEK_SET);
+        return read(fd, buf, size);
+    }
+
+    mutex_lock(&readahead_mutex);
+
+    for (i = 0; i < TAGCACHE_READAHEAD_COUNT; i++)
+    {
+        struct readahead_block *b = &readahead[i];
+        if (b->fd == fd && pos >= b->pos && pos + size <= b->pos + b->len)
+        {
+            ra = b;
+            break ;
+        }
+    }
+
+    if (ra == NULL)
+    {
+        ra = &readahead[0];
+        for (i = 1; i < TAGCACHE_READAHEAD_COUNT; i++)
+        {
+            if (readahead[i].age < ra->age)
+                ra = &readahead[i];
+        }
+
+        /* Start on a sector boundary. */
+        ra->fd = -1;
+        ra->pos = pos & ~511L;
+        lseek(fd, ra->pos, SEEK_SET);
+        ra->len = read(fd, ra->data, TAGCACHE_READAHEAD_SIZE);
+        if (ra->len < 0)
+        {
+            ra->len = 0;
+            mutex_unlock(&readahead_mutex);
+            return -1;
+        }
+        ra->fd = fd;
+    }
+
+    ra->age = ++readahead_age;
+
+    len = ra->pos + ra->len - pos;
+    if (len > size)
+        len = size;
+    if (len > 0)
+        memcpy(buf, &ra->data[pos - ra->pos], len);
+    else
+        len = 0;
+
+    mutex_unlock(&readahead_mutex);
+
+    return len;
+}
+
+static ssize_t readahead_read_tagfile_entry(int fd, long pos,
+                                            struct tagfile_entry *buf)
+{
+    ssize_t ret = readahead_read(fd, pos, buf, sizeof(struct tagfile_entry));
+    structec_convert(buf, tagfile_entry_ec, 1, tc_stat.econ);
+    return ret;
+}
+
+static ssize_t readahead_read_index_entry(int fd, int idxid,
+                                          struct index_entry *buf)
+{
+    ssize_t ret = readahead_read(fd, idxid * sizeof(struct index_entry)
+                                 + sizeof(struct master_header),
+                                 buf, sizeof(struct index_entry));
+    structec_convert(buf, index_entry_ec, 1, tc_stat.econ);
+    return ret;
+}
+
 #ifdef HAVE_DIRCACHE
 /**
  * Returns true if specified flag is still present, i.e., dircache
@@ -436,6 +592,117 @@ static long find_entry_ram(const char *filename, int dc)
 }
 #endif
 
+static int open_filehash_fd(struct filehash_header *hdr,
+                            const struct tagcache_header *tch)
+{
+    int fd;
+
+    fd = open(TAGCACHE_FILE_FILEHASH, O_RDONLY);
+    if (fd < 0)
+        return fd;
+
+    /* Only usable if built for the current filename tag file. */
+    if (ecread(fd, hdr, 1, filehash_header_ec, tc_stat.econ)
+        != sizeof(struct filehash_header)
+        || hdr->tch.magic != TAGCACHE_MAGIC
+        || hdr->tch.entry_count <= 0
+        || (hdr->tch.entry_count & (hdr->tch.entry_count - 1))
+        || hdr->tag_entry_count != tch->entry_count
+        || hdr->tag_datasize != tch->datasize)
+    {
+        logf("filehash stale");
+        close(fd);
+        return -2;
+    }
+
+    return fd;
+}
+
+/**
+ * Looks up filename through the filename hash index. fd must be an open
+ * filename tag file.
+ * Return values:
+ *    >= 0   index id of the entry
+ *    == -1  no usable hash index, the tag file must be scanned
+ *    == -4  filename is not in the database
+ */
+static long find_entry_hash(const char *filename, int fd, bool localfd)
+{
+    struct tagcache_header tch;
+    struct filehash_header fhh;
+    struct filehash_entry fhe;
+    struct tagfile_entry tfe;
+    char buf[TAG_MAXLEN+32];
+    int hashfd = -1;
+    long slots, slot, i;
+    uint32_t crc;
+    long result = -1;
+
+    crc = crc_32(filename, strlen(filename), 0xffffffff);
+
+    if (!localfd && filehash_fd >= 0)
+    {
+        hashfd = filehash_fd;
+        slots = filehash_hdr.tch.entry_count;
+    }
+    else
+    {
+        lseek(fd, 0, SEEK_SET);
+        if (ecread(fd, &tch, 1, tagcache_header_ec, tc_stat.econ)
+            != sizeof(struct tagcache_header))
+            return -1;
+
+        if ( (hashfd = open_filehash_fd(&fhh, &tch)) < 0)
+            return -1;
+
+        slots = fhh.tch.entry_count;
+    }
+
+    slot = crc & (slots - 1);
+    for (i = 0; i < slots; i++, slot = (slot + 1) & (slots - 1))
+    {
+        lseek(hashfd, sizeof(struct filehash_header)
+              + slot * sizeof(struct filehash_entry), SEEK_SET);
+        if (ecread(hashfd, &fhe, 1, filehash_entry_ec, tc_stat.econ)
+            != sizeof(struct filehash_entry))
+        {
+            logf("filehash read error");
+            break;
+        }
+
+        /* An unused slot ends the probe sequence. */
+        if (fhe.seek < 0)
+        {
+            result = -4;
+            break;
+        }
+
+        if (fhe.crc != (int32_t)crc)
+            continue;
+
+        lseek(fd, fhe.seek, SEEK_SET);
+        if (ecread_tagfile_entry(fd, &tfe) != sizeof(struct tagfile_entry)
+            || tfe.tag_length >= (long)sizeof(buf)
+            || read(fd, buf, tfe.tag_length) != tfe.tag_length)
+        {
+            logf("filehash: tag read error");
+            break;
+        }
+
+        /* Deleted entries have their data cleared and never match. */
+        if (!strcmp(filename, buf))
+        {
+            result = tfe.idx_id;
+            break;
+        }
+    }
+
+    if (hashfd != filehash_fd)
+        close(hashfd);
+
+    return result;
+}
+
 static long find_entry_disk(const char *filename_raw, bool localfd)
 {
     struct tagcache_header tch;
@@ -447,7 +714,7 @@ static long find_entry_disk(const char *filename_raw, bool localfd)
     int fd;
     char buf[TAG_MAXLEN+32];
     int i;
-    int pos = -1;
+    long pos = -1;
 
     const char *filename = filename_raw;
 #ifdef APPLICATION
@@ -466,22 +733,28 @@ static long find_entry_disk(const char *filename_raw, bool localfd)
         if ( (fd = open_tag_fd(&tch, tag_filename, false)) < 0)
             return -1;
     }
+
+    if ( (i = find_entry_hash(filename, fd, localfd)) != -1)
+    {
+        if (fd != filenametag_fd || localfd)
+            readahead_close(fd);
+        return i;
+    }
     
     check_again:
     
     if (last_pos > 0)
-        lseek(fd, last_pos, SEEK_SET);
+        pos = last_pos;
     else
-        lseek(fd, sizeof(struct tagcache_header), SEEK_SET);
+        pos = sizeof(struct tagcache_header);
 
     while (true)
     {
-        pos = lseek(fd, 0, SEEK_CUR);
         for (i = pos_history_idx-1; i >= 0; i--)
             pos_history[i+1] = pos_history[i];
         pos_history[0] = pos;
 
-        if (ecread_tagfile_entry(fd, &tfe) 
+        if (readahead_read_tagfile_entry(fd, pos, &tfe)
             != sizeof(struct tagfile_entry))
         {
             break ;
@@ -490,17 +763,18 @@ static long find_entry_disk(const char *filename_raw, bool localfd)
         if (tfe.tag_length >= (long)sizeof(buf))
         {
             logf("too long tag #1");
-            close(fd);
+            readahead_close(fd);
             if (!localfd)
                 filenametag_fd = -1;
             last_pos = -1;
             return -2;
         }
         
-        if (read(fd, buf, tfe.tag_length) != tfe.tag_length)
+        if (readahead_read(fd, pos + sizeof(struct tagfile_entry), buf,
+                           tfe.tag_length) != tfe.tag_length)
         {
             logf("read error #2");
-            close(fd);
+            readahead_close(fd);
             if (!localfd)
                 filenametag_fd = -1;
             last_pos = -1;
@@ -516,6 +790,8 @@ static long find_entry_disk(const char *filename_raw, bool localfd)
         
         if (pos_history_idx < POS_HISTORY_COUNT - 1)
             pos_history_idx++;
+
+        pos += sizeof(struct tagfile_entry) + tfe.tag_length;
     }
     
     /* Not found? */
@@ -529,12 +805,12 @@ static long find_entry_disk(const char *filename_raw, bool localfd)
         }
         
         if (fd != filenametag_fd || localfd)
-            close(fd);
+            readahead_close(fd);
         return -4;
     }
     
     if (fd != filenametag_fd || localfd)
-        close(fd);
+        readahead_close(fd);
         
     return tfe.idx_id;
 }
@@ -613,20 +889,18 @@ static bool get_index(int masterfd, int idxid,
             return false;
     }
     
-    lseek(masterfd, idxid * sizeof(struct index_entry) 
-          + sizeof(struct master_header), SEEK_SET);
-    if (ecread_index_entry(masterfd, idx) 
+    if (readahead_read_index_entry(masterfd, idxid, idx)
         != sizeof(struct index_entry))
     {
         logf("read error #3");
         if (localfd)
-            close(masterfd);
+            readahead_close(masterfd);
         
         return false;
     }
     
     if (localfd)
-        close(masterfd);
+        readahead_close(masterfd);
     
     if (idx->flag & FLAG_DELETED)
         return false;
@@ -668,6 +942,7 @@ static bool write_index(int masterfd, int idxid, struct index_entry *idx)
     }
 #endif
     
+    readahead_invalidate(-1);
     lseek(masterfd, idxid * sizeof(struct index_entry) 
           + sizeof(struct master_header), SEEK_SET);
     if (ecwrite_index_entry(masterfd, idx) != sizeof(struct index_entry))
@@ -759,8 +1034,7 @@ static bool retrieve(struct tagcache_search *tcs, struct index_entry *idx,
     if (!open_files(tcs, tag))
         return false;
     
-    lseek(tcs->idxfd[tag], seek, SEEK_SET);
-    if (ecread_tagfile_entry(tcs->idxfd[tag], &tfe) 
+    if (readahead_read_tagfile_entry(tcs->idxfd[tag], seek, &tfe)
         != sizeof(struct tagfile_entry))
     {
         logf("read error #5");
@@ -773,8 +1047,8 @@ static bool retrieve(struct tagcache_search *tcs, struct index_entry *idx,
         return false;
     }
     
-    if (read(tcs->idxfd[tag], buf, tfe.tag_length) !=
-        tfe.tag_length)
+    if (readahead_read(tcs->idxfd[tag], seek + sizeof(struct tagfile_entry),
+                       buf, tfe.tag_length) != tfe.tag_length)
     {
         logf("read error #6");
         return false;
@@ -1059,15 +1333,15 @@ static bool check_clauses(struct tagcache_search *tcs,
                     tag = tag_filename;
 
                 int fd = tcs->idxfd[tag];
-                lseek(fd, seek, SEEK_SET);
-                ecread_tagfile_entry(fd, &tfe);
+                readahead_read_tagfile_entry(fd, seek, &tfe);
                 if (tfe.tag_length >= (int)sizeof(buf))
                 {
                     logf("Too long tag read!");
                     return false;
                 }
 
-                read(fd, str, tfe.tag_length);
+                readahead_read(fd, seek + sizeof(struct tagfile_entry),
+                               str, tfe.tag_length);
                 str[tfe.tag_length] = '\0';
                 
                 /* Check if entry has been deleted. */
@@ -1210,10 +1484,7 @@ static bool build_lookup_list(struct tagcache_search *tcs)
         tcs->masterfd = open_master_fd(&tcmh, false);
     }
     
-    lseek(tcs->masterfd, tcs->seek_pos * sizeof(struct index_entry) +
-            sizeof(struct master_header), SEEK_SET);
-    
-    while (ecread_index_entry(tcs->masterfd, &entry) 
+    while (readahead_read_index_entry(tcs->masterfd, tcs->seek_pos, &entry)
            == sizeof(struct index_entry))
     {
         struct tagcache_seeklist_entry *seeklist;
@@ -1253,7 +1524,7 @@ static bool build_lookup_list(struct tagcache_search *tcs)
         seeklist->idx_id = i;
         tcs->seek_list_count++;
         
-        yield();
+        do_timed_yield();
     }
 
     return tcs->seek_list_count > 0;
@@ -1277,6 +1548,7 @@ static void remove_files(void)
         snprintf(buf, sizeof buf, TAGCACHE_FILE_INDEX, i);
         remove(buf);
     }
+    remove(TAGCACHE_FILE_FILEHASH);
 }
 
 
@@ -1563,10 +1835,9 @@ static bool get_next(struct tagcache_search *tcs)
         return false;
     }
     
-    /* Seek stream to the correct position and continue to direct fetch. */
-    lseek(tcs->idxfd[tcs->type], tcs->position, SEEK_SET);
-    
-    if (ecread_tagfile_entry(tcs->idxfd[tcs->type], &entry) != sizeof(struct tagfile_entry))
+    /* Continue to direct fetch from the current position. */
+    if (readahead_read_tagfile_entry(tcs->idxfd[tcs->type], tcs->position,
+                                     &entry) != sizeof(struct tagfile_entry))
     {
         logf("read error #5");
         tcs->valid = false;
@@ -1581,7 +1852,9 @@ static bool get_next(struct tagcache_search *tcs)
         return false;
     }
     
-    if (read(tcs->idxfd[tcs->type], buf, entry.tag_length) != entry.tag_length)
+    if (readahead_read(tcs->idxfd[tcs->type],
+                       tcs->position + sizeof(struct tagfile_entry),
+                       buf, entry.tag_length) != entry.tag_length)
     {
         tcs->valid = false;
         logf("read error #4");
@@ -1656,7 +1929,7 @@ void tagcache_search_finish(struct tagcache_search *tcs)
     
     if (tcs->masterfd >= 0)
     {
-        close(tcs->masterfd);
+        readahead_close(tcs->masterfd);
         tcs->masterfd = -1;
     }
 
@@ -1664,7 +1937,7 @@ void tagcache_search_finish(struct tagcache_search *tcs)
     {
         if (tcs->idxfd[i] >= 0)
         {
-            close(tcs->idxfd[i]);
+            readahead_close(tcs->idxfd[i]);
             tcs->idxfd[i] = -1;
         }
     }
@@ -1823,6 +2096,9 @@ static void __attribute__ ((noinline)) add_tagcache(char *path,
     int path_length = strlen(path);
     bool has_albumartist;
     bool has_grouping;
+#ifdef __PCTOOL__
+    int hook_rc;
+#endif
 
 #ifdef SIMULATOR
     /* Crude logging for the sim - to aid in debugging */
@@ -1888,18 +2164,26 @@ static void __attribute__ ((noinline)) add_tagcache(char *path,
         }
     }
     
-    fd = open(path, O_RDONLY);
-    if (fd < 0)
-    {
-        logf("open fail: %s", path);
-        return ;
-    }
-
     memset(&id3, 0, sizeof(struct mp3entry));
     memset(&entry, 0, sizeof(struct temp_file_entry));
     memset(&tracknumfix, 0, sizeof(tracknumfix));
-    ret = get_metadata(&id3, fd, path);
-    close(fd);
+
+#ifdef __PCTOOL__
+    if (metadata_hook != NULL && (hook_rc = metadata_hook(&id3, path)) >= 0)
+        ret = hook_rc > 0;
+    else
+#endif
+    {
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            logf("open fail: %s", path);
+            return ;
+        }
+
+        ret = get_metadata(&id3, fd, path);
+        close(fd);
+    }
 
     if (!ret)
         return ;
@@ -2070,12 +2354,11 @@ static int compare(const void *p1, const void *p2)
     return strncasecmp(e1->str, e2->str, TAG_MAXLEN);
 }
 
-static int tempbuf_sort(int fd)
+/* Sorts the tempbuf entries and fixes the lookup buffer to match. */
+static bool tempbuf_sort_entries(void)
 {
     struct tempbuf_searchidx *index = (struct tempbuf_searchidx *)tempbuf;
-    struct tagfile_entry fe;
     int i;
-    int length;
     
     /* Generate reverse lookup entries. */
     for (i = 0; i < lookup_buffer_depth; i++)
@@ -2094,7 +2377,7 @@ static int tempbuf_sort(int fd)
         
         tempbuf_left -= sizeof(struct tempbuf_id_list);
         if (tempbuf_left - 4 < 0)
-            return -1;
+            return false;
         
         idlist->next = (struct tempbuf_id_list *)&tempbuf[tempbuf_pos];
         if (tempbuf_pos & 0x03)
@@ -2126,49 +2409,240 @@ static int tempbuf_sort(int fd)
                 lookup[idlist->id] = &index[i];
             idlist = idlist->next;
         }
+    }
+
+    return true;
+}
+
+/* Writes a tempbuf entry to the current position of a tag file. */
+static int tempbuf_write_entry(int fd, struct tempbuf_searchidx *entry)
+{
+    struct tagfile_entry fe;
+    int length;
+    
+    entry->seek = lseek(fd, 0, SEEK_CUR);
+    length = strlen(entry->str) + 1;
+    fe.tag_length = length;
+    fe.idx_id = entry->idx_id;
+    
+    /* Check the chunk alignment. */
+    if ((fe.tag_length + sizeof(struct tagfile_entry)) 
+        % TAGFILE_ENTRY_CHUNK_LENGTH)
+    {
+        fe.tag_length += TAGFILE_ENTRY_CHUNK_LENGTH - 
+            ((fe.tag_length + sizeof(struct tagfile_entry)) 
+             % TAGFILE_ENTRY_CHUNK_LENGTH);
+    }
+    
+#ifdef TAGCACHE_STRICT_ALIGN
+    /* Make sure the entry is long aligned. */
+    if (entry->seek & 0x03)
+    {
+        logf("tempbuf_sort: alignment error!");
+        return -3;
+    }
+#endif
+    
+    if (ecwrite(fd, &fe, 1, tagfile_entry_ec, tc_stat.econ) !=
+        sizeof(struct tagfile_entry))
+    {
+        logf("tempbuf_sort: write error #1");
+        return -1;
+    }
+    
+    if (write(fd, entry->str, length) != length)
+    {
+        logf("tempbuf_sort: write error #2");
+        return -2;
+    }
+    
+    /* Write some padding. */
+    if (fe.tag_length - length > 0)
+        write(fd, "XXXXXXXX", fe.tag_length - length);
+
+    return sizeof(struct tagfile_entry) + fe.tag_length;
+}
+
+static int tempbuf_sort(int fd)
+{
+    struct tempbuf_searchidx *index = (struct tempbuf_searchidx *)tempbuf;
+    int i, rc;
+    
+    if (!tempbuf_sort_entries())
+        return -1;
+    
+    for (i = 0; i < tempbufidx; i++)
+    {
+        if ( (rc = tempbuf_write_entry(fd, &index[i])) < 0)
+            return rc;
+    }
+
+    return i;
+}
+
+/**
+ * Offset map from the old to the merged tag file: entries at old_seek
+ * and up to the next mark moved by delta bytes.
+ */
+struct merge_shift {
+    long old_seek;
+    long delta;
+};
+
+static struct merge_shift *merge_shifts;
+static long merge_shift_count;
+
+/* tempbuf_merge() result when the offset map doesn't fit; the other errors
+ * are negative too, -1 to -3 come from tempbuf_write_entry() */
+#define MERGE_NO_ROOM   (-4)
+
+/**
+ * Merges the sorted tempbuf entries with the already sorted tag file fd
+ * into mergefd. Unique tags that already exist in the file are mapped to
+ * the old entry and deleted entries are dropped as long as there is room
+ * left in the offset map. Returns the number of entries written,
+ * MERGE_NO_ROOM if there's no room for the offset map or another negative
+ * value on errors.
+ */
+static int tempbuf_merge(int fd, int mergefd, int index_type,
+                         const struct tagcache_header *tch)
+{
+    struct tempbuf_searchidx *index = (struct tempbuf_searchidx *)tempbuf;
+    struct tempbuf_searchidx old;
+    struct tagfile_entry entry;
+    char buf[TAG_MAXLEN+32];
+    long pos = sizeof(struct tagcache_header);
+    long delta = 0;
+    long max_shifts;
+    int count = 0;
+    int i, n = 0, rc;
+    
+    if (!tempbuf_sort_entries())
+        return -1;
+    
+    /* The rest of tempbuf holds the offset map. */
+    tempbuf_pos = (tempbuf_pos + 3) & ~3;
+    merge_shifts = (struct merge_shift *)&tempbuf[tempbuf_pos];
+    max_shifts = (long)(tempbuf_size - tempbuf_pos) / sizeof(struct merge_shift);
+    merge_shift_count = 0;
+    
+    /* Every new entry can move the rest of the file. */
+    if (max_shifts < tempbufidx + 1)
+    {
+        logf("merge: buffer too small");
+        return MERGE_NO_ROOM;
+    }
+    
+    old.str = buf;
+    lseek(mergefd, sizeof(struct tagcache_header), SEEK_SET);
+    
+    for (i = 0; i < tch->entry_count; i++)
+    {
+        if (readahead_read_tagfile_entry(fd, pos, &entry)
+            != sizeof(struct tagfile_entry))
+        {
+            logf("read error #7");
+            return -2;
+        }
         
-        index[i].seek = lseek(fd, 0, SEEK_CUR);
-        length = strlen(index[i].str) + 1;
-        fe.tag_length = length;
-        fe.idx_id = index[i].idx_id;
-        
-        /* Check the chunk alignment. */
-        if ((fe.tag_length + sizeof(struct tagfile_entry)) 
-            % TAGFILE_ENTRY_CHUNK_LENGTH)
+        if (entry.tag_length >= (int)sizeof(buf))
         {
-            fe.tag_length += TAGFILE_ENTRY_CHUNK_LENGTH - 
-                ((fe.tag_length + sizeof(struct tagfile_entry)) 
-                 % TAGFILE_ENTRY_CHUNK_LENGTH);
+            logf("too long tag #3");
+            return -2;
         }
         
-#ifdef TAGCACHE_STRICT_ALIGN
-        /* Make sure the entry is long aligned. */
-        if (index[i].seek & 0x03)
+        if (readahead_read(fd, pos + sizeof(struct tagfile_entry), buf,
+                           entry.tag_length) != entry.tag_length)
         {
-            logf("tempbuf_sort: alignment error!");
-            return -3;
+            logf("read error #8");
+            return -2;
         }
-#endif
         
-        if (ecwrite(fd, &fe, 1, tagfile_entry_ec, tc_stat.econ) !=
-            sizeof(struct tagfile_entry))
+        if (buf[0] == '\0')
         {
-            logf("tempbuf_sort: write error #1");
-            return -1;
+            /* Deleted entry, drop it unless the offset map may run out. */
+            if (merge_shift_count + (tempbufidx - n) + 2 <= max_shifts)
+            {
+                delta -= sizeof(struct tagfile_entry) + entry.tag_length;
+                pos += sizeof(struct tagfile_entry) + entry.tag_length;
+                continue;
+            }
+        }
+        else
+        {
+            /* Write the new tags sorting before this one. */
+            while (n < tempbufidx && compare(&index[n], &old) < 0)
+            {
+                if ( (rc = tempbuf_write_entry(mergefd, &index[n])) < 0)
+                    return rc;
+                
+                delta += rc;
+                count++;
+                n++;
+            }
+            
+            /* Unique tags already in the file stay where they are. */
+            if (TAGCACHE_IS_UNIQUE(index_type) && n < tempbufidx
+                && compare(&index[n], &old) == 0)
+            {
+                index[n].seek = pos + delta;
+                n++;
+            }
+            
+            if (merge_shift_count > 0 
+                ? merge_shifts[merge_shift_count-1].delta != delta
+                : delta != 0)
+            {
+                merge_shifts[merge_shift_count].old_seek = pos;
+                merge_shifts[merge_shift_count].delta = delta;
+                merge_shift_count++;
+            }
         }
         
-        if (write(fd, index[i].str, length) != length)
+        /* Copy the old entry over as is. */
+        if (ecwrite(mergefd, &entry, 1, tagfile_entry_ec, tc_stat.econ) !=
+            sizeof(struct tagfile_entry)
+            || write(mergefd, buf, entry.tag_length) != entry.tag_length)
         {
-            logf("tempbuf_sort: write error #2");
+            logf("merge: write error");
             return -2;
         }
         
-        /* Write some padding. */
-        if (fe.tag_length - length > 0)
-            write(fd, "XXXXXXXX", fe.tag_length - length);
+        pos += sizeof(struct tagfile_entry) + entry.tag_length;
+        count++;
+        do_timed_yield();
     }
+    
+    /* And the new tags sorting after all old ones. */
+    for (; n < tempbufidx; n++)
+    {
+        if ( (rc = tempbuf_write_entry(mergefd, &index[n])) < 0)
+            return rc;
+        count++;
+    }
+    
+    return count;
+}
 
-    return i;
+/* Returns the position in the merged tag file for an old entry. */
+static long merge_find_location(long old_seek)
+{
+    long lo = 0, hi = merge_shift_count;
+    
+    /* Find the last mark at or before old_seek. */
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (merge_shifts[mid].old_seek <= old_seek)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    if (lo == 0)
+        return old_seek;
+    
+    return old_seek + merge_shifts[lo-1].delta;
 }
     
 inline static struct tempbuf_searchidx* tempbuf_locate(int id)
@@ -2433,7 +2907,8 @@ static bool build_numeric_indices(struct tagcache_header *h, int tmpfd)
  *    == 0   temporary failure
  *     < 0   fatal error
  */
-static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
+static int build_index(int index_type, struct tagcache_header *h, int tmpfd,
+                       bool allow_merge)
 {
     int i;
     struct tagcache_header tch;
@@ -2443,8 +2918,10 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
     char buf[TAG_MAXLEN+32];
     int fd = -1, masterfd;
     bool error = false;
+    bool merge, rebuild = false;
     int init;
     int masterfd_pos;
+    int update_count;
     
     logf("Building index: %d", index_type);
     
@@ -2462,7 +2939,18 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
 
     /* Open the index file, which contains the tag names. */
     fd = open_tag_fd(&tch, index_type, true);
-    if (fd >= 0)
+
+    /**
+     * New tags are merged into existing sorted tag files, so only
+     * the new ones need to be kept in memory.
+     */
+    merge = allow_merge && fd >= 0 && TAGCACHE_IS_SORTED(index_type);
+    if (merge)
+    {
+        commit_entry_count = h->entry_count + 1;
+        lookup_buffer_depth = 1 + commit_entry_count;
+    }
+    else if (fd >= 0)
     {
         logf("tch.datasize=%ld", tch.datasize);
         lookup_buffer_depth = 1 +
@@ -2493,18 +2981,18 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
      * |  index  | position/ENTRY_CHUNK_SIZE |  lookup buffer
      * +---------+---------------------------+
      *              
-     * Old tags are inserted to a temporary buffer with position:
-     *     tempbuf_insert(position/ENTRY_CHUNK_SIZE, ...);
-     * And new tags with index:
+     * New tags are inserted to a temporary buffer with index:
      *     tempbuf_insert(idx, ...);
      * 
-     * The buffer is sorted and written into tag file:
+     * The buffer is sorted and written into a new tag file:
      *     tempbuf_sort(...);
+     * or merged with the already sorted old tags:
+     *     tempbuf_merge(...);
      * leaving master index locations messed up.
      * 
-     * That is fixed using the lookup buffer for old tags:
-     *     new_seek = tempbuf_find_location(old_seek, ...);
-     * and for new tags:
+     * That is fixed using the offset map for old tags:
+     *     new_seek = merge_find_location(old_seek);
+     * and the lookup buffer for new tags:
      *     new_seek = tempbuf_find_location(idx);
      */
     lookup = (struct tempbuf_searchidx **)&tempbuf[tempbuf_pos];
@@ -2523,11 +3011,14 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
     if (fd >= 0)
     {
         /**
-         * If tag file contains unique tags (sorted index), we will load
-         * it entirely into memory so we can resort it later for use with
-         * chunked browsing.
+         * If tag file contains unique tags (sorted index) and there's no
+         * room to merge into it, we will load it entirely into memory so
+         * we can resort it later for use with chunked browsing. Otherwise
+         * sorted tags are merged later and the rest appended.
          */
-        if (TAGCACHE_IS_SORTED(index_type))
+        if (merge)
+            ;
+        else if (TAGCACHE_IS_SORTED(index_type))
         {
             logf("loading tags...");
             for (i = 0; i < tch.entry_count; i++)
@@ -2723,31 +3214,65 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
         }
         logf("done");
 
-        /* Sort the buffer data and write it to the index file. */
-        lseek(fd, sizeof(struct tagcache_header), SEEK_SET);
-        /**
-         * We need to truncate the index file now. There can be junk left
-         * at the end of file (however, we _should_ always follow the
-         * entry_count and don't crash with that).
-         */
-        ftruncate(fd, lseek(fd, 0, SEEK_CUR));
-        
-        i = tempbuf_sort(fd);
-        if (i < 0)
-            goto error_exit;
-        logf("sorted %d tags", i);
+        if (merge)
+        {
+            /* Merge the buffer data with the index file into a copy. */
+            int mergefd = open(TAGCACHE_FILE_MERGE,
+                               O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (mergefd < 0)
+            {
+                logf("%s open fail", TAGCACHE_FILE_MERGE);
+                error = true;
+                goto error_exit;
+            }
+            
+            i = tempbuf_merge(fd, mergefd, index_type, &tch);
+            readahead_close(fd);
+            fd = mergefd;
+            if (i < 0)
+            {
+                /* Without room for the offset map, sort it all instead. */
+                rebuild = (i == MERGE_NO_ROOM);
+                error = true;
+                goto error_exit;
+            }
+            logf("merged %d tags", i);
+            tempbufidx = i;
+            tc_stat.commit_merged++;
+        }
+        else
+        {
+            /* Sort the buffer data and write it to the index file. */
+            lseek(fd, sizeof(struct tagcache_header), SEEK_SET);
+            /**
+             * We need to truncate the index file now. There can be junk left
+             * at the end of file (however, we _should_ always follow the
+             * entry_count and don't crash with that).
+             */
+            ftruncate(fd, lseek(fd, 0, SEEK_CUR));
+            
+            i = tempbuf_sort(fd);
+            if (i < 0)
+                goto error_exit;
+            logf("sorted %d tags", i);
+        }
         
         /**
-         * Now update all indexes in the master lookup file.
+         * Now update all indexes in the master lookup file. Nothing
+         * moved if the merge only appended to the file.
          */
         logf("updating indices...");
+        update_count = tcmh.tch.entry_count;
+        if (merge && merge_shift_count == 0)
+            update_count = 0;
+        
         lseek(masterfd, sizeof(struct master_header), SEEK_SET);
-        for (i = 0; i < tcmh.tch.entry_count; i += idxbuf_pos)
+        for (i = 0; i < update_count; i += idxbuf_pos)
         {
             int j;
             int loc = lseek(masterfd, 0, SEEK_CUR);
             
-            idxbuf_pos = MIN(tcmh.tch.entry_count - i, IDX_BUF_DEPTH);
+            idxbuf_pos = MIN(update_count - i, IDX_BUF_DEPTH);
             
             if (ecread(masterfd, idxbuf, idxbuf_pos, index_entry_ec, tc_stat.econ) 
                 != (int)sizeof(struct index_entry)*idxbuf_pos)
@@ -2767,9 +3292,17 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
                     continue;
                 }
                 
-                idxbuf[j].tag_seek[index_type] = tempbuf_find_location(
-                    idxbuf[j].tag_seek[index_type]/TAGFILE_ENTRY_CHUNK_LENGTH
-                    + commit_entry_count);
+                if (merge)
+                {
+                    idxbuf[j].tag_seek[index_type] = merge_find_location(
+                        idxbuf[j].tag_seek[index_type]);
+                }
+                else
+                {
+                    idxbuf[j].tag_seek[index_type] = tempbuf_find_location(
+                        idxbuf[j].tag_seek[index_type]/TAGFILE_ENTRY_CHUNK_LENGTH
+                        + commit_entry_count);
+                }
                 
                 if (idxbuf[j].tag_seek[index_type] < 0)
                 {
@@ -2917,12 +3450,128 @@ static int build_index(int index_type, struct tagcache_header *h, int tmpfd)
     close(fd);
     close(masterfd);
 
+    if (merge)
+    {
+        /* Replace the tag file with the merged copy. */
+        if (!error)
+        {
+            snprintf(buf, sizeof buf, TAGCACHE_FILE_INDEX, index_type);
+            remove(buf);
+            if (rename(TAGCACHE_FILE_MERGE, buf) < 0)
+            {
+                logf("merge: rename failed");
+                error = true;
+            }
+        }
+        else
+            remove(TAGCACHE_FILE_MERGE);
+    }
+
+    if (rebuild)
+    {
+        logf("merge failed, rebuilding");
+        return build_index(index_type, h, tmpfd, false);
+    }
+
     if (error)
         return -2;
     
     return 1;
 }
 
+/**
+ * Builds the filename hash index from the filename tag file using tempbuf
+ * for the table. Failure is not fatal, lookups just fall back to scanning.
+ */
+static bool build_filehash(void)
+{
+    struct tagcache_header tch;
+    struct filehash_header fhh;
+    struct filehash_entry *table = (struct filehash_entry *)tempbuf;
+    struct tagfile_entry tfe;
+    char buf[TAG_MAXLEN+32];
+    long slots, slot;
+    int fd, i;
+    uint32_t crc;
+
+    logf("Building filename hash...");
+    remove(TAGCACHE_FILE_FILEHASH);
+
+    if ( (fd = open_tag_fd(&tch, tag_filename, false)) < 0)
+        return false;
+
+    /* Keep the table at most half full so probe sequences stay short. */
+    for (slots = 16; slots < tch.entry_count * 2; slots <<= 1)
+        ;
+
+    if ((size_t)slots * sizeof(struct filehash_entry) > tempbuf_size)
+    {
+        logf("filehash: buffer too small");
+        close(fd);
+        return false;
+    }
+
+    memset(table, 0xff, slots * sizeof(struct filehash_entry));
+
+    for (i = 0; i < tch.entry_count; i++)
+    {
+        long pos = lseek(fd, 0, SEEK_CUR);
+
+        if (ecread_tagfile_entry(fd, &tfe) != sizeof(struct tagfile_entry)
+            || tfe.tag_length >= (long)sizeof(buf)
+            || read(fd, buf, tfe.tag_length) != tfe.tag_length)
+        {
+            logf("filehash: read error");
+            close(fd);
+            return false;
+        }
+
+        /* Skip deleted entries. */
+        if (buf[0] == '\0')
+            continue;
+
+        crc = crc_32(buf, strlen(buf), 0xffffffff);
+        for (slot = crc & (slots - 1); table[slot].seek >= 0;
+             slot = (slot + 1) & (slots - 1))
+            ;
+
+        table[slot].crc = crc;
+        table[slot].seek = pos;
+        do_timed_yield();
+    }
+
+    close(fd);
+
+    fd = open(TAGCACHE_FILE_FILEHASH, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        logf("filehash: create failed");
+        return false;
+    }
+
+    fhh.tch.magic = TAGCACHE_MAGIC;
+    fhh.tch.datasize = slots * sizeof(struct filehash_entry);
+    fhh.tch.entry_count = slots;
+    fhh.tag_entry_count = tch.entry_count;
+    fhh.tag_datasize = tch.datasize;
+
+    if (ecwrite(fd, &fhh, 1, filehash_header_ec, tc_stat.econ)
+        != sizeof(struct filehash_header)
+        || ecwrite(fd, table, slots, filehash_entry_ec, tc_stat.econ)
+        != fhh.tch.datasize)
+    {
+        logf("filehash: write error");
+        close(fd);
+        remove(TAGCACHE_FILE_FILEHASH);
+        return false;
+    }
+
+    close(fd);
+    logf("done");
+
+    return true;
+}
+
 static bool commit(void)
 {
     struct tagcache_header tch;
@@ -2930,6 +3579,7 @@ static bool commit(void)
     int i, len, rc;
     int tmpfd;
     int masterfd;
+    long start_tick, phase_tick;
 #ifdef HAVE_DIRCACHE
     bool dircache_buffer_stolen = false;
 #endif
@@ -2943,6 +3593,9 @@ static bool commit(void)
     while (write_lock)
         sleep(1);
 
+    /* The database files are about to be rewritten. */
+    readahead_invalidate(-1);
+
     tmpfd = open(TAGCACHE_FILE_TEMP, O_RDONLY);
     if (tmpfd < 0)
     {
@@ -3035,6 +3688,12 @@ static bool commit(void)
     tc_stat.commit_step = 0;
     tch.datasize = 0;
     tc_stat.commit_delayed = false;
+    tc_stat.commit_merged = 0;
+    tc_stat.commit_ticks = 0;
+    tc_stat.commit_index_ticks = 0;
+    tc_stat.commit_numeric_ticks = 0;
+    tc_stat.commit_hash_ticks = 0;
+    start_tick = current_tick;
     
     for (i = 0; i < TAG_COUNT; i++)
     {
@@ -3044,7 +3703,7 @@ static bool commit(void)
             continue;
         
         tc_stat.commit_step++;
-        ret = build_index(i, &tch, tmpfd);
+        ret = build_index(i, &tch, tmpfd, true);
         if (ret <= 0)
         {
             close(tmpfd);
@@ -3058,6 +3717,9 @@ static bool commit(void)
         }
     }
     
+    tc_stat.commit_index_ticks = current_tick - start_tick;
+    phase_tick = current_tick;
+    
     if (!build_numeric_indices(&tch, tmpfd))
     {
         logf("Failure to commit numeric indices");
@@ -3070,6 +3732,11 @@ static bool commit(void)
     close(tmpfd);
     
     tc_stat.commit_step = 0;
+    tc_stat.commit_numeric_ticks = current_tick - phase_tick;
+    phase_tick = current_tick;
+
+    build_filehash();
+    tc_stat.commit_hash_ticks = current_tick - phase_tick;
     
     /* Update the master index headers. */
     if ( (masterfd = open_master_fd(&tcmh, true)) < 0)
@@ -3091,7 +3758,9 @@ static bool commit(void)
     ecwrite(masterfd, &tcmh, 1, master_header_ec, tc_stat.econ);
     close(masterfd);
     
-    logf("tagcache committed");
+    tc_stat.commit_ticks = current_tick - start_tick;
+    logf("tagcache committed in %ld ticks (%d merged)",
+         tc_stat.commit_ticks, tc_stat.commit_merged);
     tc_stat.ready = check_all_headers();
     tc_stat.readyvalid = true;
     
@@ -3216,7 +3885,7 @@ static void command_queue_sync_callback(void)
         {
             case CMD_UPDATE_MASTER_HEADER:
             {
-                close(masterfd);
+                readahead_close(masterfd);
                 update_master_header();
                 
                 /* Re-open the masterfd. */
@@ -3236,7 +3905,7 @@ static void command_queue_sync_callback(void)
             command_queue_ridx = 0;
     }
     
-    close(masterfd);
+    readahead_close(masterfd);
     
     tc_stat.queue_length = 0;
     mutex_unlock(&command_queue_mutex);
@@ -3522,11 +4191,11 @@ bool tagcache_import_changelog(void)
                   parse_changelog_line);
     
     close(clfd);
-    close(masterfd);
+    readahead_close(masterfd);
     
     if (filenametag_fd >= 0)
     {
-        close(filenametag_fd);
+        readahead_close(filenametag_fd);
         filenametag_fd = -1;
     }
     
@@ -3809,6 +4478,7 @@ static bool delete_entry(long idx_id)
     }
     
     close(masterfd);
+    readahead_invalidate(-1);
     
     return true;
     
@@ -3817,6 +4487,7 @@ static bool delete_entry(long idx_id)
         close(fd);
     if (masterfd >= 0)
         close(masterfd);
+    readahead_invalidate(-1);
   
     return false;
 }
@@ -4533,6 +5204,8 @@ void do_tagcache_build(const char *path[])
     }
 
     filenametag_fd = open_tag_fd(&header, tag_filename, false);
+    if (filenametag_fd >= 0)
+        filehash_fd = open_filehash_fd(&filehash_hdr, &header);
     
     cpu_boost(true);
 
@@ -4576,10 +5249,16 @@ void do_tagcache_build(const char *path[])
 
     if (filenametag_fd >= 0)
     {
-        close(filenametag_fd);
+        readahead_close(filenametag_fd);
         filenametag_fd = -1;
     }
 
+    if (filehash_fd >= 0)
+    {
+        close(filehash_fd);
+        filehash_fd = -1;
+    }
+
     if (!ret)
     {
         logf("Aborted.");
@@ -4789,6 +5468,33 @@ void tagcache_shutdown(void)
 #endif
 }
 
+void tagcache_start_scan(void)
+{
+    queue_post(&tagcache_queue, Q_START_SCAN, 0);
+}
+
+bool tagcache_update(void)
+{
+    if (!tc_stat.ready)
+        return false;
+    
+    queue_post(&tagcache_queue, Q_UPDATE, 0);
+    return false;
+}
+
+bool tagcache_rebuild()
+{
+    queue_post(&tagcache_queue, Q_REBUILD, 0);
+    return false;
+}
+
+void tagcache_stop_scan(void)
+{
+    queue_post(&tagcache_queue, Q_STOP_SCAN, 0);
+}
+
+#endif /* !__PCTOOL__ */
+
 static int get_progress(void)
 {
     int total_count = -1;
@@ -4821,40 +5527,15 @@ struct tagcache_stat* tagcache_get_stat(void)
     return &tc_stat;
 }
 
-void tagcache_start_scan(void)
-{
-    queue_post(&tagcache_queue, Q_START_SCAN, 0);
-}
-
-bool tagcache_update(void)
-{
-    if (!tc_stat.ready)
-        return false;
-    
-    queue_post(&tagcache_queue, Q_UPDATE, 0);
-    return false;
-}
-
-bool tagcache_rebuild()
-{
-    queue_post(&tagcache_queue, Q_REBUILD, 0);
-    return false;
-}
-
-void tagcache_stop_scan(void)
-{
-    queue_post(&tagcache_queue, Q_STOP_SCAN, 0);
-}
-
-#endif /* !__PCTOOL__ */
-
-
 void tagcache_init(void)
 {
     memset(&tc_stat, 0, sizeof(struct tagcache_stat));
     memset(&current_tcmh, 0, sizeof(struct master_header));
     filenametag_fd = -1;
+    filehash_fd = -1;
     write_lock = read_lock = 0;
+    mutex_init(&readahead_mutex);
+    readahead_invalidate(-1);
     
 #ifndef __PCTOOL__
     mutex_init(&command_queue_mutex);
@@ -4873,6 +5554,12 @@ void tagcache_init(void)
 }
 
 #ifdef __PCTOOL__
+void tagcache_set_metadata_hook(int (*hook)(struct mp3entry *id3,
+                                            const char *path))
+{
+    metadata_hook = hook;
+}
+
 void tagcache_reverse_scan(void)
 {
     logf("Checking for deleted files");
@@ -72,6 +72,10 @@ enum tag_type { tag_artist = 0, tag_album, tag_genre, tag_title,
 /* How many entries to fetch to the seek table at once while searching. */
 #define SEEK_LIST_SIZE 32
 
+/* Size and number of the read-ahead blocks used when searching on disk. */
+#define TAGCACHE_READAHEAD_SIZE  4096
+#define TAGCACHE_READAHEAD_COUNT 3
+
 /* Always strict align entries for best performance and binary compatibility. */
 #define TAGCACHE_STRICT_ALIGN 1
 
@@ -94,6 +98,12 @@ enum tag_type { tag_artist = 0, tag_album, tag_genre, tag_title,
 /* The main database string data. */
 #define TAGCACHE_FILE_INDEX      ROCKBOX_DIR "/database_%d.tcd"
 
+/* Filename hash index for fast filename lookups (optional). */
+#define TAGCACHE_FILE_FILEHASH   ROCKBOX_DIR "/database_hash.tcd"
+
+/* Tag file being merged with new tags during commit. */
+#define TAGCACHE_FILE_MERGE      ROCKBOX_DIR "/database_merge.tcd"
+
 /* ASCII dumpfile of the DB contents. */
 #define TAGCACHE_FILE_CHANGELOG  ROCKBOX_DIR "/database_changelog.txt"
 
@@ -141,6 +151,11 @@ struct tagcache_stat {
     int  progress;           /* Current progress of disk scan */
     int  processed_entries;  /* Scanned disk entries so far */
     int  queue_length;       /* Command queue length */
+    int  commit_merged;      /* Tag files merged by the last commit */
+    long commit_ticks;       /* Duration of the last commit */
+    long commit_index_ticks; /* ..spent building the tag files */
+    long commit_numeric_ticks; /* ..spent updating numeric tags */
+    long commit_hash_ticks;  /* ..spent building the filename hash */
     volatile const char 
         *curentry;           /* Path of the current entry being scanned. */
     volatile bool syncscreen;/* Synchronous operation with debug screen? */
@@ -208,6 +223,11 @@ void tagcache_reverse_scan(void);
 /* call this directly instead of tagcache_build in order to not pull
  * on global_settings */
 void do_tagcache_build(const char *path[]);
+/* Metadata for files to add is asked from the hook first. It returns 1
+ * and fills in the strings and numbers of id3 for a parsed file, 0 if
+ * the file couldn't be parsed and -1 to have the file parsed as usual. */
+void tagcache_set_metadata_hook(int (*hook)(struct mp3entry *id3,
+                                            const char *path));
 #endif
 
 const char* tagcache_tag_to_str(int tag);
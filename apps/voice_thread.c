@@ -145,22 +145,16 @@ static enum voice_state voice_message(struct voice_thread_data *td);
 static enum voice_state voice_decode(struct voice_thread_data *td);
 static enum voice_state voice_buffer_insert(struct voice_thread_data *td);
 
-/* Might have lookahead and be skipping samples, so size is needed */
 static struct voice_buf
 {
     /* Buffer for decoded samples */
     spx_int16_t spx_outbuf[VOICE_FRAME_COUNT];
-    /* Queue frame indexes */
-    unsigned int volatile frame_in;
-    unsigned int volatile frame_out;
+    /* Frames queued to the mixer so far */
+    unsigned int frame_in;
     /* For PCM pointer adjustment */
     struct voice_thread_data *td;
     /* Buffers for mixing voice */
-    struct voice_pcm_frame
-    {
-        size_t size;
-        int16_t pcm[2*VOICE_PCM_FRAME_COUNT];
-    } frames[VOICE_FRAMES];
+    int16_t frames[VOICE_FRAMES][2*VOICE_PCM_FRAME_COUNT];
 } *voice_buf = NULL;
 
 static int voice_buf_hid = 0;
@@ -205,46 +199,24 @@ static struct buflib_callbacks ops =
     .sync_callback = sync_callback,
 };
 
-/* Number of frames in queue */
+/* Number of frames the mixer isn't done with yet */
 static unsigned int voice_unplayed_frames(void)
 {
-    return voice_buf->frame_in - voice_buf->frame_out;
-}
-
-/* Mixer channel callback */
-static void voice_pcm_callback(const void **start, size_t *size)
-{
-    unsigned int frame_out = ++voice_buf->frame_out;
-
-    if (voice_unplayed_frames() == 0)
-        return; /* Done! */
-
-    struct voice_pcm_frame *frame =
-        &voice_buf->frames[frame_out % VOICE_FRAMES];
-
-    *start = frame->pcm;
-    *size = frame->size;
+    return voice_buf->frame_in -
+           mixer_channel_queue_done(PCM_MIXER_CHAN_VOICE);
 }
 
 /* Start playback of voice channel if not already playing */
 static void voice_start_playback(void)
 {
-    if (mixer_channel_status(PCM_MIXER_CHAN_VOICE) != CHANNEL_STOPPED ||
-        voice_unplayed_frames() == 0)
-        return;
-
-    struct voice_pcm_frame *frame =
-        &voice_buf->frames[voice_buf->frame_out % VOICE_FRAMES];
-
-    mixer_channel_play_data(PCM_MIXER_CHAN_VOICE, voice_pcm_callback,
-                            frame->pcm, frame->size);
+    if (voice_unplayed_frames() > 0)
+        mixer_channel_play_queue(PCM_MIXER_CHAN_VOICE);
 }
 
-/* Stop the voice channel */
+/* Stop the voice channel, dropping any queued frames */
 static void voice_stop_playback(void)
 {
     mixer_channel_stop(PCM_MIXER_CHAN_VOICE);
-    voice_buf->frame_in = voice_buf->frame_out = 0;
 }
 
 /* Grab a free PCM frame */
@@ -257,7 +229,7 @@ static int16_t * voice_buf_get(void)
         return NULL;
     }
 
-    return voice_buf->frames[voice_buf->frame_in % VOICE_FRAMES].pcm;
+    return voice_buf->frames[voice_buf->frame_in % VOICE_FRAMES];
 }
 
 /* Commit a frame returned by voice_buf_get and set the actual size */
@@ -265,9 +237,13 @@ static void voice_buf_commit(int count)
 {
     if (count > 0)
     {
+        /* Might have lookahead and be skipping samples, so the size is
+           passed along; never full as there are fewer frames than queue
+           entries */
         unsigned int frame_in = voice_buf->frame_in;
-        voice_buf->frames[frame_in % VOICE_FRAMES].size =
-            count * 2 * sizeof (int16_t);
+        mixer_channel_queue_data(PCM_MIXER_CHAN_VOICE,
+                                 voice_buf->frames[frame_in % VOICE_FRAMES],
+                                 count * 2 * sizeof (int16_t));
         voice_buf->frame_in = frame_in + 1;
     }
 }
@@ -396,7 +372,9 @@ static enum voice_state voice_message(struct voice_thread_data *td)
     case SYS_TIMEOUT:
         if (voice_unplayed_frames())
         {
-            /* Waiting for PCM to finish */
+            /* Waiting for PCM to finish; restart it if it ran dry just as
+               the last frames were queued */
+            voice_start_playback();
             break;
         }
 
@@ -570,6 +548,7 @@ void voice_thread_init(void)
     }
 
     memset(voice_buf, 0, sizeof (*voice_buf));
+    voice_buf->frame_in = mixer_channel_queue_done(PCM_MIXER_CHAN_VOICE);
 
     logf("Starting voice thread");
     queue_init(&voice_queue, false);
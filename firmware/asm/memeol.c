@@ -0,0 +1,77 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+
+#include <limits.h>
+#include "memeol.h"
+
+#define LBLOCKSIZE   (sizeof (long))
+#define UNALIGNED(X) ((long)X & (LBLOCKSIZE - 1))
+
+#if LONG_MAX == 2147483647L
+#define ONES  0x01010101UL
+#else
+#if LONG_MAX == 9223372036854775807L
+#define ONES  0x0101010101010101UL
+#else
+#error long int is not a 32bit or 64bit type.
+#endif
+#endif
+
+/* Nonzero if X contains a NULL byte */
+#define DETECTNULL(X) (((X) - ONES) & ~(X) & (ONES << 7))
+/* Nonzero if X contains a CR or a LF */
+#define DETECTEOL(X)  (DETECTNULL((X) ^ (ONES * '\r')) | \
+                       DETECTNULL((X) ^ (ONES * '\n')))
+
+#define ISEOL(c) ((c) == '\r' || (c) == '\n')
+
+void *memeol(const void *src, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)src;
+
+#if !defined(PREFER_SIZE_OVER_SPEED) && !defined(__OPTIMIZE_SIZE__)
+    /* check bytes up to a word boundary, then a word at a time until the
+       word that has one in it */
+    while (len && UNALIGNED(s))
+    {
+        if (ISEOL(*s))
+            return (void *)s;
+        s++, len--;
+    }
+
+    const unsigned long *aligned_addr = (const unsigned long *)s;
+
+    while (len >= LBLOCKSIZE && !DETECTEOL(*aligned_addr))
+    {
+        aligned_addr++;
+        len -= LBLOCKSIZE;
+    }
+
+    s = (const unsigned char *)aligned_addr;
+#endif /* not PREFER_SIZE_OVER_SPEED */
+
+    while (len--)
+    {
+        if (ISEOL(*s))
+            return (void *)s;
+        s++;
+    }
+
+    return NULL;
+}
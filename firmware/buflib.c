@@ -53,13 +53,15 @@
  * array there's a length marker for the length of the character array including
  * this length marker (counted in n*sizeof(union buflib_data)), which allows
  * to find the start of the character array (and therefore the start of the
- * entire block) when only the handle or payload start is known.
+ * entire block) when only the handle or payload start is known. The payload
+ * is followed by a copy of the length marker, so that the block before any
+ * other block can be found from the last unit in front of it.
  *
  * UPDATE BUFLIB_ALLOC_OVERHEAD (buflib.h) WHEN THE METADATA CHANGES!
  *
  * Example:
- * |<- alloc block #1 ->|<- unalloc block ->|<- alloc block #2      ->|<-handle table->|
- * |L|H|C|cccc|L2|crc|XXXXXX|-L|YYYYYYYYYYYYYYYY|L|H|C|cc|L2|crc|XXXXXXXXXXXXX|AAA|
+ * |<- alloc block #1   ->|<- unalloc block ->|<- alloc block #2        ->|<-handle table->|
+ * |L|H|C|cccc|L2|crc|XXXXXX|L|-L|YYYYYYYYYYYYY|-L|L|H|C|cc|L2|crc|XXXXXXXXXX|L|AAA|
  *
  * L - length marker (negative if block unallocated)
  * H - handle table entry pointer
@@ -80,6 +82,24 @@
  * The allocator functions are passed a context struct so that two allocators
  * can be run, for example, one per core may be used, with convenience wrappers
  * for the single-allocator case that use a predefined context.
+ *
+ * Free blocks big enough to take an allocation are indexed in lists by size
+ * class, so neither allocating nor freeing has to walk the blocks. Such a free
+ * block looks like this:
+ *
+ * |-L|N|P|YYYYYYYY|-L|
+ *
+ * N - next free block of the same class (or NULL)
+ * P - previous free block of the same class (or NULL)
+ * -L - second length marker at the end, to find the block from the one after
+ *
+ * Smaller free blocks only carry the two length markers (a single one if the
+ * block is one unit long) and compaction takes care of those. While the
+ * index is valid every block ends in its length marker, positive for
+ * allocated and negative for free ones, so a freed block sees in constant
+ * time whether it can be merged with the one before it. The index is dropped
+ * by anything moving blocks around and built again with a single walk by the
+ * next allocation.
  */
 
 #define B_ALIGN_DOWN(x) \
@@ -98,10 +118,90 @@
 #define BPANICF panicf
 
 #define IS_MOVABLE(a) (!a[2].ops || a[2].ops->move_callback)
+
+/* Smallest free block kept in the free lists: nothing smaller can fit an
+ * allocation, which takes at least 5 units of metadata */
+#define BUFLIB_MIN_FREE 5
 static union buflib_data* find_first_free(struct buflib_context *ctx);
 static union buflib_data* find_block_before(struct buflib_context *ctx,
                                             union buflib_data* block,
                                             bool is_free);
+
+/* Return the size class of a free block of len units */
+static inline int free_list_class(intptr_t len)
+{
+    int list = 0;
+    while (list < BUFLIB_NUM_FREE_LISTS - 1 && (len >> (list + 3)))
+        list++;
+    return list;
+}
+
+/* Mark len units at block free and index them if they're big enough */
+static void free_list_add(struct buflib_context *ctx, union buflib_data *block,
+                          intptr_t len)
+{
+    block->val = -len;
+    block[len - 1].val = -len;
+    if (len < BUFLIB_MIN_FREE)
+        return;
+
+    union buflib_data **head = &ctx->free_lists[free_list_class(len)];
+    block[1].link = *head;
+    block[2].link = NULL;
+    if (*head)
+        (*head)[2].link = block;
+    *head = block;
+}
+
+/* Take an indexed free block out of its list */
+static void free_list_remove(struct buflib_context *ctx,
+                             union buflib_data *block)
+{
+    union buflib_data *next = block[1].link, *prev = block[2].link;
+    if (prev)
+        prev[1].link = next;
+    else
+        ctx->free_lists[free_list_class(-block->val)] = next;
+    if (next)
+        next[2].link = prev;
+}
+
+/* Index all free blocks, merging the adjacent ones on the way */
+static void free_index_build(struct buflib_context *ctx)
+{
+    union buflib_data *block, *run = NULL;
+
+    memset(ctx->free_lists, 0, sizeof(ctx->free_lists));
+    for (block = ctx->buf_start; block < ctx->alloc_end; block += abs(block->val))
+    {
+        if (block->val > 0)
+        {
+            if (run)
+                free_list_add(ctx, run, block - run);
+            run = NULL;
+        }
+        else if (!run)
+            run = block;
+    }
+
+    if (run) /* free space right before alloc_end belongs to it */
+        ctx->alloc_end = run;
+
+    ctx->free_index = true;
+    /* blocks were merged, the cursor might point into one of them now */
+    ctx->compact_cursor = ctx->buf_start;
+}
+
+/* Return the free block ending right before block, NULL if that one is
+ * allocated. Only valid while the index is. */
+static inline union buflib_data* free_block_before(struct buflib_context *ctx,
+                                                   union buflib_data *block)
+{
+    if (block == ctx->buf_start || block[-1].val > 0)
+        return NULL;
+
+    return block + block[-1].val;
+}
 /* Initialize buffer manager */
 void
 buflib_init(struct buflib_context *ctx, void *buf, size_t size)
@@ -122,7 +222,11 @@ buflib_init(struct buflib_context *ctx, void *buf, size_t size)
      * does not collide with the handle table, and to detect end-of-buffer.
      */
     ctx->alloc_end = bd_buf;
+    memset(ctx->free_lists, 0, sizeof(ctx->free_lists));
+    ctx->free_index = true;
     ctx->compact = true;
+    ctx->compact_cursor = bd_buf;
+    memset(&ctx->compact_stats, 0, sizeof(ctx->compact_stats));
 }
 
 bool buflib_context_relocate(struct buflib_context *ctx, void *buf)
@@ -147,6 +251,8 @@ bool buflib_context_relocate(struct buflib_context *ctx, void *buf)
     ctx->first_free_handle  += diff;
     ctx->buf_start          += diff;
     ctx->alloc_end          += diff;
+    /* the free list links point into the old buffer */
+    ctx->free_index = false;
 
     return true;
 }
@@ -277,8 +383,11 @@ move_block(struct buflib_context* ctx, union buflib_data* block, int shift)
     if (!ops || ops->move_callback(handle, tmp->alloc, new_start)
                     != BUFLIB_CB_CANNOT_MOVE)
     {
+        size_t size = block->val * sizeof(union buflib_data);
         tmp->alloc = new_start; /* update handle table */
-        memmove(new_block, block, block->val * sizeof(union buflib_data));
+        memmove(new_block, block, size);
+        ctx->compact_stats.blocks_moved++;
+        ctx->compact_stats.bytes_moved += size;
         retval = true;
     }
 
@@ -298,8 +407,11 @@ buflib_compact(struct buflib_context *ctx)
     union buflib_data *block,
                       *hole = NULL;
     int shift = 0, len;
+    unsigned long moved = ctx->compact_stats.bytes_moved;
     /* Store the results of attempting to shrink the handle table */
     bool ret = handle_table_shrink(ctx);
+    /* blocks are moved around without caring for the free lists */
+    ctx->free_index = false;
     /* compaction has basically two modes of operation:
      *  1) the buffer is nicely movable: In this mode, blocks can be simply
      * moved towards the beginning. Free blocks add to a shift value,
@@ -368,9 +480,123 @@ buflib_compact(struct buflib_context *ctx)
      */
     ctx->alloc_end += shift;
     ctx->compact = true;
+
+    moved = ctx->compact_stats.bytes_moved - moved;
+    ctx->compact_stats.runs++;
+    if (moved > ctx->compact_stats.max_pause)
+        ctx->compact_stats.max_pause = moved;
+
     return ret || shift;
 }
 
+/* Unlink a free block from the lists, if it's in one */
+static inline void free_list_take(struct buflib_context *ctx,
+                                  union buflib_data *block)
+{
+    if (block->val <= -BUFLIB_MIN_FREE)
+        free_list_remove(ctx, block);
+}
+
+/* Compact incrementally: walk up from where the last slice stopped and slide
+ * each movable block down into the free block in front of it, which carries
+ * the free space up with it, until budget bytes have been moved.
+ */
+bool
+buflib_compact_slice(struct buflib_context *ctx, size_t budget)
+{
+    union buflib_data *block, *next;
+    unsigned long moved = ctx->compact_stats.bytes_moved;
+    intptr_t len, next_len;
+
+    if (ctx->compact)
+        return false;
+
+    /* slices keep the free lists up to date as they go */
+    if (!ctx->free_index)
+        free_index_build(ctx);
+
+    block = ctx->compact_cursor;
+    while (ctx->compact_stats.bytes_moved - moved < budget)
+    {
+        /* find the next free block */
+        while (block < ctx->alloc_end && block->val > 0)
+            block += block->val;
+
+        if (block >= ctx->alloc_end)
+            break;
+
+        len = -block->val;
+        next = block + len;
+        if (next >= ctx->alloc_end)
+        {   /* free space at the end, give it back to alloc_end */
+            free_list_take(ctx, block);
+            ctx->alloc_end = block;
+            break;
+        }
+
+        next_len = next->val;
+        if (next_len < 0)
+        {   /* small free blocks aren't merged on free, do it now */
+            free_list_take(ctx, block);
+            free_list_take(ctx, next);
+            free_list_add(ctx, block, len - next_len);
+            continue;
+        }
+
+        /* leave blocks that are expensive to move to full compaction, and
+         * the hole in front of the ones without a move callback to the
+         * allocations */
+        if ((size_t)next_len * sizeof(union buflib_data) > budget ||
+            !next[2].ops || !next[2].ops->move_callback)
+        {
+            block = next + next_len;
+            continue;
+        }
+
+        /* moving overwrites the list links */
+        free_list_take(ctx, block);
+        if (!move_block(ctx, next, -len))
+        {
+            free_list_add(ctx, block, len);
+            block = next + next_len;
+            continue;
+        }
+
+        /* the free space is behind the moved block now, merge it with
+         * what follows */
+        block += next_len;
+        next = block + len;
+        if (next >= ctx->alloc_end)
+        {
+            ctx->alloc_end = block;
+            break;
+        }
+        if (next->val < 0)
+        {
+            free_list_take(ctx, next);
+            len -= next->val;
+            if (block + len >= ctx->alloc_end)
+            {
+                ctx->alloc_end = block;
+                break;
+            }
+        }
+        free_list_add(ctx, block, len);
+    }
+
+    ctx->compact_cursor = block;
+
+    moved = ctx->compact_stats.bytes_moved - moved;
+    if (moved)
+    {
+        ctx->compact_stats.slices++;
+        if (moved > ctx->compact_stats.max_pause)
+            ctx->compact_stats.max_pause = moved;
+    }
+
+    return block < ctx->alloc_end;
+}
+
 /* Compact the buffer by trying both shrinking and moving.
  *
  * Try to move first. If unsuccesfull, try to shrink. If that was successful
@@ -412,7 +638,7 @@ buflib_compact_and_shrink(struct buflib_context *ctx, unsigned shrink_hints)
                     shrink_hints = pos_hints | wanted;
                 }
                 ret = this[2].ops->shrink_callback(handle, shrink_hints,
-                                            data, (char*)(this+this->val)-data);
+                                            data, (char*)(this+this->val-1)-data);
                 result |= (ret == BUFLIB_CB_OK);
                 /* 'this' might have changed in the callback (if it shrinked
                  * from the top or even freed the handle), get it again */
@@ -444,6 +670,7 @@ buflib_buffer_shift(struct buflib_context *ctx, int shift)
         (ctx->alloc_end - ctx->buf_start) * sizeof(union buflib_data));
     ctx->buf_start += shift;
     ctx->alloc_end += shift;
+    ctx->free_index = false;
     shift *= sizeof(union buflib_data);
     union buflib_data *handle;
     for (handle = ctx->last_handle; handle < ctx->handle_table; handle++)
@@ -513,9 +740,9 @@ buflib_alloc_ex(struct buflib_context *ctx, size_t size, const char *name,
     size += name_len;
     size = (size + sizeof(union buflib_data) - 1) /
            sizeof(union buflib_data)
-           /* add 5 objects for alloc len, pointer to handle table entry and
-            * name length, the ops pointer and crc */
-           + 5;
+           /* add 6 objects for alloc len, pointer to handle table entry and
+            * name length, the ops pointer, crc and the trailing alloc len */
+           + 6;
 handle_alloc:
     handle = handle_alloc(ctx);
     if (!handle)
@@ -549,7 +776,26 @@ buffer_alloc:
     /* need to re-evaluate last before the loop because the last allocation
      * possibly made room in its front to fit this, so last would be wrong */
     last = false;
-    for (block = find_first_free(ctx);;block += block_len)
+    if (!ctx->free_index)
+        free_index_build(ctx);
+    /* Any block of a bigger class fits, only the own class and the last one
+     * need to be searched. Fragmentation this causes will be handled at
+     * compaction.
+     */
+    block = NULL;
+    for (int list = free_list_class(size);
+         list < BUFLIB_NUM_FREE_LISTS && !block; list++)
+    {
+        for (block = ctx->free_lists[list]; block; block = block[1].link)
+        {
+            block_len = -block->val;
+            if ((size_t)block_len >= size)
+                break;
+        }
+    }
+    if (block)
+        free_list_remove(ctx, block);
+    else
     {
         /* If the last used block extends all the way to the handle table, the
          * block "after" it doesn't have a header. Because of this, it's easier
@@ -557,24 +803,11 @@ buffer_alloc:
          * calculate the free space at the end by comparing it to the
          * last_handle pointer.
          */
-        if(block == ctx->alloc_end)
-        {
-            last = true;
-            block_len = ctx->last_handle - block;
-            if ((size_t)block_len < size)
-                block = NULL;
-            break;
-        }
-        block_len = block->val;
-        /* blocks with positive length are already allocated. */
-        if(block_len > 0)
-            continue;
-        block_len = -block_len;
-        /* The search is first-fit, any fragmentation this causes will be
-         * handled at compaction.
-         */
-        if ((size_t)block_len >= size)
-            break;
+        last = true;
+        block = ctx->alloc_end;
+        block_len = ctx->last_handle - block;
+        if ((size_t)block_len < size)
+            block = NULL;
     }
     if (!block)
     {
@@ -607,6 +840,7 @@ buffer_alloc:
                            (crc_slot - block)*sizeof(union buflib_data),
                            0xffffffff);
     handle->alloc = (char*)(crc_slot + 1);
+    block[size - 1].val = size;
 
     BDEBUGF("buflib_alloc_ex: size=%d handle=%p clb=%p crc=0x%0x name=\"%s\"\n",
             (unsigned int)size, (void *)handle, (void *)ops,
@@ -618,7 +852,7 @@ buffer_alloc:
         ctx->alloc_end = block;
     /* Only free blocks *before* alloc_end have tagged length. */
     else if ((size_t)block_len > size)
-        block->val = size - block_len;
+        free_list_add(ctx, block, block_len - size);
     /* Return the handle index as a positive integer. */
     return ctx->handle_table - handle;
 }
@@ -674,7 +908,15 @@ buflib_free(struct buflib_context *ctx, int handle_num)
     /* We need to find the block before the current one, to see if it is free
      * and can be merged with this one.
      */
-    block = find_block_before(ctx, freed_block, true);
+    if (ctx->free_index)
+    {
+        block = free_block_before(ctx, freed_block);
+        if (block)
+            free_list_take(ctx, block);
+    }
+    else
+        block = find_block_before(ctx, freed_block, true);
+
     if (block)
     {
         block->val -= freed_block->val;
@@ -698,8 +940,16 @@ buflib_free(struct buflib_context *ctx, int handle_num)
     else {
         ctx->compact = false;
         if (next_block->val < 0)
+        {
+            if (ctx->free_index && next_block->val <= -BUFLIB_MIN_FREE)
+                free_list_remove(ctx, next_block);
             block->val += next_block->val;
+        }
+        if (ctx->free_index)
+            free_list_add(ctx, block, -block->val);
     }
+    if (block < ctx->compact_cursor)
+        ctx->compact_cursor = block;
     handle_free(ctx, handle);
     handle->alloc = NULL;
 
@@ -709,9 +959,10 @@ buflib_free(struct buflib_context *ctx, int handle_num)
 static size_t
 free_space_at_end(struct buflib_context* ctx)
 {
-    /* subtract 5 elements for
-     * val, handle, name_len, ops and the handle table entry*/
-    ptrdiff_t diff = (ctx->last_handle - ctx->alloc_end - 5);
+    /* subtract 7 elements for
+     * val, handle, name_len, ops, crc, trailing val and the handle table
+     * entry */
+    ptrdiff_t diff = (ctx->last_handle - ctx->alloc_end - 7);
     diff -= 16; /* space for future handles */
     diff *= sizeof(union buflib_data); /* make it bytes */
     diff -= 16; /* reserve 16 for the name */
@@ -841,17 +1092,23 @@ buflib_shrink(struct buflib_context* ctx, int handle, void* new_start, size_t ne
                  * needn't be since it's only dereferenced by the user code */
                       *aligned_newstart = (union buflib_data*)B_ALIGN_DOWN(newstart),
                       *aligned_oldstart = (union buflib_data*)B_ALIGN_DOWN(oldstart),
-                      *new_next_block =   (union buflib_data*)B_ALIGN_UP(newend),
+                      /* leave room for the trailing length marker */
+                      *new_next_block =   (union buflib_data*)B_ALIGN_UP(newend) + 1,
                       *new_block, metadata_size;
 
     /* growing is not supported */
     if (new_next_block > old_next_block)
         return false;
 
+    /* free blocks around this one change, leave the free lists to be built
+     * again */
+    ctx->free_index = false;
+
     metadata_size.val = aligned_oldstart - block;
     /* update val and the handle table entry */
     new_block = aligned_newstart - metadata_size.val;
     block[0].val = new_next_block - new_block;
+    new_next_block[-1].val = block[0].val;
 
     block[1].handle->alloc = newstart;
     if (block != new_block)
@@ -941,6 +1198,12 @@ void buflib_check_valid(struct buflib_context *ctx)
 }
 #endif
 
+const struct buflib_compact_stats*
+buflib_get_compact_stats(struct buflib_context *ctx)
+{
+    return &ctx->compact_stats;
+}
+
 #ifdef BUFLIB_DEBUG_BLOCKS
 void buflib_print_allocs(struct buflib_context *ctx,
                                         void (*print)(int, const char*))
@@ -25,6 +25,7 @@
 #include "string-extra.h"
 #include <stdbool.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "debug.h"
 #include "system.h"
 #include "logf.h"
@@ -41,7 +42,7 @@
 #include "audio.h"
 #include "rbpaths.h"
 #include "linked_list.h"
-#ifdef HAVE_EEPROM_SETTINGS
+#ifdef DIRCACHE_SNAPSHOT
 #include "crc32.h"
 #endif
 
@@ -92,6 +93,18 @@
  *
  * r0->r1->r2->q0->q1->q2->NULL
  * ^resolved0  ^queued0
+ *
+ * Name indexes:
+ * Opening a path looks up each component in its parent. Finding a name in a
+ * directory with thousands of entries by scanning means copying and comparing
+ * every name ahead of it, so a directory that is fully cached and big enough
+ * gets an open-addressed table of its entry indexes, keyed by a case-folded
+ * hash of the decoded names, in its own allocation. The tables may take up to
+ * half the size of the cache; one that was used recently is never dropped to
+ * make room for another, that directory is scanned instead. Any change to a
+ * directory's entries or names drops its table; it is rebuilt by the next
+ * lookup. The tables can be freed whenever memory is needed, lookups simply
+ * go back to scanning then.
  */
 
 #ifdef DIRCACHE_NATIVE
@@ -154,6 +167,19 @@ enum
 #define MAX_TINYNAME   sizeof (uint32_t)
 #define DC_MAX_NAME    MIN(MAX_NAME, UINT8_MAX)
 
+/* directories with at least this many entries get a name index on lookup */
+#ifndef DIRHASH_MIN_ENTRIES
+#define DIRHASH_MIN_ENTRIES 64
+#endif
+#define DIRHASH_NUM    128 /* most directories indexed at the same time */
+/* an index used within this many lookups isn't replaced, the directory that
+   wanted its place is scanned instead */
+#define DIRHASH_KEEP   (2*DIRHASH_NUM)
+/* the indexes together may take this much memory for a cache of 'size'
+   bytes; that's at least 8 bytes per entry so any one directory fits */
+#define DIRHASH_BUDGET(size) ((size) / 2)
+#define DIRCHANGE_NUM  8 /* number of directories whose last change is kept */
+
 /* Throw some warnings if about the limits if things may not work */
 #if MAX_NAME > UINT8_MAX
 #warning Need more than 8 bits in name length bitfield
@@ -211,7 +237,7 @@ static struct dircache
     size_t       sizeused;            /* bytes of .size bytes actually used */
     union {
     unsigned int numentries;          /* entry count (including holes) */
-#ifdef HAVE_EEPROM_SETTINGS
+#ifdef DIRCACHE_SNAPSHOT
     size_t       sizeentries;         /* used when persisting */
 #endif
     };
@@ -261,7 +287,27 @@ static struct dircache_runinfo
         struct file_base_binding *resolved0; /* first resolved binding in list */
         struct file_base_binding *queued0;   /* first queued binding in list */
         struct sab               *sabp;      /* if building, struct sab in use */
+        bool                     snapshot;   /* loaded contents not verified */
     } dcrivol[NUM_VOLUMES];
+    /* name indexes of large directories */
+    struct dirhash
+    {
+        int           handle;      /* buflib handle of the slots (0 = none) */
+        int           diridx;      /* cache index of the directory */
+        dc_serial_t   serialnum;   /* serial number of the directory */
+        unsigned int  mask;        /* number of slots - 1 */
+        unsigned long lastuse;     /* for replacement */
+    } dirhash[DIRHASH_NUM];
+    unsigned long dirhash_clock;   /* lookups so far */
+    size_t        dirhash_size;    /* bytes taken by all the indexes */
+    unsigned long changes;         /* count of name changes and mounts */
+    /* directories whose names changed most recently */
+    struct dirchange
+    {
+        int           diridx;      /* cache index of the directory (0 = none) */
+        unsigned long changes;     /* .changes as of its last change */
+    } dirchange[DIRCHANGE_NUM];
+    unsigned long dirchange_floor; /* .changes of the newest one forgotten */
 } dircache_runinfo;
 
 #define BINDING_NEXT(bindp) \
@@ -287,6 +333,7 @@ static struct dircache_runinfo
 
 #define DCRIVOL_i(i)             (&dircache_runinfo.dcrivol[i])
 #define DCRIVOL_infop(infop)     (&dircache_runinfo.dcrivol[BASEINFO_VOL(infop)])
+#define DCRIVOL_dirinfop(dirinfop) (&dircache_runinfo.dcrivol[BASEINFO_VOL(dirinfop)])
 #define DCRIVOL_bindp(bindp)     (&dircache_runinfo.dcrivol[BASEBINDING_VOL(bindp)])
 #define DCRIVOL(x)               DCRIVOL_##x(x)
 
@@ -294,7 +341,7 @@ static struct dircache_runinfo
 #define DIRCACHE_STUFFED(reserve_used) \
     ((reserve_used) > 3*DIRCACHE_RESERVE / 4)
 
-#ifdef HAVE_EEPROM_SETTINGS
+#ifdef DIRCACHE_SNAPSHOT
 /**
  * remove the snapshot file
  */
@@ -310,7 +357,7 @@ static int open_dircache_file(int oflag)
 {
     return open(DIRCACHE_FILE, oflag, 0666);
 }
-#endif /* HAVE_EEPROM_SETTINGS */
+#endif /* DIRCACHE_SNAPSHOT */
 
 #ifdef DIRCACHE_DUMPSTER
 /**
@@ -741,6 +788,257 @@ static void entry_name_copy(char *dst, const struct dircache_entry *ce)
     *dst = '\0';
 }
 
+/**
+ * copy the entry's name as a directory scan returns it once it's decoded
+ */
+static void entry_name_copy_decoded(char *dst, const struct dircache_entry *ce)
+{
+    entry_name_copy(dst, ce);
+
+    if (ce->direntries == 1)
+        iso_decode_d_name(dst);
+}
+
+/**
+ * does the entry have exactly this name?
+ */
+static bool entry_name_is(const struct dircache_entry *ce, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (ce->tinyname)
+    {
+        return len <= MAX_TINYNAME &&
+               !strncmp((const char *)ce->namebuf, name, MAX_TINYNAME);
+    }
+
+    return len == ce->length && !memcmp(get_name(ce->name), name, len);
+}
+
+/**
+ * is the entry a "." or ".." directory?
+ */
+static inline bool entry_is_dotdir(const struct dircache_entry *ce)
+{
+    return ce->tinyname && is_dotdir_name((const char *)ce->namebuf);
+}
+
+/**
+ * hash a name the way strcasecmp() compares it
+ */
+static uint32_t dirhash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const unsigned char *p = name; *p; p++)
+        hash = (hash ^ tolower(*p)) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * free a directory's name index
+ */
+static void dirhash_release(struct dirhash *dhp)
+{
+    int handle = dhp->handle;
+    dhp->handle = 0;
+
+    if (handle > 0)
+    {
+        dircache_runinfo.dirhash_size -= (dhp->mask + 1)*sizeof (int);
+        core_free(handle);
+    }
+}
+
+/**
+ * drop the name index of the directory because its entries changed
+ */
+static void dirhash_invalidate(int diridx)
+{
+    for (unsigned int i = 0; i < DIRHASH_NUM; i++)
+    {
+        struct dirhash *dhp = &dircache_runinfo.dirhash[i];
+        if (dhp->handle && dhp->diridx == diridx)
+            dirhash_release(dhp);
+    }
+}
+
+/**
+ * note that the entries of the directory changed; the oldest record is
+ * given up for it if it has none yet
+ */
+static void dirchange_note(int diridx)
+{
+    struct dirchange *dcp = &dircache_runinfo.dirchange[0];
+
+    for (unsigned int i = 0; i < DIRCHANGE_NUM; i++)
+    {
+        struct dirchange *p = &dircache_runinfo.dirchange[i];
+        if (p->diridx == diridx)
+        {
+            dcp = p;
+            break;
+        }
+
+        if (p->changes < dcp->changes)
+            dcp = p;
+    }
+
+    if (dcp->diridx != diridx &&
+        dcp->changes > dircache_runinfo.dirchange_floor)
+        dircache_runinfo.dirchange_floor = dcp->changes;
+
+    dcp->diridx  = diridx;
+    dcp->changes = ++dircache_runinfo.changes;
+}
+
+/**
+ * the entries of the directory changed: drop its name index and remember it
+ */
+static void directory_changed(int diridx)
+{
+    dirhash_invalidate(diridx);
+    dirchange_note(diridx);
+}
+
+/**
+ * drop all name indexes
+ */
+static void dirhash_reset(void)
+{
+    for (unsigned int i = 0; i < DIRHASH_NUM; i++)
+        dirhash_release(&dircache_runinfo.dirhash[i]);
+}
+
+static int dirhash_move_callback(int handle, void *current, void *new)
+{
+    return BUFLIB_CB_OK;
+    (void)handle; (void)current; (void)new;
+}
+
+static int dirhash_shrink_callback(int handle, unsigned hints, void *start,
+                                   size_t old_size)
+{
+    /* an index can always be rebuilt; just give it up */
+    for (unsigned int i = 0; i < DIRHASH_NUM; i++)
+    {
+        if (dircache_runinfo.dirhash[i].handle == handle)
+        {
+            dirhash_release(&dircache_runinfo.dirhash[i]);
+            return BUFLIB_CB_OK;
+        }
+    }
+
+    core_free(handle);
+    return BUFLIB_CB_OK;
+    (void)hints; (void)start; (void)old_size;
+}
+
+/**
+ * return the name index of the directory, building it if needed; NULL if the
+ * directory is too small to need one or there's no memory for it
+ *
+ * 'namebuf' is scratch space for decoded names
+ */
+static struct dirhash * dirhash_get(int diridx, dc_serial_t serialnum,
+                                    char *namebuf)
+{
+    static struct buflib_callbacks ops =
+    {
+        .move_callback   = dirhash_move_callback,
+        .shrink_callback = dirhash_shrink_callback,
+    };
+
+    struct dirhash *dhp = NULL;
+    unsigned long now = ++dircache_runinfo.dirhash_clock;
+
+    for (unsigned int i = 0; i < DIRHASH_NUM; i++)
+    {
+        struct dirhash *p = &dircache_runinfo.dirhash[i];
+        if (!p->handle)
+        {
+            dhp = p; /* an unused one */
+        }
+        else if (p->diridx == diridx && p->serialnum == serialnum)
+        {
+            p->lastuse = now;
+            return p;
+        }
+    }
+
+    unsigned int count = 0;
+    for (int idx = *get_downidxp(diridx); idx; idx = get_entry(idx)->next)
+        count++;
+
+    if (count < DIRHASH_MIN_ENTRIES)
+        return NULL; /* a scan is fast enough */
+
+    /* keep it at most half full */
+    unsigned int numslots = 2*DIRHASH_MIN_ENTRIES;
+    while (numslots < 2*count)
+        numslots *= 2;
+
+    size_t size = numslots*sizeof (int);
+    size_t budget = DIRHASH_BUDGET(dircache.size);
+    if (size > budget)
+        return NULL;
+
+    /* make room by dropping the least recently used indexes unless they're
+       still in use; rebuilding them in turn would be slower than scanning */
+    while (!dhp || dircache_runinfo.dirhash_size + size > budget)
+    {
+        struct dirhash *lru = NULL;
+
+        for (unsigned int i = 0; i < DIRHASH_NUM; i++)
+        {
+            struct dirhash *p = &dircache_runinfo.dirhash[i];
+            if (p->handle && (!lru || p->lastuse < lru->lastuse))
+                lru = p;
+        }
+
+        if (!lru)
+            break;
+
+        if (now - lru->lastuse < DIRHASH_KEEP)
+            return NULL;
+
+        dirhash_release(lru);
+        dhp = lru;
+    }
+
+    int handle = core_alloc_ex("dircache hash", size, &ops);
+    if (handle <= 0)
+        return NULL;
+
+    memset(core_get_data(handle), 0, size);
+
+    dircache_runinfo.dirhash_size += size;
+    dhp->handle    = handle;
+    dhp->diridx    = diridx;
+    dhp->serialnum = serialnum;
+    dhp->mask      = numslots - 1;
+    dhp->lastuse   = now;
+
+    for (int idx = *get_downidxp(diridx); idx; idx = get_entry(idx)->next)
+    {
+        entry_name_copy_decoded(namebuf, get_entry(idx));
+
+        /* decoding may block; make sure the index is still around */
+        if (dhp->handle != handle)
+            return NULL;
+
+        int *slots = core_get_data(handle);
+        unsigned int i = dirhash_name(namebuf) & dhp->mask;
+        while (slots[i])
+            i = (i + 1) & dhp->mask;
+
+        slots[i] = idx;
+    }
+
+    return dhp;
+}
+
 /**
  * set the namesfree hint to a new position
  */
@@ -914,6 +1212,8 @@ static bool entry_reassign_name(struct dircache_entry *ce,
     size_t oldlen = ce->tinyname ? 0 : ce->length;
     size_t newlen = strlen(newname);
 
+    directory_changed(ce->up);
+
     if (oldlen == newlen || (oldlen == 0 && newlen <= MAX_TINYNAME))
     {
         char *p = mempcpy(oldlen == 0 ? ce->namebuf : get_name(ce->name),
@@ -1040,6 +1340,7 @@ static void remove_entry(struct dircache_runinfo_volume *dcrivolp,
 {
     /* unlink it from its list */
     *prevp = ce->next;
+    directory_changed(ce->up);
 
     if (dcrivolp)
     {
@@ -1071,16 +1372,12 @@ static void free_subentries(struct dircache_runinfo_volume *dcrivolp, int *downp
 }
 
 /**
- * free the specified file entry and its children
+ * free the entry referenced by *prevp and its children
  */
-static void free_file_entry(struct file_base_info *infop)
+static void free_listed_entry(struct dircache_runinfo_volume *dcrivolp,
+                              int *prevp)
 {
-    int idx = infop->dcfile.idx;
-    if (idx <= 0)
-        return; /* can't remove a root/invalid */
-
-    struct dircache_runinfo_volume *dcrivolp = DCRIVOL(infop);
-
+    int idx = *prevp;
     struct dircache_entry *ce = get_entry(idx);
     if ((ce->attr & ATTR_DIRECTORY) && ce->down)
     {
@@ -1088,10 +1385,22 @@ static void free_file_entry(struct file_base_info *infop)
         free_subentries(dcrivolp, &ce->down);
     }
 
-    remove_entry(dcrivolp, ce, get_previdxp(idx));
+    remove_entry(dcrivolp, ce, prevp);
     free_orphan_entry(dcrivolp, ce, idx);
 }
 
+/**
+ * free the specified file entry and its children
+ */
+static void free_file_entry(struct file_base_info *infop)
+{
+    int idx = infop->dcfile.idx;
+    if (idx <= 0)
+        return; /* can't remove a root/invalid */
+
+    free_listed_entry(DCRIVOL(infop), get_previdxp(idx));
+}
+
 /**
  * insert the new entry into the parent, sorted into position
  */
@@ -1134,6 +1443,8 @@ static void insert_file_entry(struct file_base_info *dirinfop,
     ce->up   = diridx;
     ce->next = *nextp;
     *nextp   = get_index(ce);
+
+    directory_changed(diridx);
 }
 
 /**
@@ -1216,6 +1527,54 @@ static void process_events(void)
 }
 
 #if defined (DIRCACHE_NATIVE)
+/**
+ * is the entry still the one the storage has in its place?
+ */
+static bool entry_is_fatent(const struct dircache_entry *ce,
+                            const struct fat_direntry *fatentp)
+{
+    return ce->firstcluster == fatentp->firstcluster &&
+           !((ce->attr ^ fatentp->attr) & ATTR_DIRECTORY) &&
+           entry_name_is(ce, fatentp->name);
+}
+
+/**
+ * bring the entry up to date with what may change without it being replaced
+ */
+static void entry_refresh(struct dircache_entry *ce,
+                          const struct fat_direntry *fatentp)
+{
+    if (!(ce->attr & ATTR_DIRECTORY))
+        ce->filesize = fatentp->filesize;
+
+    ce->attr    = fatentp->attr;
+    ce->wrtdate = fatentp->wrtdate;
+    ce->wrttime = fatentp->wrttime;
+}
+
+/**
+ * does the entry loaded from a snapshot still match the storage? only its
+ * own directory entry is read from the directory open on the stream
+ */
+static bool snapshot_entry_check(struct filestr_base *stream, int idx,
+                                 struct file_base_info *infop,
+                                 struct fat_direntry *fatent)
+{
+    struct dircache_entry *ce = get_entry(idx);
+
+    /* read from just ahead of its long name entries */
+    infop->fatfile.e.entry = ce->direntry - ce->direntries;
+    int rc = uncached_readdir_internal(stream, infop, fatent);
+
+    ce = get_entry(idx);
+    if (rc <= 0 || infop->fatfile.e.entry != ce->direntry ||
+        !entry_is_fatent(ce, fatent))
+        return false;
+
+    entry_refresh(ce, fatent);
+    return true;
+}
+
 /**
  * scan and build the contents of a subdirectory
  */
@@ -1224,6 +1583,7 @@ static void sab_process_sub(struct sab *sabp)
     struct fat_direntry *const fatentp = get_dir_fatent();
     struct filestr_base *const streamp = &sabp->stream;
     struct file_base_info *const infop = &sabp->info;
+    struct dircache_runinfo_volume *const dcrivolp = DCRIVOL(infop);
 
     int idx = infop->dcfile.idx;
     int *downp = get_downidxp(idx);
@@ -1266,7 +1626,13 @@ static void sab_process_sub(struct sab *sabp)
                 if (rc < 0)
                     sabp->quit = true;
                 else
+                {
+                    /* snapshot entries left over are gone from storage */
+                    while (dcrivolp->snapshot && *compp->prevp)
+                        free_listed_entry(dcrivolp, compp->prevp);
+
                     compp->prevp = downp; /* rewind list */
+                }
 
                 break;
             }
@@ -1274,6 +1640,27 @@ static void sab_process_sub(struct sab *sabp)
             struct dircache_entry *ce;
             int prev = *compp->prevp;
 
+            if (prev && dcrivolp->snapshot)
+            {
+                /* the entries loaded from a snapshot may have been removed
+                   or replaced on the storage since it was saved */
+                while ((prev = *compp->prevp))
+                {
+                    ce = get_entry(prev);
+                    if (ce->direntry > infop->fatfile.e.entry)
+                        break;
+
+                    if (ce->direntry == infop->fatfile.e.entry &&
+                        entry_is_fatent(ce, fatentp))
+                    {
+                        entry_refresh(ce, fatentp);
+                        break;
+                    }
+
+                    free_listed_entry(dcrivolp, compp->prevp);
+                }
+            }
+
             if (prev)
             {
                 /* there are entries ahead of us; they will be what was just
@@ -1301,6 +1688,7 @@ static void sab_process_sub(struct sab *sabp)
             ce->next = prev;
             *compp->prevp = idx;
             compp->prevp = &ce->next;
+            dirhash_invalidate(compp->idx);
 
             if (!(fatentp->attr & ATTR_DIRECTORY))
                 ce->filesize = fatentp->filesize;
@@ -1528,6 +1916,32 @@ void dircache_rewinddir_dirent(struct dirscan_info *scanp)
     dircache_dcfile_init(&scanp->dcscan);
 }
 
+/**
+ * fill in what internal scanning returns for the cache entry
+ */
+static int entry_to_internal(int idx, const struct dircache_entry *ce,
+                             struct file_base_info *infop,
+                             struct fat_direntry *fatent)
+{
+    /* FS entry information that we maintain */
+    fatent->shortname[0]     = '\0';
+    fatent->attr             = ce->attr;
+    /* file code file scanning does not need time information */
+    fatent->filesize         = (ce->attr & ATTR_DIRECTORY) ? 0 : ce->filesize;
+    fatent->firstcluster     = ce->firstcluster;
+
+    /* FS entry directory information */
+    infop->fatfile.e.entry   = ce->direntry;
+    infop->fatfile.e.entries = ce->direntries;
+
+    /* dircache file binding information */
+    infop->dcfile.idx        = idx;
+    infop->dcfile.serialnum  = ce->serialnum;
+
+    /* return whether this needs decoding */
+    return ce->direntries == 1 ? 2 : 1;
+}
+
 /**
  * this function is the back end to file API internal scanning, which requires
  * much more detail about the directory entries; this is allowed to make
@@ -1569,9 +1983,16 @@ int dircache_readdir_internal(struct filestr_base *stream,
            information; otherwise return the uncached read result while
            maintaining the last index */
         int rc = uncached_readdir_internal(stream, infop, fatent);
-        if (rc <= 0 || !ce || ce->direntry > infop->fatfile.e.entry)
+        if (rc <= 0 || !ce || ce->direntry != infop->fatfile.e.entry)
+            return rc;
+
+        /* an unverified snapshot entry may be something else by now or be
+           out of date */
+        if (!entry_is_fatent(ce, fatent))
             return rc;
 
+        entry_refresh(ce, fatent);
+
         /* entry matches next one to read */
     }
     else if (!ce)
@@ -1582,24 +2003,8 @@ int dircache_readdir_internal(struct filestr_base *stream,
         return 0;
     }
 
-    /* FS entry information that we maintain */
     entry_name_copy(fatent->name, ce);
-    fatent->shortname[0]     = '\0';
-    fatent->attr             = ce->attr;
-    /* file code file scanning does not need time information */
-    fatent->filesize         = (ce->attr & ATTR_DIRECTORY) ? 0 : ce->filesize;
-    fatent->firstcluster     = ce->firstcluster;
-
-    /* FS entry directory information */
-    infop->fatfile.e.entry   = ce->direntry;
-    infop->fatfile.e.entries = ce->direntries;
-
-    /* dircache file binding information */
-    infop->dcfile.idx        = idx;
-    infop->dcfile.serialnum  = ce->serialnum;
-
-    /* return whether this needs decoding */
-    int rc = ce->direntries == 1 ? 2 : 1;
+    int rc = entry_to_internal(idx, ce, infop, fatent);
 
     if (frontier == FRONTIER_SETTLED)
     {
@@ -1623,6 +2028,84 @@ void dircache_rewinddir_internal(struct file_base_info *infop)
     dircache_dcfile_init(&infop->dcfile);
 }
 
+/**
+ * look for the name in a rewound internal scan's directory without scanning
+ * it; large directories get a name index for this
+ *
+ * returns > 0 if found, with the results a scan would have given and the name
+ * already decoded, 0 if it doesn't exist or < 0 if the directory has to be
+ * scanned instead
+ */
+int dircache_lookup_internal(struct filestr_base *stream, const char *name,
+                             struct file_base_info *infop,
+                             struct fat_direntry *fatent)
+{
+    /* call with writer exclusion */
+    struct file_base_info *dirinfop = stream->infop;
+
+    /* is parent cached? */
+    if (!dirinfop->dcfile.serialnum)
+        return -1;
+
+    int diridx = dirinfop->dcfile.idx;
+    unsigned int frontier = diridx < 0 ?
+        DCVOL(dirinfop)->frontier : get_entry(diridx)->frontier;
+
+    /* what an unverified snapshot has may be found there but is checked */
+    bool snapshot = frontier != FRONTIER_SETTLED &&
+                    DCRIVOL(dirinfop)->snapshot;
+
+    if (frontier != FRONTIER_SETTLED && !snapshot)
+        return -1; /* only a complete list can say what isn't there */
+
+    struct dirhash *dhp =
+        dirhash_get(diridx, dirinfop->dcfile.serialnum, fatent->name);
+    if (!dhp)
+        return -1;
+
+    int handle = dhp->handle;
+    unsigned int i = dirhash_name(name) & dhp->mask;
+
+    while (1)
+    {
+        /* decoding may block; make sure the index is still around */
+        if (dhp->handle != handle)
+            return -1;
+
+        int idx = ((int *)core_get_data(handle))[i];
+        if (!idx)
+            break;
+
+        entry_name_copy_decoded(fatent->name, get_entry(idx));
+
+        if (!strcasecmp(name, fatent->name))
+        {
+            if (snapshot)
+            {
+                if (!snapshot_entry_check(stream, idx, infop, fatent))
+                {
+                    dircache_rewinddir_internal(infop);
+                    return -1;
+                }
+
+                entry_name_copy_decoded(fatent->name, get_entry(idx));
+            }
+
+            entry_to_internal(idx, get_entry(idx), infop, fatent);
+            return 1;
+        }
+
+        i = (i + 1) & dhp->mask;
+    }
+
+    if (snapshot)
+        return -1; /* it may have been added since */
+
+    fat_empty_fat_direntry(fatent);
+    infop->fatfile.e.entries = 0;
+    return 0;
+}
+
 #else /* !DIRCACHE_NATIVE (for all others) */
 
 #####################
@@ -1739,14 +2222,18 @@ int dircache_readdir_r(struct dircache_dirscan *dir, struct dirent *result)
  */
 static void reset_volume(IF_MV_NONVOID(int volume))
 {
+    /* indexes may refer to entries about to go away */
+    dirhash_reset();
+
     FOR_EACH_VOLUME(volume, i)
     {
         struct dircache_volume *dcvolp = DCVOL(i);
+        struct dircache_runinfo_volume *dcrivolp = DCRIVOL(i);
 
-        if (dcvolp->status == DIRCACHE_IDLE)
+        if (dcvolp->status == DIRCACHE_IDLE && !dcrivolp->snapshot)
             continue; /* idle => nothing happening there */
 
-        struct dircache_runinfo_volume *dcrivolp = DCRIVOL(i);
+        dcrivolp->snapshot = false;
 
         /* stop any scan and build on this one */
         if (dcrivolp->sabp)
@@ -1837,6 +2324,7 @@ static void build_volumes(void)
         /* whatever happened, it's ready unless reset */
         dcvolp->build_ticks = current_tick - dcvolp->start_tick;
         dcvolp->status = DIRCACHE_READY;
+        DCRIVOL(i)->snapshot = false;
     }
 
     size_t reserve_used = reserve_buf_used();
@@ -1863,7 +2351,7 @@ static int prepare_build(bool *realloced)
     /* called holding dircache lock */
     size_t size = dircache.last_size;
 
-#ifdef HAVE_EEPROM_SETTINGS
+#ifdef DIRCACHE_SNAPSHOT
     if (realloced)
     {
         dircache_unlock();
@@ -1873,7 +2361,7 @@ static int prepare_build(bool *realloced)
         if (dircache_runinfo.suspended)
             return -1;
     }
-#endif /* HAVE_EEPROM_SETTINGS */
+#endif /* DIRCACHE_SNAPSHOT */
 
     bool stuffed = DIRCACHE_STUFFED(dircache.reserve_used);
     if (dircache_runinfo.bufsize > size && !stuffed)
@@ -2069,6 +2557,8 @@ void dircache_wait(void)
 void dircache_mount(void)
 {
     /* call with writer exclusion */
+    dircache_runinfo.dirchange_floor = ++dircache_runinfo.changes;
+
     if (dircache_runinfo.suspended)
         return;
 
@@ -2082,6 +2572,8 @@ void dircache_mount(void)
 void dircache_unmount(IF_MV_NONVOID(int volume))
 {
     /* call with writer exclusion */
+    dircache_runinfo.dirchange_floor = ++dircache_runinfo.changes;
+
     if (dircache_runinfo.suspended)
         return;
 
@@ -2294,6 +2786,8 @@ void dircache_fileop_create(struct file_base_info *dirinfop,
     logf("dc create: %u \"%s\"",
          (unsigned int)bindp->info.dcfile.serialnum, basename);
 
+    dircache_runinfo.changes++;
+
     if (!dirinfop->dcfile.serialnum)
     {
         /* no parent binding => no child binding */
@@ -2348,6 +2842,8 @@ void dircache_fileop_remove(struct file_base_binding *bindp)
     /* requires write exclusion */
     logf("dc remove: %u\n", (unsigned int)bindp->info.dcfile.serialnum);
 
+    dircache_runinfo.changes++;
+
     if (!bindp->info.dcfile.serialnum)
         return; /* no binding yet */
 
@@ -2367,6 +2863,8 @@ void dircache_fileop_rename(struct file_base_info *dirinfop,
     logf("dc rename: %u \"%s\"",
          (unsigned int)bindp->info.dcfile.serialnum, basename);
 
+    dircache_runinfo.changes++;
+
     if (!dirinfop->dcfile.serialnum)
     {
         /* new parent directory not cached; there is nowhere to put it so
@@ -2719,6 +3217,75 @@ int dircache_get_file(const char *path, struct dircache_file *dcfilep)
 }
 #endif /* 0 */
 
+/**
+ * return a count that changes whenever a name may have been created, removed
+ * or renamed or a volume was (un)mounted, so that callers can tell if what
+ * they learned about the file system is still current
+ */
+unsigned long dircache_get_change_count(void)
+{
+    return dircache_runinfo.changes;
+}
+
+/**
+ * return the change count as of the last name change inside the directory,
+ * or a later one if that isn't known anymore; a directory that doesn't exist
+ * can only appear through a change in the nearest one that does, so that
+ * one's is returned instead
+ */
+unsigned long dircache_get_dir_change_count(const char *dirpath)
+{
+    char path[MAX_PATH];
+    struct filestr_base stream;
+
+    if (strlcpy(path, dirpath, sizeof (path)) >= sizeof (path))
+        return dircache_runinfo.changes;
+
+    dircache_lock();
+
+    unsigned long changes = dircache_runinfo.changes;
+
+    while (1)
+    {
+        int rc = open_stream_internal(path, FF_DIR, &stream, NULL);
+        if (rc > 0)
+        {
+            const struct dircache_file *dcfilep = &stream.infop->dcfile;
+
+            if (dcfilep->serialnum)
+            {
+                changes = dircache_runinfo.dirchange_floor;
+
+                for (unsigned int i = 0; i < DIRCHANGE_NUM; i++)
+                {
+                    const struct dirchange *dcp =
+                        &dircache_runinfo.dirchange[i];
+                    if (dcp->diridx == dcfilep->idx)
+                    {
+                        changes = dcp->changes;
+                        break;
+                    }
+                }
+            }
+            /* else not cached and nothing is known about it */
+
+            close_stream_internal(&stream);
+            break;
+        }
+
+        /* try its parent unless it's a root already */
+        const char *dir;
+        size_t len = path_dirname(path, &dir);
+        if (len == 0 || len >= strlen(path))
+            break;
+
+        path[len] = '\0';
+    }
+
+    dircache_unlock();
+    return changes;
+}
+
 
 /** Debug screen/info stuff **/
 
@@ -2894,7 +3461,7 @@ void dircache_dcfile_init(struct dircache_file *dcfilep)
     dcfilep->serialnum = 0;
 }
 
-#ifdef HAVE_EEPROM_SETTINGS
+#ifdef DIRCACHE_SNAPSHOT
 
 #ifdef HAVE_HOTSWAP
 /* NOTE: This is hazardous to the filesystem of any sort of removable
@@ -2904,13 +3471,26 @@ void dircache_dcfile_init(struct dircache_file *dcfilep)
   #warning "Don't do this; you'll find the consequences unpleasant."
 #endif
 
+/* Files are still written after the snapshot is saved at shutdown, so the
+   loaded cache is never trusted as a whole. Until the next build has read
+   every directory again, a lookup may find a name in it but the entry is
+   checked against its directory entry on the storage before it's returned,
+   and a name that isn't there is looked for on the storage. Directory write
+   times can't stand in for reading: nothing updates them when a file is
+   rewritten in place, we don't update them at all and targets without a RTC
+   write a fixed time. */
+
 /* dircache persistence file header magic */
-#define DIRCACHE_MAGIC  0x00d0c0a1
+#define DIRCACHE_MAGIC   0x00d0c0a1
+/* bump this whenever what's saved changes its meaning or layout */
+#define DIRCACHE_VERSION 1
 
 /* dircache persistence file header */
 struct dircache_maindata
 {
     uint32_t        magic;      /* DIRCACHE_MAGIC */
+    uint16_t        version;    /* DIRCACHE_VERSION */
+    uint16_t        entrysize;  /* ENTRYSIZE */
     struct dircache dircache;   /* metadata of the cache! */
     uint32_t        datacrc;    /* CRC32 of data */
     uint32_t        hdrcrc;     /* CRC32 of header through datacrc */
@@ -2930,9 +3510,35 @@ static bool dircache_is_clean(bool saving)
     }
 }
 
+/**
+ * mark everything that was loaded to be checked against the storage by the
+ * next build
+ */
+static void snapshot_unverify(void)
+{
+    FOR_EACH_VOLUME(-1, i)
+    {
+        struct dircache_volume *dcvolp = DCVOL(i);
+        if (dcvolp->status == DIRCACHE_IDLE)
+            continue; /* nothing cached there */
+
+        dcvolp->status   = DIRCACHE_IDLE;
+        dcvolp->frontier = FRONTIER_NEW;
+        DCRIVOL(i)->snapshot = true;
+    }
+
+    FOR_EACH_CACHE_ENTRY(ce)
+    {
+        /* any zoned mark stays; zoned ones get scanned no matter what */
+        if ((ce->attr & ATTR_DIRECTORY) && !entry_is_dotdir(ce))
+            ce->frontier |= FRONTIER_NEW;
+    }
+}
+
 /**
  * function to load the internal cache structure from disk to initialize
- * the dircache really fast with little disk access.
+ * the dircache really fast; lookups may use it right away and
+ * dircache_enable() verifies it in the background
  */
 int dircache_load(void)
 {
@@ -2963,6 +3569,13 @@ int dircache_load(void)
         goto error_nolock;
     }
 
+    if (maindata.version != DIRCACHE_VERSION ||
+        maindata.entrysize != ENTRYSIZE)
+    {
+        logf("dircache: other version");
+        goto error_nolock;
+    }
+
     crc = crc_32(&maindata, offsetof(struct dircache_maindata, hdrcrc),
                  0xffffffff);
     if (crc != maindata.hdrcrc)
@@ -2973,7 +3586,8 @@ int dircache_load(void)
 
     if (maindata.dircache.size !=
             maindata.dircache.sizeentries + maindata.dircache.sizenames ||
-        ALIGN_DOWN(maindata.dircache.size, ENTRYSIZE) != maindata.dircache.size ||
+        ALIGN_DOWN(maindata.dircache.sizeentries, ENTRYSIZE) !=
+            maindata.dircache.sizeentries ||
         filesize(fd) - sizeof (maindata) != maindata.dircache.size)
     {
         logf("dircache: file header error");
@@ -3049,8 +3663,8 @@ int dircache_load(void)
 
     dircache.reserve_used = 0;
 
-    /* enable the cache but do not try to build it */
-    dircache_enable_internal(false);
+    /* leave it to dircache_enable() to build, verifying what's here */
+    snapshot_unverify();
 
     /* cache successfully loaded */
     logf("Done, %ld KiB used", dircache.size / 1024);
@@ -3081,7 +3695,7 @@ int dircache_save(void)
 {
     logf("Saving directory cache");
 
-    int fd = open_dircache_file(O_WRONLY|O_CREAT|O_TRUNC|O_APPEND);
+    int fd = open_dircache_file(O_WRONLY|O_CREAT|O_TRUNC);
     if (fd < 0)
         return -1;
 
@@ -3098,8 +3712,10 @@ int dircache_save(void)
     uint32_t crc;
     struct dircache_maindata maindata =
     {
-        .magic    = DIRCACHE_MAGIC,
-        .dircache = dircache,
+        .magic     = DIRCACHE_MAGIC,
+        .version   = DIRCACHE_VERSION,
+        .entrysize = ENTRYSIZE,
+        .dircache  = dircache,
     };
 
     /* store the size since it better detects an invalid header */
@@ -3164,7 +3780,7 @@ error:
     close(fd);
     return rc;
 }
-#endif /* HAVE_EEPROM_SETTINGS */
+#endif /* DIRCACHE_SNAPSHOT */
 
 /**
  * main one-time initialization function that must be called before any other
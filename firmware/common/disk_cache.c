@@ -19,6 +19,7 @@
  *
  ****************************************************************************/
 #include "config.h"
+#include <string.h>
 #include "debug.h"
 #include "system.h"
 #include "linked_list.h"
@@ -26,35 +27,26 @@
 #include "fat.h" /* for SECTOR_SIZE */
 #include "bitarray.h"
 
-/* Cache: LRU cache with separately-chained hashtable
+/* Cache: LRU cache with a separately-chained hashtable
  *
- * Each entry of the map is the mapped location of the hashed sector value
- * where each bit in each map entry indicates which corresponding cache
- * entries are occupied by sector values that collide in that map entry.
+ * Each volume has its own table of buckets. A bucket holds the index of the
+ * first cache entry whose sector hashes into it and each entry links to the
+ * next one in the same bucket, so probing only looks at entries that
+ * actually collide.
  *
- * Each volume is given its own bit map.
+ * The sector is hashed multiplicatively. Directory and FAT sectors that are
+ * accessed together are often a cluster size apart, and a plain modulo would
+ * fold those into a handful of buckets.
  *
- * To probe for a specific key, each bit in the map entry must be examined,
- * its position used as an index into the cache_entry array and the actual
- * sector information compared for that cache entry. If the search exhausts
- * all bits, the sector is not cached.
+ * Since the cache is an LRU design, no buffer entry in the array is
+ * intrinsically associated with any particular sector number or volume.
  *
- * To avoid long chains, the map entry count should be much greater than the
- * number of cache entries. Since the cache is an LRU design, no buffer entry
- * in the array is intrinsically associated with any particular sector number
- * or volume.
- *
- * Example 6-sector cache with 8-entry map:
- * cache entry 543210
- * cache map   100000 <- sector number hashes into map
- *             000000
- *             000100
- *             000000
- *             010000
- *             000000
- *             001001 <- collision
- *             000000
- * volume map  111101 <- entry usage by the volume (OR of all map entries)
+ * Example 6-sector cache with 8-bucket table:
+ * bucket   0 1 2 3 4 5 6 7
+ * head     5 - 3 - 4 - 0 -     <- sector number hashes into bucket
+ * entry    0 1 2 3 4 5
+ * next     2 - - - - -         <- collision: bucket 6 holds 0 then 2
+ * volume map  111101 <- entry usage by the volume
  */
 
 enum dce_flags /* flags for each cache entry */
@@ -62,8 +54,16 @@ enum dce_flags /* flags for each cache entry */
     DCE_INUSE = 0x01, /* entry in use and valid */
     DCE_DIRTY = 0x02, /* entry is dirty in need of writeback */
     DCE_BUF   = 0x04, /* entry is being used as a general buffer */
+    DCE_AHEAD = 0x08, /* entry was read ahead and not probed since */
 };
 
+#if DC_NUM_ENTRIES < 255
+typedef uint8_t dc_link_t;
+#else
+typedef uint16_t dc_link_t;
+#endif
+#define DC_LINK_NONE ((dc_link_t)-1)
+
 struct disk_cache_entry
 {
     struct lldc_node node;  /* LRU list links */
@@ -71,6 +71,7 @@ struct disk_cache_entry
 #ifdef HAVE_MULTIVOLUME
     unsigned char volume;   /* volume of sector */
 #endif
+    dc_link_t hnext;        /* next entry in the same bucket */
     unsigned long sector;   /* cached disk sector number */
 };
 
@@ -78,15 +79,16 @@ BITARRAY_TYPE_DECLARE(cache_map_entry_t, cache_map, DC_NUM_ENTRIES)
 
 static inline unsigned int map_sector(unsigned long sector)
 {
-    /* keep sector hash simple for now */
-    return sector % DC_MAP_NUM_ENTRIES;
+    return (uint32_t)(sector * 0x9e3779b1u) >> (32 - DC_MAP_BITS);
 }
 
 static struct lldc_head cache_lru; /* LRU cache list (head = LRU item) */
+static unsigned int cache_lru_count; /* entries in the list */
 static struct disk_cache_entry cache_entry[DC_NUM_ENTRIES];
-static cache_map_entry_t cache_map_entry[NUM_VOLUMES][DC_MAP_NUM_ENTRIES];
+static dc_link_t cache_map_entry[NUM_VOLUMES][DC_MAP_NUM_ENTRIES];
 static cache_map_entry_t cache_vol_map[NUM_VOLUMES] IBSS_ATTR;
 static uint8_t cache_buffer[DC_NUM_ENTRIES][DC_CACHE_BUFSIZE] CACHEALIGN_ATTR;
+static struct dc_stats cache_stats;
 struct mutex disk_cache_mutex SHAREDBSS_ATTR;
 
 #define CACHE_MAP_ENTRY(volume, mapnum) \
@@ -105,24 +107,48 @@ struct mutex disk_cache_mutex SHAREDBSS_ATTR;
 #define DCIDX_FROM_DCE(dce) \
     ((dce) - cache_entry)
 
-/* set the in-use bit in the map */
-static inline void cache_bitmap_set_bit(int volume, unsigned int mapnum,
-                                        unsigned int bitnum)
+/* link the entry into its bucket and mark it used by the volume */
+static inline void cache_bucket_insert(int volume, unsigned int mapnum,
+                                       unsigned int index)
 {
-    cache_map_set_bit(&CACHE_MAP_ENTRY(volume, mapnum), bitnum);
-    cache_map_set_bit(&CACHE_VOL_MAP(volume), bitnum);
+    dc_link_t *bucket = &CACHE_MAP_ENTRY(volume, mapnum);
+    cache_entry[index].hnext = *bucket;
+    *bucket = index;
+    cache_map_set_bit(&CACHE_VOL_MAP(volume), index);
     (void)volume;
 }
 
-/* clear the in-use bit in the map */
-static inline void cache_bitmap_clear_bit(int volume, unsigned int mapnum,
-                                          unsigned int bitnum)
+/* unlink the entry from its bucket and mark it unused by the volume */
+static inline void cache_bucket_remove(int volume, unsigned int mapnum,
+                                       unsigned int index)
 {
-    cache_map_clear_bit(&CACHE_MAP_ENTRY(volume, mapnum), bitnum);
-    cache_map_clear_bit(&CACHE_VOL_MAP(volume), bitnum);
+    dc_link_t *link = &CACHE_MAP_ENTRY(volume, mapnum);
+
+    while (*link != index)
+        link = &cache_entry[*link].hnext;
+
+    *link = cache_entry[index].hnext;
+    cache_map_clear_bit(&CACHE_VOL_MAP(volume), index);
     (void)volume;
 }
 
+/* find the entry caching a sector, if any */
+static struct disk_cache_entry * cache_find(IF_MV(int volume,)
+                                            unsigned long sector,
+                                            unsigned int mapnum)
+{
+    for (unsigned int index = CACHE_MAP_ENTRY(volume, mapnum);
+         index != DC_LINK_NONE; index = cache_entry[index].hnext)
+    {
+        struct disk_cache_entry *dce = &cache_entry[index];
+
+        if (dce->sector == sector)
+            return dce;
+    }
+
+    return NULL;
+}
+
 /* make entry MRU by moving it to the list tail */
 static inline void touch_cache_entry(struct disk_cache_entry *which)
 {
@@ -151,6 +177,7 @@ static struct disk_cache_entry * cache_remove_lru_entry(void)
 
     /* remove it; next-LRU becomes the LRU */
     lldc_remove(&cache_lru, lru);
+    cache_lru_count--;
     return NODE_DCE(lru);
 }
 
@@ -158,38 +185,22 @@ static struct disk_cache_entry * cache_remove_lru_entry(void)
 static void cache_return_lru_entry(struct disk_cache_entry *fce)
 {
     lldc_insert_first(&cache_lru, &fce->node);
+    cache_lru_count++;
 }
 
 /* discard the entry's data and mark it unused */
 static inline void cache_discard_entry(struct disk_cache_entry *dce,
                                        unsigned int index)
 {
-    cache_bitmap_clear_bit(IF_MV_VOL(dce->volume), map_sector(dce->sector),
-                           index);
+    cache_bucket_remove(IF_MV_VOL(dce->volume), map_sector(dce->sector),
+                        index);
     dce->flags = 0;
 }
 
-/* search the cache for the specified sector, returning a buffer, either
-   to the specified sector, if it exists, or a new/evicted entry that must
-   be filled */
-void * dc_cache_probe(IF_MV(int volume,) unsigned long sector,
-                      unsigned int *flagsp)
+/* evict the LRU entry and give it to the sector, making it MRU */
+static void * cache_new_entry(IF_MV(int volume,) unsigned long sector,
+                              unsigned int mapnum)
 {
-    unsigned int mapnum = map_sector(sector);
-
-    FOR_EACH_BITARRAY_SET_BIT(&CACHE_MAP_ENTRY(volume, mapnum), index)
-    {
-        struct disk_cache_entry *dce = &cache_entry[index];
-
-        if (dce->sector == sector)
-        {
-            *flagsp = DCE_INUSE;
-            touch_cache_entry(dce);
-            return cache_buffer[index];
-        }
-    }
-
-    /* sector not found so the LRU is the victim */
     struct disk_cache_entry *dce = DCE_LRU();
     cache_lru.head = dce->node.next;
 
@@ -203,16 +214,21 @@ void * dc_cache_probe(IF_MV(int volume,) unsigned long sector,
         unsigned long sector = dce->sector;
         unsigned int old_mapnum = map_sector(sector);
 
+        cache_stats.evictions++;
+
         if (old_flags & DCE_DIRTY)
+        {
+            cache_stats.writebacks++;
             dc_writeback_callback(IF_MV(old_volume,) sector, buf);
+        }
 
         if (mapnum == old_mapnum IF_MV( && volume == old_volume ))
             goto finish_setup;
 
-        cache_bitmap_clear_bit(old_volume, old_mapnum, index);
+        cache_bucket_remove(old_volume, old_mapnum, index);
     }
 
-    cache_bitmap_set_bit(IF_MV_VOL(volume), mapnum, index);
+    cache_bucket_insert(IF_MV_VOL(volume), mapnum, index);
 
 finish_setup:
     dce->flags  = DCE_INUSE;
@@ -221,10 +237,81 @@ finish_setup:
 #endif
     dce->sector = sector;
 
-    *flagsp = 0;
     return buf;
 }
 
+/* search the cache for the specified sector, returning a buffer, either
+   to the specified sector, if it exists, or a new/evicted entry that must
+   be filled */
+void * dc_cache_probe(IF_MV(int volume,) unsigned long sector,
+                      unsigned int *flagsp)
+{
+    unsigned int mapnum = map_sector(sector);
+    struct disk_cache_entry *dce = cache_find(IF_MV(volume,) sector, mapnum);
+
+    if (dce)
+    {
+        cache_stats.hits++;
+
+        if (dce->flags & DCE_AHEAD)
+        {
+            cache_stats.readahead_hits++;
+            dce->flags &= ~DCE_AHEAD;
+        }
+
+        *flagsp = DCE_INUSE;
+        touch_cache_entry(dce);
+        return cache_buffer[DCIDX_FROM_DCE(dce)];
+    }
+
+    /* sector not found so the LRU is the victim */
+    cache_stats.misses++;
+    *flagsp = 0;
+    return cache_new_entry(IF_MV(volume,) sector, mapnum);
+}
+
+/* store count consecutive sectors that were read along with a needed one;
+   those already cached are left as they are */
+void dc_cache_readahead(IF_MV(int volume,) unsigned long sector,
+                        unsigned int count, const void *data)
+{
+    struct disk_cache_entry *ahead[DC_READAHEAD_MAX];
+    unsigned int num = 0;
+
+    /* Leave most of the list alone; anything the client has probed under
+       the same lock must not be pushed out by speculation */
+    count = MIN(count, cache_lru_count / 4);
+    count = MIN(count, DC_READAHEAD_MAX);
+
+    for (unsigned int i = 0; i < count; i++, sector++)
+    {
+        const uint8_t *src = (const uint8_t *)data + i*DC_CACHE_BUFSIZE;
+        unsigned int mapnum = map_sector(sector);
+
+        /* a cached copy may be newer than the disk */
+        if (cache_find(IF_MV(volume,) sector, mapnum))
+            continue;
+
+        void *buf = cache_new_entry(IF_MV(volume,) sector, mapnum);
+        memcpy(buf, src, DC_CACHE_BUFSIZE);
+
+        struct disk_cache_entry *dce = &cache_entry[DCIDX_FROM_BUF(buf)];
+        dce->flags |= DCE_AHEAD;
+        ahead[num++] = dce;
+    }
+
+    cache_stats.readahead += num;
+
+    /* They were made MRU; make them LRU instead so unused ones are the
+       next to go, the one that should be needed first going last */
+    for (unsigned int i = 0; i < num; i++)
+    {
+        struct lldc_node *node = &ahead[i]->node;
+        lldc_remove(&cache_lru, node);
+        lldc_insert_first(&cache_lru, node);
+    }
+}
+
 /* mark in-use cache entry as dirty by buffer */
 void dc_dirty_buf(void *buf)
 {
@@ -264,6 +351,7 @@ void dc_commit_all(IF_MV_NONVOID(int volume))
 
         if (flags & DCE_DIRTY)
         {
+            cache_stats.writebacks++;
             dc_writeback_callback(IF_MV(volume,) dce->sector,
                                   cache_buffer[index]);
             dce->flags = flags & ~DCE_DIRTY;
@@ -299,8 +387,12 @@ void * dc_get_buffer(void)
         {
             /* must first commit this sector if dirty */
             if (flags & DCE_DIRTY)
+            {
+                cache_stats.writebacks++;
                 dc_writeback_callback(IF_MV(dce->volume,) dce->sector, buf);
+            }
 
+            cache_stats.evictions++;
             cache_discard_entry(dce, index);
         }
 
@@ -333,11 +425,24 @@ void dc_release_buffer(void *buf)
     dc_unlock_cache();
 }
 
+/* copy the counters */
+void dc_get_stats(struct dc_stats *stats)
+{
+    dc_lock_cache();
+    *stats = cache_stats;
+    stats->entries = DC_NUM_ENTRIES;
+    stats->buckets = DC_MAP_NUM_ENTRIES;
+    stats->lru_entries = cache_lru_count;
+    dc_unlock_cache();
+}
+
 /* one-time init at startup */
 void dc_init(void)
 {
     mutex_init(&disk_cache_mutex);
+    memset(cache_map_entry, 0xff, sizeof (cache_map_entry));
     lldc_init(&cache_lru);
     for (unsigned int i = 0; i < DC_NUM_ENTRIES; i++)
         lldc_insert_last(&cache_lru, &cache_entry[i].node);
+    cache_lru_count = DC_NUM_ENTRIES;
 }
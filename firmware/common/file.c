@@ -41,6 +41,7 @@ static struct filestr_desc
     struct filestr_base stream; /* basic stream info (first!) */
     file_size_t         offset; /* current offset for stream */
     file_size_t         *sizep; /* shortcut to file size in fileobj */
+    struct fat_extent_map extents; /* cluster runs for seeking */
 } open_streams[MAX_OPEN_FILES];
 
 /* check and return a struct filestr_desc* from a file descriptor number */
@@ -204,6 +205,9 @@ void ftruncate_internal_callback(struct filestr_base *stream,
     if (file->offset > size)
         file->offset = size;
 
+    /* the cluster chain was cut somewhere, start mapping it over */
+    fat_filestr_map_extents(&file->stream.fatstr, &file->extents);
+
     (void)stream;
 }
 
@@ -306,12 +310,21 @@ static int fsync_internal(struct filestr_desc *file)
     }
 
 file_error:;
+    /* an empty file gives its whole cluster chain back */
+    bool freed = !size && file->stream.fatstr.fatfilep->firstcluster;
+
     /* tie up all loose ends (try to close the file even if failing) */
     int rc2 = fat_closewrite(&file->stream.fatstr, size,
                              get_dir_fatent_dircache());
     if (rc2 >= 0)
+    {
         fileop_onsync_internal(&file->stream); /* dir_fatent is implicit arg */
 
+        /* every stream still has the old chain mapped */
+        if (freed)
+            fileop_ontruncate_internal(&file->stream);
+    }
+
     if (rc2 < 0 && rc >= 0)
     {
         errno = EIO;
@@ -405,6 +418,7 @@ static int open_internal_inner2(const char *path,
     }
 
     fat_rewind(&file->stream.fatstr);
+    fat_filestr_map_extents(&file->stream.fatstr, &file->extents);
     file->sizep = fileobj_get_sizep(&file->stream);
     file->offset = 0;
 
@@ -0,0 +1,100 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+#include "config.h"
+#include "system.h"
+#include "kernel.h"
+#include "thread.h"
+#include "file.h"
+#include "file_async.h"
+
+/* The storage drivers already put the calling thread to sleep while the
+ * transfer runs, so a thread that owns the reads is all it takes for the
+ * submitter to keep serving its own queue meanwhile. Reads go out one after
+ * the other in the order they were submitted. */
+
+enum
+{
+    FILE_ASYNC_READ = 1,    /* Perform the read of a request */
+    FILE_ASYNC_SYNC,        /* Reply once everything before it is done */
+};
+
+static long file_async_stack[(DEFAULT_STACK_SIZE + 0x400)/sizeof(long)];
+static const char file_async_thread_name[] = "file async";
+static struct event_queue file_async_queue SHAREDBSS_ATTR;
+static struct queue_sender_list file_async_queue_sender_list SHAREDBSS_ATTR;
+
+static void NORETURN_ATTR file_async_thread(void)
+{
+    struct queue_event ev;
+
+    while (1)
+    {
+        queue_wait(&file_async_queue, &ev);
+
+        switch (ev.id)
+        {
+        case FILE_ASYNC_READ:
+        {
+            struct file_async_req *req = (struct file_async_req *)ev.data;
+            long start = current_tick;
+
+            req->result = read(req->fd, req->buf, req->count);
+            req->ticks = current_tick - start;
+            req->done = true;
+
+            if (req->queue)
+                queue_post(req->queue, req->id, ev.data);
+            break;
+            }
+
+        case FILE_ASYNC_SYNC:
+            queue_reply(&file_async_queue, 0);
+            break;
+        }
+    }
+}
+
+void file_read_async(struct file_async_req *req)
+{
+    req->result = 0;
+    req->ticks = 0;
+    req->done = false;
+    queue_post(&file_async_queue, FILE_ASYNC_READ, (intptr_t)req);
+}
+
+void file_async_wait(struct file_async_req *req)
+{
+    /* The queue is served in order so once the barrier is answered, the
+       request is done too */
+    if (!req->done)
+        queue_send(&file_async_queue, FILE_ASYNC_SYNC, 0);
+}
+
+void INIT_ATTR file_async_init(void)
+{
+    queue_init(&file_async_queue, false);
+    unsigned int id = create_thread(file_async_thread, file_async_stack,
+                                    sizeof(file_async_stack), 0,
+                                    file_async_thread_name
+                                    IF_PRIO(, PRIORITY_BUFFERING)
+                                    IF_COP(, CPU));
+
+    queue_enable_queue_send(&file_async_queue, &file_async_queue_sender_list,
+                            id);
+}
@@ -190,6 +190,7 @@ void fileobj_fileop_open(struct filestr_base *stream,
     stream->flags = FDO_BUSY | (callflags & (FD_WRITE|FD_WRONLY|FD_APPEND));
     stream->infop = &fobp->bind.info;
     stream->fatstr.fatfilep = &fobp->bind.info.fatfile;
+    stream->fatstr.extents  = NULL;
     stream->bindp = &fobp->bind;
     stream->mtx   = &stream_mutexes[fobp - fobindings];
 
@@ -26,6 +26,7 @@ extern unsigned char *audiobufend;
 
 /* debug test alloc */
 static int test_alloc;
+static size_t compact_budget = CORE_COMPACT_BUDGET;
 void core_allocator_init(void)
 {
     unsigned char *start = ALIGN_UP(audiobuffer, sizeof(intptr_t));
@@ -52,6 +53,15 @@ bool core_test_free(void)
     return ret;
 }
 
+/* Compact a bit of the core buffer. Returns true if there's more to do. */
+bool core_compact_slice(void)
+{
+    if (!compact_budget)
+        return false;
+
+    return buflib_compact_slice(&core_ctx, compact_budget);
+}
+
 /* Allocate memory in the "core" context. See documentation
  * of buflib_alloc_ex() for details.
  *
@@ -60,11 +70,14 @@ bool core_test_free(void)
  *       like disc input/output. */
 int core_alloc(const char* name, size_t size)
 {
-    return buflib_alloc_ex(&core_ctx, size, name, NULL);
+    return core_alloc_ex(name, size, NULL);
 }
 
 int core_alloc_ex(const char* name, size_t size, struct buflib_callbacks *ops)
 {
+    /* blocks may move during an allocation anyway, tidy up a slice now so
+     * that a full compaction is rarely needed */
+    core_compact_slice();
     return buflib_alloc_ex(&core_ctx, size, name, ops);
 }
 
@@ -93,6 +106,16 @@ bool core_shrink(int handle, void* new_start, size_t new_size)
     return buflib_shrink(&core_ctx, handle, new_start, new_size);
 }
 
+void core_set_compact_budget(size_t bytes)
+{
+    compact_budget = bytes;
+}
+
+const struct buflib_compact_stats* core_get_compact_stats(void)
+{
+    return buflib_get_compact_stats(&core_ctx);
+}
+
 const char* core_get_name(int handle)
 {
     const char *name = buflib_get_name(&core_ctx, handle);
@@ -30,6 +30,10 @@
 #include "pathfuncs.h"
 #include "disk_cache.h"
 #include "file_internal.h" /* for struct filestr_cache */
+#if !defined(BOOTLOADER) && !defined(__PCTOOL__)
+#include "core_alloc.h"
+#define FAT_FREE_MAP
+#endif
 #include "storage.h"
 #include "timefuncs.h"
 #include "rbunicode.h"
@@ -234,6 +238,8 @@ static struct bpb
     unsigned long dataclusters;
     unsigned long fatrgnstart;
     unsigned long fatrgnend;
+    unsigned long fatnextmiss;      /* FAT sector a sequential walk would
+                                       miss on next */
     struct fsinfo fsinfo;
 #ifdef HAVE_FAT16SUPPORT
     unsigned int bpb_rootentcnt;    /* Number of dir entries in the root */
@@ -253,6 +259,9 @@ static struct bpb
     uint8_t volume;   /* on which volume is this located (shortcut) */
 #endif
     uint8_t mounted;  /* true if volume is mounted, false otherwise */
+#ifdef FAT_FREE_MAP
+    int freemap;      /* buflib handle of the free sector map, 0 if none */
+#endif
 #ifdef HAVE_FAT16SUPPORT
     /* some functions are different for different FAT types */
     long BPB_FN_DECL(get_next_cluster, long);
@@ -318,6 +327,30 @@ static void cache_discard(IF_MV_NONVOID(struct bpb *fat_bpb))
     dc_unlock_cache();
 }
 
+/* FAT sectors read along with a missed one when the FAT is walked in order,
+   which is what following a contiguous chain or looking for free clusters
+   does */
+#define FAT_READAHEAD   DC_READAHEAD_MAX
+
+static uint8_t fat_readahead_buf[FAT_READAHEAD + 1][SECTOR_SIZE]
+    STORAGE_ALIGN_ATTR;
+
+/* how many sectors to read ahead of a missed one */
+static unsigned int fat_readahead_count(struct bpb *fat_bpb,
+                                        unsigned long secnum)
+{
+    if (!IS_FAT_SECTOR(fat_bpb, secnum))
+        return 0;
+
+    unsigned int count = 0;
+
+    if (secnum == fat_bpb->fatnextmiss)
+        count = MIN(FAT_READAHEAD, fat_bpb->fatrgnend - secnum - 1);
+
+    fat_bpb->fatnextmiss = secnum + 1 + count;
+    return count;
+}
+
 /* caches a FAT or data area sector */
 static void * cache_sector(struct bpb *fat_bpb, unsigned long secnum)
 {
@@ -326,8 +359,27 @@ static void * cache_sector(struct bpb *fat_bpb, unsigned long secnum)
 
     if (!flags)
     {
-        int rc = storage_read_sectors(IF_MD(fat_bpb->drive,)
+        unsigned int count = fat_readahead_count(fat_bpb, secnum);
+        int rc;
+
+        if (count)
+        {
+            rc = storage_read_sectors(IF_MD(fat_bpb->drive,)
+                                      secnum + fat_bpb->startsector,
+                                      count + 1, fat_readahead_buf);
+            if (rc >= 0)
+            {
+                memcpy(buf, fat_readahead_buf[0], SECTOR_SIZE);
+                dc_cache_readahead(IF_MV(fat_bpb->volume,) secnum + 1,
+                                   count, fat_readahead_buf[1]);
+            }
+        }
+        else
+        {
+            rc = storage_read_sectors(IF_MD(fat_bpb->drive,)
                                       secnum + fat_bpb->startsector, 1, buf);
+        }
+
         if (UNLIKELY(rc < 0))
         {
             DEBUGF("%s() - Could not read sector %ld"
@@ -773,6 +825,96 @@ static bool fatlong_parse_finish(struct fatlong_parse_state *lnparse,
     return true;
 }
 
+#ifdef FAT_FREE_MAP
+/* Free sector map: one bit for each FAT sector, cleared once the sector was
+ * seen to have no free entry and set again when one of its clusters is freed.
+ * Searching for free clusters skips over the full parts of the FAT without
+ * reading them, which matters on big, nearly full volumes.
+ *
+ * Set bits only mean "may have free entries" so the map is learned as the
+ * FAT gets searched, and is exact after a free count recalculation. It is
+ * given up when memory gets tight; the searches then read every sector
+ * again.
+ *
+ * Only the handle is kept. Accesses don't yield, so the allocation may be
+ * moved at any time. */
+static int freemap_move_callback(int handle, void *current, void *new)
+{
+    return BUFLIB_CB_OK;
+    (void)handle; (void)current; (void)new;
+}
+
+static int freemap_shrink_callback(int handle, unsigned hints, void *start,
+                                   size_t old_size)
+{
+    for (unsigned int i = 0; i < NUM_VOLUMES; i++)
+    {
+        if (fat_bpbs[i].freemap == handle)
+            fat_bpbs[i].freemap = 0;
+    }
+
+    core_free(handle);
+    return BUFLIB_CB_OK;
+    (void)hints; (void)start; (void)old_size;
+}
+
+static void freemap_alloc(struct bpb *fat_bpb)
+{
+    static struct buflib_callbacks ops =
+    {
+        .move_callback   = freemap_move_callback,
+        .shrink_callback = freemap_shrink_callback,
+    };
+
+    size_t size = (fat_bpb->fatsize + 7) / 8;
+    int handle = core_alloc_ex("fat free map", size, &ops);
+    if (handle <= 0)
+        return; /* do without */
+
+    /* nothing is known yet */
+    memset(core_get_data(handle), 0xff, size);
+    fat_bpb->freemap = handle;
+}
+
+static void freemap_free(struct bpb *fat_bpb)
+{
+    int handle = fat_bpb->freemap;
+    fat_bpb->freemap = 0;
+
+    if (handle > 0)
+        core_free(handle);
+}
+
+/* can the FAT sector have free entries? */
+static inline bool freemap_test(struct bpb *fat_bpb, unsigned long sector)
+{
+    if (fat_bpb->freemap <= 0)
+        return true;
+
+    const uint8_t *map = core_get_data(fat_bpb->freemap);
+    return map[sector / 8] & (1u << (sector % 8));
+}
+
+static inline void freemap_set(struct bpb *fat_bpb, unsigned long sector,
+                               bool mayhavefree)
+{
+    if (fat_bpb->freemap <= 0)
+        return;
+
+    uint8_t *map = core_get_data(fat_bpb->freemap);
+    if (mayhavefree)
+        map[sector / 8] |= 1u << (sector % 8);
+    else
+        map[sector / 8] &= ~(1u << (sector % 8));
+}
+#else /* !FAT_FREE_MAP */
+#define freemap_alloc(fat_bpb)              do {} while (0)
+#define freemap_free(fat_bpb)               do {} while (0)
+#define freemap_test(fat_bpb, sector)       ({ (void)(fat_bpb); true; })
+#define freemap_set(fat_bpb, sector, mayhavefree) \
+    do { (void)(mayhavefree); } while (0)
+#endif /* FAT_FREE_MAP */
+
 static unsigned long cluster2sec(struct bpb *fat_bpb, long cluster)
 {
     long zerocluster = 2;
@@ -835,6 +977,12 @@ static long find_free_cluster16(struct bpb *fat_bpb, long startcluster)
     for (unsigned long i = 0; i < fat_bpb->fatsize; i++)
     {
         unsigned long nr = (i + sector) % fat_bpb->fatsize;
+        if (!freemap_test(fat_bpb, nr))
+        {
+            offset = 0;
+            continue;
+        }
+
         uint16_t *sec = cache_sector(fat_bpb, nr + fat_bpb->fatrgnstart);
         if (!sec)
             break;
@@ -858,6 +1006,8 @@ static long find_free_cluster16(struct bpb *fat_bpb, long startcluster)
             }
         }
 
+        /* all of it was looked at */
+        freemap_set(fat_bpb, nr, false);
         offset = 0;
     }
 
@@ -904,6 +1054,8 @@ static int update_fat_entry16(struct bpb *fat_bpb, unsigned long entry,
         /* being freed */
         if (curval != 0x0000)
             fat_bpb->fsinfo.freecount++;
+
+        freemap_set(fat_bpb, sector, true);
     }
 
     DEBUGF("%lu free clusters\n", (unsigned long)fat_bpb->fsinfo.freecount);
@@ -925,6 +1077,8 @@ static void fat_recalc_free_internal16(struct bpb *fat_bpb)
         if (!sec)
             break;
 
+        unsigned long secfree = free;
+
         for (unsigned long j = 0; j < CLUSTERS_PER_FAT16_SECTOR; j++)
         {
             unsigned long c = i * CLUSTERS_PER_FAT16_SECTOR + j;
@@ -939,6 +1093,8 @@ static void fat_recalc_free_internal16(struct bpb *fat_bpb)
             if (fat_bpb->fsinfo.nextfree == 0xffffffff)
                 fat_bpb->fsinfo.nextfree = c;
         }
+
+        freemap_set(fat_bpb, i, free != secfree);
     }
 
     fat_bpb->fsinfo.freecount = free;
@@ -994,6 +1150,12 @@ static long find_free_cluster32(struct bpb *fat_bpb, long startcluster)
     for (unsigned long i = 0; i < fat_bpb->fatsize; i++)
     {
         unsigned long nr = (i + sector) % fat_bpb->fatsize;
+        if (!freemap_test(fat_bpb, nr))
+        {
+            offset = 0;
+            continue;
+        }
+
         uint32_t *sec = cache_sector(fat_bpb, nr + fat_bpb->fatrgnstart);
         if (!sec)
             break;
@@ -1017,6 +1179,8 @@ static long find_free_cluster32(struct bpb *fat_bpb, long startcluster)
             }
         }
 
+        /* all of it was looked at */
+        freemap_set(fat_bpb, nr, false);
         offset = 0;
     }
 
@@ -1061,6 +1225,8 @@ static int update_fat_entry32(struct bpb *fat_bpb, unsigned long entry,
         /* being freed */
         if (curval & 0x0fffffff)
             fat_bpb->fsinfo.freecount++;
+
+        freemap_set(fat_bpb, sector, true);
     }
 
     DEBUGF("%lu free clusters\n", (unsigned long)fat_bpb->fsinfo.freecount);
@@ -1083,6 +1249,8 @@ static void fat_recalc_free_internal32(struct bpb *fat_bpb)
         if (!sec)
             break;
 
+        unsigned long secfree = free;
+
         for (unsigned long j = 0; j < CLUSTERS_PER_FAT_SECTOR; j++)
         {
             unsigned long c = i * CLUSTERS_PER_FAT_SECTOR + j;
@@ -1097,6 +1265,8 @@ static void fat_recalc_free_internal32(struct bpb *fat_bpb)
             if (fat_bpb->fsinfo.nextfree == 0xffffffff)
                 fat_bpb->fsinfo.nextfree = c;
         }
+
+        freemap_set(fat_bpb, i, free != secfree);
     }
 
     fat_bpb->fsinfo.freecount = free;
@@ -1840,9 +2010,9 @@ static int update_short_entry(struct bpb *fat_bpb, struct fat_file *file,
     uint16_t time = 0;
     uint16_t date = 0;
 #else
-    /* get old time to increment from */
-    uint16_t time = letoh16(fatent->wrttime);
-    uint16_t date = letoh16(fatent->wrtdate);
+    /* get old time to increment from, if the caller has it */
+    uint16_t time = fatent ? letoh16(fatent->wrttime) : 0;
+    uint16_t date = fatent ? letoh16(fatent->wrtdate) : 0;
 #endif
     fat_time(&date, &time, NULL);
     date = htole16(date);
@@ -2276,6 +2446,9 @@ int fat_closewrite(struct fat_filestr *filestr, uint32_t size,
 
         file->firstcluster = 0;
         fat_rewind(filestr);
+
+        if (filestr->extents)
+            filestr->extents->count = 0;
     }
 
     if (file->dircluster)
@@ -2321,9 +2494,94 @@ fat_error:
 void fat_filestr_init(struct fat_filestr *fatstr, struct fat_file *file)
 {
     fatstr->fatfilep = file;
+    fatstr->extents  = NULL;
     fat_rewind(fatstr);
 }
 
+/* have the stream remember the cluster runs it comes across in map, which
+   also forgets whatever was there; call again when the chain was cut */
+void fat_filestr_map_extents(struct fat_filestr *filestr,
+                             struct fat_extent_map *map)
+{
+    filestr->extents = map;
+    if (map)
+        map->count = 0;
+}
+
+/* return the cluster clusternum clusters into the file if the map covers it,
+   else 0 */
+static long extent_lookup(const struct fat_extent_map *map, long clusternum)
+{
+    /* find the last extent starting at or before clusternum */
+    int lo = 0, hi = map->count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (map->extent[mid].clusternum <= clusternum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!lo)
+        return 0;
+
+    const struct fat_extent *ext = &map->extent[lo - 1];
+    if (clusternum - ext->clusternum >= ext->count)
+        return 0;
+
+    return ext->cluster + (clusternum - ext->clusternum);
+}
+
+/* forget all clusters from the file's clusternum'th on */
+static void extent_clip(struct fat_extent_map *map, long clusternum)
+{
+    while (map->count)
+    {
+        struct fat_extent *ext = &map->extent[map->count - 1];
+        if (ext->clusternum < clusternum)
+        {
+            if (ext->clusternum + ext->count > clusternum)
+                ext->count = clusternum - ext->clusternum;
+            break;
+        }
+
+        map->count--;
+    }
+}
+
+/* note that the file's clusternum'th cluster is cluster; the map only grows
+   at its end so it always covers the file from the start without gaps */
+static void extent_note(struct fat_extent_map *map, long clusternum,
+                        long cluster)
+{
+    if (!map->count)
+    {
+        if (clusternum != 0)
+            return;
+    }
+    else
+    {
+        struct fat_extent *ext = &map->extent[map->count - 1];
+        if (clusternum != ext->clusternum + ext->count)
+            return;
+
+        if (cluster == ext->cluster + ext->count)
+        {
+            ext->count++;
+            return;
+        }
+
+        if (map->count >= FAT_MAX_EXTENTS)
+            return;
+    }
+
+    struct fat_extent *ext = &map->extent[map->count++];
+    ext->clusternum = clusternum;
+    ext->cluster    = cluster;
+    ext->count      = 1;
+}
+
 unsigned long fat_query_sectornum(const struct fat_filestr *filestr)
 {
     /* return next sector number to be transferred */
@@ -2428,6 +2686,9 @@ long fat_readwrite(struct fat_filestr *filestr, unsigned long sectorcount,
             cluster = newcluster;
             sector = cluster2sec(fat_bpb, cluster) - 1;
 
+            if (filestr->extents && cluster > 0)
+                extent_note(filestr->extents, 0, cluster);
+
         #ifdef HAVE_FAT16SUPPORT
             if (fat_bpb->is_fat16 && file->firstcluster < 0)
             {
@@ -2462,6 +2723,9 @@ long fat_readwrite(struct fat_filestr *filestr, unsigned long sectorcount,
                 clusternum++;
                 sectornum = 0;
 
+                if (filestr->extents)
+                    extent_note(filestr->extents, clusternum, cluster);
+
                 /* jumped clusters right at start? */
                 if (!count)
                     last = sector;
@@ -2521,7 +2785,7 @@ void fat_rewind(struct fat_filestr *filestr)
     filestr->lastcluster  = filestr->fatfilep->firstcluster;
     filestr->lastsector   = 0;
     filestr->clusternum   = 0;
-    filestr->sectornum    = FAT_RW_VAL;
+    filestr->sectornum    = FAT_RW_SECTOR;
     filestr->eof          = false;
 }
 
@@ -2536,7 +2800,7 @@ int fat_seek(struct fat_filestr *filestr, unsigned long seeksector)
     long          cluster    = file->firstcluster;
     unsigned long sector     = 0;
     long          clusternum = 0;
-    unsigned long sectornum  = FAT_RW_VAL;
+    unsigned long sectornum  = FAT_RW_SECTOR;
 
 #ifdef HAVE_FAT16SUPPORT
     if (fat_bpb->is_fat16 && cluster < 0) /* FAT16 root dir */
@@ -2560,16 +2824,38 @@ int fat_seek(struct fat_filestr *filestr, unsigned long seeksector)
         clusternum = seeksector / fat_bpb->bpb_secperclus;
         sectornum = seeksector % fat_bpb->bpb_secperclus;
 
-        long numclusters = clusternum;
+        struct fat_extent_map *map = cluster > 0 ? filestr->extents : NULL;
+        long startnum = 0;
+
+        if (map)
+        {
+            if (!map->count)
+                extent_note(map, 0, cluster);
+
+            long mapped = extent_lookup(map, clusternum);
+            if (mapped)
+            {
+                cluster  = mapped;
+                startnum = clusternum;
+            }
+            else
+            {
+                /* walk on from the end of the map */
+                const struct fat_extent *ext = &map->extent[map->count - 1];
+                startnum = ext->clusternum + ext->count - 1;
+                cluster  = ext->cluster + ext->count - 1;
+            }
+        }
 
-        if (filestr->clusternum && clusternum >= filestr->clusternum)
+        if (filestr->clusternum && clusternum >= filestr->clusternum &&
+            filestr->clusternum > startnum)
         {
             /* seek forward from current position */
-            cluster = filestr->lastcluster;
-            numclusters -= filestr->clusternum;
+            cluster  = filestr->lastcluster;
+            startnum = filestr->clusternum;
         }
 
-        for (long i = 0; i < numclusters; i++)
+        for (long i = startnum; i < clusternum; i++)
         {
             cluster = get_next_cluster(fat_bpb, cluster);
 
@@ -2579,6 +2865,9 @@ int fat_seek(struct fat_filestr *filestr, unsigned long seeksector)
                        "(sector %lu, cluster %ld)\n", seeksector, i);
                 FAT_ERROR(FAT_SEEK_EOF);
             }
+
+            if (map)
+                extent_note(map, i + 1, cluster);
         }
 
         sector = cluster2sec(fat_bpb, cluster) + sectornum;
@@ -2610,6 +2899,10 @@ int fat_truncate(const struct fat_filestr *filestr)
     long last = filestr->lastcluster;
     long next = 0;
 
+    /* the map must not hand out the clusters freed below */
+    if (filestr->extents)
+        extent_clip(filestr->extents, last ? filestr->clusternum + 1 : 0);
+
     /* truncate trailing clusters after the current position */
     if (last)
     {
@@ -2797,6 +3090,8 @@ int fat_mount(IF_MV(int volume,) IF_MD(int drive,) unsigned long startsector)
     /* it worked */
     fat_bpb->mounted = true;
 
+    freemap_alloc(fat_bpb);
+
     /* calculate freecount if unset */
     if (fat_bpb->fsinfo.freecount == 0xffffffff)
         fat_recalc_free(IF_MV(fat_bpb->volume));
@@ -2820,6 +3115,7 @@ int fat_unmount(IF_MV_NONVOID(int volume))
 
     /* free the entries for this volume */
     cache_discard(IF_MV(fat_bpb));
+    freemap_free(fat_bpb);
     fat_bpb->mounted = false;
 
     return 0;
@@ -104,6 +104,7 @@ struct fat_dirscan_info
 };
 
 #define FAT_RW_VAL  (0u - 1)
+#define FAT_RW_SECTOR (0ul - 1) /* same for the unsigned long sectornum */
 
 /* basic FAT file information about where to find a file and who houses it */
 struct fat_file
@@ -116,6 +117,23 @@ struct fat_file
     struct fat_dirscan_info e;  /* entry information */
 };
 
+/* runs of contiguous clusters of a file, from its first cluster on, so
+   seeking can skip walking the cluster chain */
+#define FAT_MAX_EXTENTS 32
+
+struct fat_extent
+{
+    long clusternum;            /* cluster number within the file */
+    long cluster;               /* where it is on the volume */
+    long count;                 /* clusters in this run */
+};
+
+struct fat_extent_map
+{
+    int count;                  /* extents in use */
+    struct fat_extent extent[FAT_MAX_EXTENTS];
+};
+
 /* this stores what was last accessed when read or writing a file's data */
 struct fat_filestr
 {
@@ -125,6 +143,7 @@ struct fat_filestr
     long          clusternum;   /* cluster number of last access */
     unsigned long sectornum;    /* sector number within current cluster */
     bool          eof;          /* end-of-file reached */
+    struct fat_extent_map *extents; /* extents seen so far (may be NULL) */
 };
 
 /** File entity functions **/
@@ -151,6 +170,8 @@ int fat_rename(struct fat_file *parent, struct fat_file *file,
 int fat_closewrite(struct fat_filestr *filestr, uint32_t size,
                    struct fat_direntry *fatentp);
 void fat_filestr_init(struct fat_filestr *filestr, struct fat_file *file);
+void fat_filestr_map_extents(struct fat_filestr *filestr,
+                             struct fat_extent_map *map);
 unsigned long fat_query_sectornum(const struct fat_filestr *filestr);
 long fat_readwrite(struct fat_filestr *filestr, unsigned long sectorcount,
                    void *buf, bool write);
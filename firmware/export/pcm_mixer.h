@@ -91,6 +91,20 @@ void mixer_channel_play_data(enum pcm_mixer_channel channel,
                              pcm_play_callback_type get_more,
                              const void *start, size_t size);
 
+/* Queue a buffer to play on a channel after what it has now; never waits
+   for the mixer and returns false if the queue is full. One thread may queue
+   to a channel. A channel stops when its queue runs dry and is started again
+   with mixer_channel_play_queue(). */
+bool mixer_channel_queue_data(enum pcm_mixer_channel channel,
+                              const void *start, size_t size);
+
+/* Start a stopped channel on the buffers queued to it */
+void mixer_channel_play_queue(enum pcm_mixer_channel channel);
+
+/* Return how many of the buffers queued to a channel were played out or
+   dropped; a buffer's memory may be reused once it is counted here */
+unsigned int mixer_channel_queue_done(enum pcm_mixer_channel channel);
+
 /* Pause or resume a channel (when started) */
 void mixer_channel_play_pause(enum pcm_mixer_channel channel, bool play);
 
@@ -107,6 +121,16 @@ enum channel_status mixer_channel_status(enum pcm_mixer_channel channel);
 /* Returns amount data remaining in channel before next callback */
 size_t mixer_channel_get_bytes_waiting(enum pcm_mixer_channel channel);
 
+struct mixer_channel_stats
+{
+    unsigned int underruns; /* Times the queue ran dry, stopping it */
+    size_t bytes_waiting;   /* Data ahead of the mixer, playing and queued */
+};
+
+/* Return channel's underrun count and the amount of data ahead of the mixer */
+void mixer_channel_get_stats(enum pcm_mixer_channel channel,
+                             struct mixer_channel_stats *stats);
+
 /* Return pointer to channel's playing audio data and the size remaining */
 const void * mixer_channel_get_buffer(enum pcm_mixer_channel channel,
                                       int *count);
@@ -118,7 +118,11 @@
 #define FIXEDSETTINGSFILE   ROCKBOX_DIR "/fixed.cfg"
 
 #define PLAYLIST_CONTROL_FILE   ROCKBOX_DIR "/.playlist_control"
+#define PLAYLIST_INDEX_FILE     ROCKBOX_DIR "/.playlist_index"
+#define PLAYLIST_CHECKPOINT_FILE ROCKBOX_DIR "/.playlist_checkpoint"
 #define NVRAM_FILE              ROCKBOX_DIR "/nvram.bin"
 #define GLYPH_CACHE_FILE        ROCKBOX_DIR "/.glyphcache"
+#define ALBUMART_THUMB_DIR      ROCKBOX_DIR "/.albumart_thumbs"
+#define SKIN_CACHE_DIR          ROCKBOX_DIR "/.skin_cache"
 
 #endif /* __PATHS_H__ */
@@ -33,6 +33,10 @@
 /* enable single block debugging */
 #define BUFLIB_DEBUG_BLOCK_SINGLE
 
+/* Number of size classes free blocks are indexed by. Class n holds the free
+ * blocks of 2^(n+2) to 2^(n+3)-1 units, the last one everything bigger */
+#define BUFLIB_NUM_FREE_LISTS 20
+
 union buflib_data
 {
     intptr_t val;                 /* length of the block in n*sizeof(union buflib_data).
@@ -43,9 +47,20 @@ union buflib_data
     char* alloc;                  /* start of allocated memory area */
     union buflib_data *handle;    /* pointer to entry in the handle table.
                                      Used during compaction for fast lookup */
+    union buflib_data *link;      /* free list link, in free blocks only */
     uint32_t crc;                 /* checksum of this data to detect corruption */
 };
 
+/* Compaction statistics, for the debug screens */
+struct buflib_compact_stats
+{
+    unsigned long runs;           /* full compactions */
+    unsigned long slices;         /* incremental slices that moved something */
+    unsigned long blocks_moved;   /* by either of them */
+    unsigned long bytes_moved;
+    size_t max_pause;             /* most bytes moved in one go */
+};
+
 struct buflib_context
 {
     union buflib_data *handle_table;
@@ -53,7 +68,14 @@ struct buflib_context
     union buflib_data *last_handle;
     union buflib_data *buf_start;
     union buflib_data *alloc_end;
+    /* free blocks by size class, only valid if free_index is true */
+    union buflib_data *free_lists[BUFLIB_NUM_FREE_LISTS];
+    bool free_index;
     bool compact;
+    /* incremental compaction resumes here, nothing before it is worth
+     * moving */
+    union buflib_data *compact_cursor;
+    struct buflib_compact_stats compact_stats;
 };
 
 /**
@@ -65,7 +87,7 @@ struct buflib_context
  * BUFLIB_ALLOC_OVERHEAD + requested bytes + strlen(<name passed to
  * buflib_alloc_ex()) + pad to pointer size
  */
-#define BUFLIB_ALLOC_OVERHEAD (6*sizeof(union buflib_data))
+#define BUFLIB_ALLOC_OVERHEAD (7*sizeof(union buflib_data))
 
 /**
  * Callbacks used by the buflib to inform allocation that compaction
@@ -286,6 +308,24 @@ static inline void* buflib_get_data(struct buflib_context *ctx, int handle)
  */
 bool buflib_shrink(struct buflib_context *ctx, int handle, void* newstart, size_t new_size);
 
+/**
+ * Does a slice of compaction: moves allocations down into the free space
+ * in front of them, block by block, until about budget bytes have been
+ * moved. Allocations bigger than budget are left for the full compaction
+ * a failing allocation does, so a slice never stalls the caller for
+ * longer than moving budget bytes (plus the move callbacks) takes.
+ *
+ * Only allocations with a move_callback are moved. Those without ops are
+ * movable too, but their owners only expect that to happen during an
+ * allocation and may hold on to the raw pointer until then.
+ *
+ * Meant to be called repeatedly, progress is remembered between calls.
+ *
+ * Returns: true if there's more to do, false if the buffer is as compact
+ * as slices can make it.
+ */
+bool buflib_compact_slice(struct buflib_context *ctx, size_t budget);
+
 /**
  * Frees memory associated with the given handle
  *
@@ -375,6 +415,12 @@ int buflib_get_num_blocks(struct buflib_context *ctx);
 void buflib_print_block_at(struct buflib_context *ctx, int block_num,
                             char* buf, size_t bufsize);
 
+/**
+ * Returns the compaction statistics of the context
+ */
+const struct buflib_compact_stats*
+buflib_get_compact_stats(struct buflib_context *ctx);
+
 /**
  * Check integrity of given buflib context
  */
@@ -18,10 +18,16 @@ int core_free(int handle);
 size_t core_available(void);
 size_t core_allocatable(void);
 const char* core_get_name(int handle);
+bool core_compact_slice(void);
+const struct buflib_compact_stats* core_get_compact_stats(void);
 #ifdef DEBUG
 void core_check_valid(void);
 #endif
 
+/* Bytes core_compact_slice() may move per call, 0 turns it off */
+#define CORE_COMPACT_BUDGET (32<<10)
+void core_set_compact_budget(size_t bytes);
+
 /* DO NOT ADD wrappers for buflib_buffer_out/in. They do not call
  * the move callbacks and are therefore unsafe in the core */
 
@@ -63,6 +63,10 @@ typedef uint32_t dc_serial_t;
 #if CONFIG_PLATFORM & PLATFORM_NATIVE
 /* native dircache is lower-level than on a hosted target */
 #define DIRCACHE_NATIVE
+#ifndef HAVE_HOTSWAP
+/* the cache may be saved at shutdown and loaded again at boot */
+#define DIRCACHE_SNAPSHOT
+#endif
 #endif
 
 struct dircache_file
@@ -112,6 +116,9 @@ int dircache_readdir_internal(struct filestr_base *stream,
                               struct file_base_info *infop,
                               struct fat_direntry *fatent);
 void dircache_rewinddir_internal(struct file_base_info *info);
+int dircache_lookup_internal(struct filestr_base *stream, const char *name,
+                             struct file_base_info *infop,
+                             struct fat_direntry *fatent);
 #endif /* DIRCACHE_NATIVE */
 
 
@@ -136,6 +143,8 @@ void dircache_fileop_sync(struct file_base_binding *infop,
 ssize_t dircache_get_path(const struct dircache_file *dcfilep, char *buf,
                           size_t size);
 int dircache_get_file(const char *path, struct dircache_file *dcfilep);
+unsigned long dircache_get_change_count(void);
+unsigned long dircache_get_dir_change_count(const char *dirpath);
 
 
 /** Debug screen/info stuff **/
@@ -163,10 +172,10 @@ void dircache_dump(void);
 /** Misc. stuff **/
 void dircache_dcfile_init(struct dircache_file *dcfilep);
 
-#ifdef HAVE_EEPROM_SETTINGS
+#ifdef DIRCACHE_SNAPSHOT
 int dircache_load(void);
 int dircache_save(void);
-#endif /* HAVE_EEPROM_SETTINGS */
+#endif /* DIRCACHE_SNAPSHOT */
 
 void dircache_init(size_t last_size) INIT_ATTR;
 
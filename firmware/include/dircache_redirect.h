@@ -183,6 +183,19 @@ static inline void rewinddir_internal(struct file_base_info *infop)
 #endif
 }
 
+static inline int lookup_internal(struct filestr_base *stream,
+                                  const char *name,
+                                  struct file_base_info *infop,
+                                  struct fat_direntry *fatent)
+{
+#ifdef HAVE_DIRCACHE
+    return dircache_lookup_internal(stream, name, infop, fatent);
+#else
+    return -1; /* scan it */
+    (void)stream; (void)name; (void)infop; (void)fatent;
+#endif
+}
+
 
 /** Misc. stuff **/
 
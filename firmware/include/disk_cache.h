@@ -26,20 +26,33 @@
  * for other file system code. The buffers are put to use by the cache if not
  * taken for another purpose (meaning nothing is wasted sitting fallow).
  *
- * One map per volume is maintained in order to avoid collisions between
- * volumes that would slow cache probing. DC_MAP_NUM_ENTRIES is the number
- * for each map per volume. The buffers themselves are shared.
+ * One hash table per volume is maintained in order to avoid collisions
+ * between volumes that would slow cache probing. DC_MAP_NUM_ENTRIES is the
+ * number of buckets for each volume. The buffers themselves are shared.
+ *
+ * A target may set both DC_NUM_ENTRIES and DC_MAP_BITS in its config to size
+ * the cache differently.
  */
+#ifndef DC_NUM_ENTRIES
 #if MEMORYSIZE < 8
 #define DC_NUM_ENTRIES      32
-#define DC_MAP_NUM_ENTRIES  128
+#define DC_MAP_BITS         7
 #elif MEMORYSIZE <= 32
 #define DC_NUM_ENTRIES      48
-#define DC_MAP_NUM_ENTRIES  128
-#else /* MEMORYSIZE > 32 */
+#define DC_MAP_BITS         7
+#elif MEMORYSIZE <= 64
 #define DC_NUM_ENTRIES      64
-#define DC_MAP_NUM_ENTRIES  256
+#define DC_MAP_BITS         8
+#else /* MEMORYSIZE > 64 */
+#define DC_NUM_ENTRIES      128
+#define DC_MAP_BITS         9
 #endif /* MEMORYSIZE */
+#endif /* DC_NUM_ENTRIES */
+
+#define DC_MAP_NUM_ENTRIES  (1u << DC_MAP_BITS)
+
+/* Most sectors that dc_cache_readahead() will store at once */
+#define DC_READAHEAD_MAX    (DC_NUM_ENTRIES / 8)
 
 /* this _could_ be larger than a sector if that would ever be useful */
 #define DC_CACHE_BUFSIZE    SECTOR_SIZE
@@ -63,6 +76,8 @@ void * dc_cache_probe(IF_MV(int volume,) unsigned long secnum,
                       unsigned int *flags);
 void dc_dirty_buf(void *buf);
 void dc_discard_buf(void *buf);
+void dc_cache_readahead(IF_MV(int volume,) unsigned long sector,
+                        unsigned int count, const void *data);
 void dc_commit_all(IF_MV_NONVOID(int volume));
 void dc_discard_all(IF_MV_NONVOID(int volume));
 
@@ -80,4 +95,19 @@ void * dc_get_buffer(void);
 /* return buffer to the cache by buffer */
 void dc_release_buffer(void *buf);
 
+struct dc_stats
+{
+    unsigned long hits;           /* probes that found the sector */
+    unsigned long misses;         /* probes that needed a fill */
+    unsigned long evictions;      /* sectors dropped to make room */
+    unsigned long writebacks;     /* dirty sectors written out */
+    unsigned long readahead;      /* sectors stored ahead of need */
+    unsigned long readahead_hits; /* of those, later probed */
+    unsigned int entries;         /* size of the cache */
+    unsigned int buckets;         /* hash buckets per volume */
+    unsigned int lru_entries;     /* entries not taken as buffers */
+};
+
+void dc_get_stats(struct dc_stats *stats);
+
 #endif /* DISK_CACHE_H */
@@ -44,7 +44,7 @@ enum relate_result
 
 #if defined(APPLICATION)
 #include "filesystem-app.h"
-#elif defined(SIMULATOR) || defined(__PCTOOL__)
+#elif (defined(SIMULATOR) || defined(__PCTOOL__)) && !defined(TEST_FAT)
 #include "../../uisimulator/common/filesystem-sim.h"
 #else
 #include "filesystem-native.h"
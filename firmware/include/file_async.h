@@ -0,0 +1,50 @@
+/***************************************************************************
+ *             __________               __   ___.
+ *   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+ *   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+ *   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+ *   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+ *                     \/            \/     \/    \/            \/
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ****************************************************************************/
+#ifndef _FILE_ASYNC_H_
+#define _FILE_ASYNC_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include "config.h"
+#include "kernel.h"
+
+/* Queued reads: the request is handed to the I/O thread and the caller goes
+ * on with its work. When the read is done, the I/O thread posts event id to
+ * queue with a pointer to the request as data.
+ *
+ * Requests are served in the order they were submitted. The request, its
+ * buffer and the file descriptor have to stay valid until it is done. */
+struct file_async_req
+{
+    int fd;                     /* file to read from */
+    void *buf;                  /* destination */
+    size_t count;               /* bytes to read */
+    struct event_queue *queue;  /* queue to notify, may be NULL */
+    long id;                    /* event id to post */
+    ssize_t result;             /* return value of read() */
+    long ticks;                 /* time the read took */
+    volatile bool done;         /* result is valid */
+};
+
+void file_async_init(void) INIT_ATTR;
+void file_read_async(struct file_async_req *req);
+/* Block until req is done, for when its result can't wait for the event */
+void file_async_wait(struct file_async_req *req);
+
+#endif /* _FILE_ASYNC_H_ */
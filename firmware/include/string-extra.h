@@ -27,6 +27,7 @@
 #include "strcasestr.h"
 #include "strtok_r.h"
 #include "memset16.h"
+#include "memeol.h"
 
 #if defined(WIN32) || defined(APPLICATION) \
         || defined(__PCTOOL__)
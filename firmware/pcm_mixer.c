@@ -37,6 +37,23 @@ static unsigned int mixer_sampr = HW_SAMPR_DEFAULT;
 /* Define this to nonzero to add a marker pulse at each frame start */
 #define FRAME_BOUNDARY_MARKERS 0
 
+/* Buffers queued to a channel. Only the producer advances "in" and only the
+   mixer, or whoever holds the PCM lock, advances "out" and "done", so the
+   producer never has to wait for the mixer. The counts are volatile and a
+   compiler barrier keeps a buffer entry written before the count that
+   publishes it. The channels are in IRAM, which isn't cached, so both cores
+   of PortalPlayer targets see them alike; the producer writes back its
+   cache before queueing so the mixer reads the data it wrote. */
+#define MIX_CHAN_QUEUE_LEN  8 /* Power of 2 */
+
+#define queue_barrier() asm volatile ("" : : : "memory")
+
+struct mixer_queue_buf
+{
+    const void *start;
+    size_t size;
+};
+
 /* Descriptor for each channel */
 struct mixer_channel
 {
@@ -47,6 +64,12 @@ struct mixer_channel
     enum channel_status status;      /* Playback status */
     uint32_t amplitude;              /* Amp. factor: 0x0000 = mute, 0x10000 = unity */
     chan_buffer_hook_fn_type buffer_hook; /* Callback for new buffer */
+    struct mixer_queue_buf queue[MIX_CHAN_QUEUE_LEN]; /* Queued buffers */
+    unsigned int volatile queue_in;  /* Buffers queued */
+    unsigned int volatile queue_out; /* Buffers taken */
+    unsigned int volatile queue_done; /* Buffers played out or dropped */
+    bool from_queue;                 /* Current buffer was taken from queue */
+    unsigned int underruns;          /* Times the queue ran dry */
 };
 
 /* Forget about boost here for the moment */
@@ -92,15 +115,71 @@ static void mixer_deactivate_channel(struct mixer_channel *chan)
     remove_array_ptr((void **)active_channels, chan);
 }
 
+/* The current buffer won't be read anymore - count it if it was queued */
+static void chan_buffer_done(struct mixer_channel *chan)
+{
+    if (chan->from_queue)
+    {
+        chan->from_queue = false;
+        queue_barrier();
+        chan->queue_done++;
+    }
+}
+
+/* Make the next queued buffer current, if there is one */
+static bool chan_take_queued(struct mixer_channel *chan)
+{
+    unsigned int out = chan->queue_out;
+
+    if (out == chan->queue_in)
+        return false;
+
+    queue_barrier();
+    struct mixer_queue_buf *buf = &chan->queue[out % MIX_CHAN_QUEUE_LEN];
+    chan->start = buf->start;
+    chan->size = buf->size;
+    chan->from_queue = true;
+    queue_barrier();
+    chan->queue_out = out + 1;
+    return true;
+}
+
+/* Drop everything still queued to a channel */
+static void chan_drop_queue(struct mixer_channel *chan)
+{
+    unsigned int in = chan->queue_in;
+    chan->queue_out = in;
+    chan->queue_done = in;
+}
+
 /* Deactivate channel and change it to stopped state */
 static void channel_stopped(struct mixer_channel *chan)
 {
     mixer_deactivate_channel(chan);
+    chan_buffer_done(chan);
     chan->size = 0;
     chan->start = NULL;
     chan->status = CHANNEL_STOPPED;
 }
 
+/* Get the next buffer for a channel: queued ones first, then whatever the
+   callback has */
+static bool chan_next_buffer(struct mixer_channel *chan)
+{
+    chan_buffer_done(chan);
+
+    if (chan_take_queued(chan))
+        return true;
+
+    if (chan->get_more)
+    {
+        chan->get_more(&chan->start, &chan->size);
+        ALIGN_AUDIOBUF(chan->start, chan->size);
+    }
+
+    return chan->start && chan->size;
+}
+
 /* Main PCM callback - sends the current prepared frame to play */
 static void mixer_pcm_callback(const void **addr, size_t *size)
 {
@@ -145,15 +224,14 @@ fill_frame:
 
         if (chan->size == 0)
         {
-            if (chan->get_more)
-            {
-                chan->get_more(&chan->start, &chan->size);
-                ALIGN_AUDIOBUF(chan->start, chan->size);
-            }
+            bool queued = chan->from_queue;
 
-            if (!(chan->start && chan->size))
+            if (!chan_next_buffer(chan))
             {
-                /* Channel is stopping */
+                /* Channel is stopping - a queued one ran dry */
+                if (queued)
+                    chan->underruns++;
+
                 channel_stopped(chan);
                 continue;
             }
@@ -301,6 +379,7 @@ void mixer_channel_play_data(enum pcm_mixer_channel channel,
     if (start && size)
     {
         /* We have data - start the channel */
+        chan_buffer_done(chan);
         chan->status = CHANNEL_PLAYING;
         chan->start = start;
         chan->size = size;
@@ -320,6 +399,68 @@ void mixer_channel_play_data(enum pcm_mixer_channel channel,
     pcm_play_unlock();
 }
 
+/* Queue a buffer to play on a channel after what it has now; never waits
+   for the mixer and returns false if the queue is full */
+bool mixer_channel_queue_data(enum pcm_mixer_channel channel,
+                              const void *start, size_t size)
+{
+    struct mixer_channel *chan = &channels[channel];
+
+    ALIGN_AUDIOBUF(start, size);
+
+    if (!(start && size))
+        return true;
+
+    unsigned int in = chan->queue_in;
+
+    if (in - chan->queue_out >= MIX_CHAN_QUEUE_LEN)
+        return false;
+
+#if NUM_CORES > 1
+    /* The mixer may run on the other core */
+    commit_dcache();
+#endif
+
+    queue_barrier();
+    struct mixer_queue_buf *buf = &chan->queue[in % MIX_CHAN_QUEUE_LEN];
+    buf->start = start;
+    buf->size = size;
+    queue_barrier();
+    chan->queue_in = in + 1;
+
+    return true;
+}
+
+/* Start a stopped channel on the buffers queued to it */
+void mixer_channel_play_queue(enum pcm_mixer_channel channel)
+{
+    struct mixer_channel *chan = &channels[channel];
+
+    pcm_play_lock();
+
+    if (chan->status == CHANNEL_STOPPED && chan_take_queued(chan))
+    {
+        chan->status = CHANNEL_PLAYING;
+        chan->last_size = 0;
+        chan->get_more = NULL;
+
+        mixer_activate_channel(chan);
+        chan_call_buffer_hook(chan);
+        mixer_start_pcm();
+    }
+
+    pcm_play_unlock();
+}
+
+/* Return how many of the buffers queued to a channel were played out or
+   dropped; a buffer's memory may be reused once it is counted here */
+unsigned int mixer_channel_queue_done(enum pcm_mixer_channel channel)
+{
+    unsigned int done = channels[channel].queue_done;
+    queue_barrier();
+    return done;
+}
+
 /* Pause or resume a channel (when started) */
 void mixer_channel_play_pause(enum pcm_mixer_channel channel, bool play)
 {
@@ -353,6 +494,7 @@ void mixer_channel_stop(enum pcm_mixer_channel channel)
 
     pcm_play_lock();
     channel_stopped(chan);
+    chan_drop_queue(chan);
     pcm_play_unlock();
 }
 
@@ -375,6 +517,24 @@ size_t mixer_channel_get_bytes_waiting(enum pcm_mixer_channel channel)
     return channels[channel].size;
 }
 
+/* Return channel's underrun count and the amount of data ahead of the mixer */
+void mixer_channel_get_stats(enum pcm_mixer_channel channel,
+                             struct mixer_channel_stats *stats)
+{
+    struct mixer_channel *chan = &channels[channel];
+    unsigned int out = chan->queue_out;
+    unsigned int in = chan->queue_in;
+    size_t queued = 0;
+
+    queue_barrier();
+
+    for (; out != in; out++)
+        queued += chan->queue[out % MIX_CHAN_QUEUE_LEN].size;
+
+    stats->underruns = chan->underruns;
+    stats->bytes_waiting = chan->size + queued;
+}
+
 /* Return pointer to channel's playing audio data and the size remaining */
 const void * mixer_channel_get_buffer(enum pcm_mixer_channel channel, int *count)
 {
@@ -411,9 +571,18 @@ void mixer_channel_calculate_peaks(enum pcm_mixer_channel channel,
 void mixer_adjust_channel_address(enum pcm_mixer_channel channel,
                                   off_t offset)
 {
+    struct mixer_channel *chan = &channels[channel];
+
     pcm_play_lock();
     /* Makes no difference if it's stopped */
-    channels[channel].start += offset;
+    chan->start += offset;
+
+    /* Whatever is queued lives in the same buffer */
+    unsigned int in = chan->queue_in;
+    queue_barrier();
+    for (unsigned int out = chan->queue_out; out != in; out++)
+        chan->queue[out % MIX_CHAN_QUEUE_LEN].start += offset;
+
     pcm_play_unlock();
 }
 
@@ -437,6 +606,9 @@ void mixer_reset(void)
     while (*active_channels)
         channel_stopped(*active_channels);
 
+    for (int i = 0; i < PCM_MIXER_NUM_CHANNELS; i++)
+        chan_drop_queue(&channels[i]);
+
     idle_counter = 0;
 }
 
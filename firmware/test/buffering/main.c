@@ -0,0 +1,244 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/*
+ * Times the handle lookups of the buffering API. A number of handles is
+ * allocated from memory, then bufgetdata(), bufread() and
+ * buf_handle_remaining() are called on handles picked at random, the way
+ * the codec and the playback code switch between audio, metadata and album
+ * art handles.
+ *
+ * Between rounds a random half of the handles is closed and as many new
+ * ones are allocated, so the IDs keep growing and the handles end up all
+ * over the lookup table. Closed handles must not be found anymore and every
+ * open handle must still give back its own data, also to a thread that
+ * keeps looking them up while the others are closed, like the codec does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "config.h"
+#include "buffering.h"
+
+#define BUFFER_SIZE (8*1024*1024)
+
+static char buffer[BUFFER_SIZE];
+
+static int ids[BUF_MAX_HANDLES];
+static size_t sizes[BUF_MAX_HANDLES];
+
+/* handles that are about to be closed, which the reader leaves alone */
+static bool closing[BUF_MAX_HANDLES];
+static volatile bool reading;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char data_byte(int id, size_t i)
+{
+    return id * 31 + i;
+}
+
+static int alloc_handle(int n)
+{
+    unsigned char data[4096];
+    size_t size = 256 + rand() % (sizeof (data) - 256);
+
+    for (size_t i = 0; i < size; i++)
+        data[i] = data_byte(n, i);
+
+    int id = bufalloc(data, size, TYPE_PACKET_AUDIO);
+    if (id < 0)
+    {
+        printf("Failed allocating handle %d (%d)\n", n, id);
+        return -1;
+    }
+
+    ids[n] = id;
+    sizes[n] = size;
+    return 0;
+}
+
+/* whether the handle is there and gives back its own data */
+static int check_handle(int n)
+{
+    unsigned char data[16];
+    void *p;
+
+    if (bufgetdata(ids[n], 0, &p) != (ssize_t)sizes[n] ||
+        bufread(ids[n], sizeof (data), data) != sizeof (data) ||
+        buf_handle_remaining(ids[n]) != 0)
+    {
+        printf("Failed looking up handle %d\n", ids[n]);
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof (data); i++)
+    {
+        if (data[i] != data_byte(n, i) ||
+            ((unsigned char *)p)[sizes[n] - 1 - i] !=
+                data_byte(n, sizes[n] - 1 - i))
+        {
+            printf("Wrong data in handle %d\n", ids[n]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int lookups(int handles, int count, double *time)
+{
+    double start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        if (check_handle(rand() % handles) < 0)
+            return -1;
+    }
+
+    *time += now() - start;
+    return 0;
+}
+
+/* looks up the handles that stay open until told to stop */
+static void *reader(void *arg)
+{
+    int handles = *(int *)arg;
+    intptr_t ret = 0;
+
+    while (reading && ret == 0)
+    {
+        for (int n = 0; n < handles && ret == 0; n++)
+        {
+            if (!closing[n])
+                ret = check_handle(n);
+        }
+    }
+
+    return (void *)ret;
+}
+
+/* closes a random half of the handles and allocates new ones in their
+   place */
+static int replace_handles(int handles)
+{
+    pthread_t thread;
+    void *ret;
+    int rc = 0;
+
+    for (int n = 0; n < handles; n++)
+        closing[n] = rand() % 2 == 0;
+
+    reading = true;
+    pthread_create(&thread, NULL, reader, &handles);
+
+    for (int n = 0; n < handles && rc == 0; n++)
+    {
+        if (closing[n] && (!bufclose(ids[n]) || buf_is_handle(ids[n])))
+        {
+            printf("Failed closing handle %d\n", ids[n]);
+            rc = -1;
+        }
+    }
+
+    reading = false;
+    pthread_join(thread, &ret);
+
+    if (rc < 0 || ret != NULL)
+        return -1;
+
+    for (int n = 0; n < handles; n++)
+    {
+        if (!closing[n] && check_handle(n) < 0)
+            return -1;
+    }
+
+    for (int n = 0; n < handles; n++)
+    {
+        if (closing[n] && alloc_handle(n) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || atoi(argv[1]) < 1 || atoi(argv[1]) > BUF_MAX_HANDLES)
+    {
+        printf("usage: buffering <handles, up to %d> <lookups> [rounds]\n",
+               BUF_MAX_HANDLES);
+        return -1;
+    }
+
+    int handles = atoi(argv[1]), count = atoi(argv[2]);
+    int rounds = argc > 3 ? atoi(argv[3]) : 10;
+    double time = 0;
+
+    srand(1);
+    buffering_init();
+
+    if (!buffering_reset(buffer, sizeof (buffer)))
+    {
+        printf("Failed setting up the buffer\n");
+        return -2;
+    }
+
+    for (int n = 0; n < handles; n++)
+    {
+        if (alloc_handle(n) < 0)
+            return -3;
+    }
+
+    for (int round = 0; round < rounds; round++)
+    {
+        if (lookups(handles, count, &time) < 0)
+            return -4;
+
+        /* start over before the buffer runs out */
+        if (buf_used() > sizeof (buffer) / 2)
+        {
+            for (int n = 0; n < handles; n++)
+                bufclose(ids[n]);
+
+            for (int n = 0; n < handles; n++)
+            {
+                if (alloc_handle(n) < 0)
+                    return -5;
+            }
+        }
+        else if (replace_handles(handles) < 0)
+            return -6;
+    }
+
+    /* three calls for every lookup */
+    printf("%d lookups of %d handles in %d rounds: %.1f ns per call\n",
+           count, handles, rounds, time * 1e9 / (3.0 * count * rounds));
+
+    return 0;
+}
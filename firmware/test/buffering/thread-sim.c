@@ -0,0 +1,237 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/* The buffering thread runs on a thread of its own, so handles get closed
+   behind the lookups like they do on the target. One lock stands in for the
+   kernel's queues and another for every mutex; there's only the one queue
+   and the one mutex of the buffering code. */
+#include <pthread.h>
+#include <time.h>
+#include "config.h"
+#include "system.h"
+#include "kernel.h"
+#include "thread.h"
+
+volatile long current_tick;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t mutex_lock_sim;
+static pthread_once_t mutex_once = PTHREAD_ONCE_INIT;
+
+static void (*thread_function)(void);
+static pthread_t thread;
+
+/* Events that were sent rather than posted wait for a reply */
+static bool sent[QUEUE_LENGTH];
+static bool replying, replied;
+static intptr_t reply;
+
+static void update_tick(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    current_tick = ts.tv_sec * HZ + ts.tv_nsec / (1000000000 / HZ);
+}
+
+unsigned int create_thread(void (*function)(void), void *stack,
+                           size_t stack_size, unsigned flags,
+                           const char *name IF_PRIO(, int priority)
+                           IF_COP(, unsigned int core))
+{
+    thread_function = function;
+    return 1;
+    (void)stack; (void)stack_size; (void)flags; (void)name;
+}
+
+static void *thread_start(void *arg)
+{
+    ((void (*)(void))arg)();
+    return NULL;
+}
+
+void thread_thaw(unsigned int thread_id)
+{
+    if (!thread_function)
+        return;
+
+    update_tick();
+    pthread_create(&thread, NULL, thread_start, thread_function);
+    pthread_detach(thread);
+    thread_function = NULL;
+    (void)thread_id;
+}
+
+unsigned int thread_self(void)
+{
+    return pthread_equal(pthread_self(), thread) ? 1 : 0;
+}
+
+unsigned sleep(unsigned ticks)
+{
+    struct timespec ts = { ticks / HZ, ticks % HZ * (1000000000 / HZ) };
+    nanosleep(&ts, NULL);
+    update_tick();
+    return 0;
+}
+
+void yield(void)
+{
+    sched_yield();
+}
+
+static void init_mutex_lock(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mutex_lock_sim, &attr);
+}
+
+void mutex_init(struct mutex *m)
+{
+    pthread_once(&mutex_once, init_mutex_lock);
+    (void)m;
+}
+
+void mutex_lock(struct mutex *m)
+{
+    pthread_mutex_lock(&mutex_lock_sim);
+    (void)m;
+}
+
+void mutex_unlock(struct mutex *m)
+{
+    pthread_mutex_unlock(&mutex_lock_sim);
+    (void)m;
+}
+
+void queue_init(struct event_queue *q, bool register_queue)
+{
+    q->read = q->write = 0;
+    (void)register_queue;
+}
+
+void queue_enable_queue_send(struct event_queue *q,
+                             struct queue_sender_list *send,
+                             unsigned int owner_id)
+{
+    (void)q; (void)send; (void)owner_id;
+}
+
+static void post(struct event_queue *q, long id, intptr_t data, bool send)
+{
+    unsigned int i = q->write++ & QUEUE_LENGTH_MASK;
+    q->events[i].id   = id;
+    q->events[i].data = data;
+    sent[i] = send;
+    pthread_cond_broadcast(&queue_cond);
+}
+
+void queue_post(struct event_queue *q, long id, intptr_t data)
+{
+    pthread_mutex_lock(&queue_lock);
+    post(q, id, data, false);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+intptr_t queue_send(struct event_queue *q, long id, intptr_t data)
+{
+    pthread_mutex_lock(&queue_lock);
+
+    post(q, id, data, true);
+    replied = false;
+    while (!replied)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+
+    intptr_t retval = reply;
+    pthread_mutex_unlock(&queue_lock);
+    return retval;
+}
+
+static void reply_locked(intptr_t retval)
+{
+    if (!replying)
+        return;
+
+    replying = false;
+    replied = true;
+    reply = retval;
+    pthread_cond_broadcast(&queue_cond);
+}
+
+void queue_reply(struct event_queue *q, intptr_t retval)
+{
+    pthread_mutex_lock(&queue_lock);
+    reply_locked(retval);
+    pthread_mutex_unlock(&queue_lock);
+    (void)q;
+}
+
+void queue_wait_w_tmo(struct event_queue *q, struct queue_event *ev,
+                      int ticks)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += ticks / HZ;
+    ts.tv_nsec += ticks % HZ * (1000000000 / HZ);
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+
+    /* a sender that didn't get an answer gets 0, like on the target */
+    reply_locked(0);
+
+    while (q->read == q->write && ticks != 0)
+    {
+        if (ticks == TIMEOUT_BLOCK)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        else if (pthread_cond_timedwait(&queue_cond, &queue_lock, &ts))
+            break;
+    }
+
+    if (q->read == q->write)
+    {
+        ev->id = SYS_TIMEOUT;
+        ev->data = 0;
+    }
+    else
+    {
+        unsigned int i = q->read++ & QUEUE_LENGTH_MASK;
+        *ev = q->events[i];
+        replying = sent[i];
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+    update_tick();
+}
+
+void queue_wait(struct event_queue *q, struct queue_event *ev)
+{
+    queue_wait_w_tmo(q, ev, TIMEOUT_BLOCK);
+}
+
+bool queue_empty(const struct event_queue *q)
+{
+    return q->read == q->write;
+}
@@ -0,0 +1,91 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/*
+ * Allocation benchmark: keeps many small allocations alive, the way fonts,
+ * skins, album art, dircache and tagcache do, and measures how long it takes
+ * to free one and allocate another in their middle.
+ *
+ * Built without DEBUG so the allocator doesn't print every call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "buflib.h"
+
+#define BUFLIB_BUFFER_SIZE (8<<20)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+#define MAX_HANDLES 4096
+static int handles[MAX_HANDLES];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t random_size(void)
+{
+    /* mostly small, sometimes a few kiB */
+    return (rand() % 8) ? 16 + rand() % 512 : 1024 + rand() % 8192;
+}
+
+static void run(int live, int rounds)
+{
+    int i, failed = 0;
+
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+    srand(1);
+
+    for (i = 0; i < live; i++)
+        handles[i] = buflib_alloc_ex(&ctx, random_size(), "bench", NULL);
+
+    double start = now();
+    for (i = 0; i < rounds; i++)
+    {
+        int victim = rand() % live;
+        if (handles[victim] > 0)
+            buflib_free(&ctx, handles[victim]);
+        handles[victim] = buflib_alloc_ex(&ctx, random_size(), "bench", NULL);
+        if (handles[victim] <= 0)
+            failed++;
+    }
+    double elapsed = now() - start;
+
+    printf("%5d live blocks: %8.1f ns per free+alloc (%d failed)\n",
+           live, elapsed * 1e9 / rounds, failed);
+
+    for (i = 0; i < live; i++)
+        if (handles[i] > 0)
+            buflib_free(&ctx, handles[i]);
+}
+
+int main(void)
+{
+    int live;
+
+    for (live = 64; live <= MAX_HANDLES; live *= 4)
+        run(live, 200000);
+
+    return 0;
+}
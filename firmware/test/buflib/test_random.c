@@ -0,0 +1,120 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/*
+ * Frees, allocates and shrinks at random and checks after every step that
+ * the blocks still add up, that every block ends in its length marker while
+ * the free index is valid, and that no allocation was overwritten.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buflib.h"
+
+#define BUFLIB_BUFFER_SIZE (16<<10)
+static char buflib_buffer[BUFLIB_BUFFER_SIZE];
+static struct buflib_context ctx;
+
+#define NUM_HANDLES 48
+static int handles[NUM_HANDLES];
+static size_t sizes[NUM_HANDLES];
+
+static int move_callback(int handle, void* current, void* new)
+{
+    (void)handle;(void)current;(void)new;
+    return BUFLIB_CB_OK;
+}
+
+static struct buflib_callbacks movable = { .move_callback = move_callback };
+static struct buflib_callbacks unmovable;
+
+static int check_blocks(void)
+{
+    union buflib_data *block;
+
+    for (block = ctx.buf_start; block < ctx.alloc_end; block += abs(block->val))
+    {
+        if (block->val == 0)
+            return 1;
+        /* allocated blocks always end in their length, free ones only
+         * while they're indexed */
+        if ((block->val > 0 || ctx.free_index) &&
+            block[abs(block->val) - 1].val != block->val)
+            return 1;
+    }
+
+    return block != ctx.alloc_end;
+}
+
+static int check_data(int i)
+{
+    unsigned char *data = buflib_get_data(&ctx, handles[i]);
+    for (size_t j = 0; j < sizes[i]; j++)
+        if (data[j] != (unsigned char)i)
+            return 1;
+    return 0;
+}
+
+int main(void)
+{
+    int ret = 0;
+
+    buflib_init(&ctx, buflib_buffer, BUFLIB_BUFFER_SIZE);
+    srand(1);
+
+    for (int round = 0; round < 20000 && !ret; round++)
+    {
+        int i = rand() % NUM_HANDLES;
+
+        if (handles[i] > 0)
+        {
+            ret |= check_data(i);
+            if (rand() % 4)
+            {
+                buflib_free(&ctx, handles[i]);
+                handles[i] = 0;
+            }
+            else
+            {   /* cut some off the end */
+                sizes[i] /= 2;
+                buflib_shrink(&ctx, handles[i],
+                              buflib_get_data(&ctx, handles[i]), sizes[i]);
+            }
+        }
+        else
+        {
+            sizes[i] = 1 + rand() % ((rand() % 8) ? 256 : 4096);
+            handles[i] = buflib_alloc_ex(&ctx, sizes[i], "random",
+                                         (rand() % 4) ? &movable : &unmovable);
+            if (handles[i] > 0)
+                memset(buflib_get_data(&ctx, handles[i]), i, sizes[i]);
+        }
+
+        ret |= check_blocks();
+    }
+
+    for (int i = 0; i < NUM_HANDLES; i++)
+        if (handles[i] > 0)
+            ret |= check_data(i);
+
+    printf("%s\n", ret ? "FAILED" : "OK");
+
+    return ret;
+}
@@ -0,0 +1,85 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+#include <stdio.h>
+#include "core_alloc.h"
+#include "util.h"
+
+static int moves;
+int move_callback(int handle, void* old, void* new)
+{
+    (void)old; (void)new;
+    printf("Move! %s\n", core_get_name(handle));
+    moves++;
+
+    return BUFLIB_CB_OK;
+}
+
+struct buflib_callbacks ops = {
+    .move_callback = move_callback,
+    .shrink_callback = NULL,
+};
+
+int main(void)
+{
+    UT_core_allocator_init();
+    core_set_compact_budget(4<<10);
+
+    int first = core_alloc("first", 2<<10);
+    int second = core_alloc_ex("second", 2<<10, &ops);
+    int third = core_alloc_ex("third", 2<<10, &ops);
+    int big = core_alloc_ex("big", 8<<10, &ops);
+    int plain = core_alloc("plain", 1<<10);
+    strcpy(core_get_data(second), "second's data");
+    strcpy(core_get_data(third), "third's data");
+
+    core_free(first);
+
+    /* the budget covers both small blocks but not the big one */
+    bool more = core_compact_slice();
+    int ret = !(moves == 2 && more);
+
+    /* the big one stays where it is, nothing left to do for slices */
+    more = core_compact_slice();
+    ret |= !(moves == 2 && !more);
+
+    ret |= strcmp(core_get_data(second), "second's data") != 0;
+    ret |= strcmp(core_get_data(third), "third's data") != 0;
+
+    const struct buflib_compact_stats *stats = core_get_compact_stats();
+    printf("slices: %lu, runs: %lu, moved: %lu bytes, worst: %lu bytes\n",
+           stats->slices, stats->runs, stats->bytes_moved,
+           (unsigned long)stats->max_pause);
+    ret |= !(stats->slices == 1 && stats->runs == 0 &&
+             stats->blocks_moved == 2);
+
+    /* blocks without a move callback are only moved by allocations, their
+     * owners may hold on to the pointer until then */
+    char *plain_data = core_get_data(plain);
+    core_free(big);
+    core_compact_slice();
+    ret |= !(moves == 2 && core_get_data(plain) == plain_data);
+
+    core_print_blocks(&print_simple);
+
+    core_free(second);
+    core_free(third);
+    core_free(plain);
+
+    return ret;
+}
@@ -0,0 +1,278 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/*
+ * Times opening paths through the dircache. The first run fills disk.img
+ * with a number of directories holding a number of files each; every run
+ * builds the cache and then opens files picked at random from all the
+ * directories, so consecutive lookups keep switching directories. Every
+ * lookup has to find its file and a name that isn't there must not be found.
+ *
+ * Then the cache is saved, a few files are changed behind its back and the
+ * snapshot is loaded again. The same lookups are timed before the snapshot
+ * is verified and the changes have to show both before and after.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include "config.h"
+#include "debug.h"
+#include "disk.h"
+#include "file.h"
+#include "dir.h"
+#include "dircache.h"
+#include "core_alloc.h"
+#include "file_internal.h"
+
+extern int ata_init(void);
+extern void ata_exit(void);
+
+void panicf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "***PANIC*** ");
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static void make_path(char *buf, int dir, int file)
+{
+    sprintf(buf, "/dir %03d/track %05d - some artist - some title.mp3",
+            dir, file);
+}
+
+static int make_tree(int dirs, int files)
+{
+    char path[MAX_PATH];
+
+    if (mkdir(ROCKBOX_DIR) < 0)
+        return -1;
+
+    for (int i = 0; i < dirs; i++)
+    {
+        sprintf(path, "/dir %03d", i);
+        if (mkdir(path) < 0)
+            return -1;
+
+        for (int j = 0; j < files; j++)
+        {
+            make_path(path, i, j);
+            int fd = creat(path, 0666);
+            if (fd < 0 || close(fd) < 0)
+                return -2;
+        }
+    }
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* opens count files picked at random; the last file of each directory is
+   left to the changes */
+static int lookups(const char *what, int dirs, int files, int count)
+{
+    char path[MAX_PATH];
+
+    srand(1);
+    double start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        make_path(path, rand() % dirs, rand() % (files - 1));
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            printf("Failed opening %s\n", path);
+            return -1;
+        }
+
+        close(fd);
+    }
+
+    printf("%d lookups in %d directories of %d files %s: %.1f us per lookup\n",
+           count, dirs, files, what, (now() - start) * 1e6 / count);
+
+    return 0;
+}
+
+/* removes one file, writes to another and adds a third; or puts them back
+   the way make_tree() made them */
+static int make_changes(int files, bool undo)
+{
+    char path[MAX_PATH];
+
+    make_path(path, 0, files - 1);
+    int fd = undo ? creat(path, 0666) : remove(path);
+    if (fd < 0 || (undo && close(fd) < 0))
+        return -1;
+
+    make_path(path, 1, files - 1);
+    fd = creat(path, 0666);
+    if (fd < 0)
+        return -1;
+
+    if (!undo && write(fd, path, sizeof (path)) != sizeof (path))
+        fd = -1;
+
+    if (close(fd) < 0)
+        return -1;
+
+    make_path(path, 2, files);
+    fd = undo ? remove(path) : creat(path, 0666);
+    if (fd < 0 || (!undo && close(fd) < 0))
+        return -1;
+
+    return 0;
+}
+
+/* whether lookups see what make_changes() did */
+static int check_changes(int files)
+{
+    char path[MAX_PATH];
+
+    make_path(path, 0, files - 1);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        printf("Found removed %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    make_path(path, 1, files - 1);
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || filesize(fd) != sizeof (path))
+    {
+        printf("Old size of %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    make_path(path, 2, files);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Failed opening added %s\n", path);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4 || atoi(argv[1]) < 3 || atoi(argv[2]) < 2)
+    {
+        printf("usage: dircache <dirs> <files per dir> <lookups>\n");
+        return -1;
+    }
+
+    int dirs = atoi(argv[1]), files = atoi(argv[2]);
+    int count = atoi(argv[3]);
+    char path[MAX_PATH];
+    int ret = 0;
+
+    if (ata_init())
+        return -1;
+
+    core_allocator_init();
+    dircache_init(0);
+    filesystem_init();
+
+    if (!disk_mount_all())
+    {
+        printf("No FAT partition\n");
+        return -1;
+    }
+
+    /* fill the image the first time around */
+    sprintf(path, "/dir %03d", dirs - 1);
+    DIR *dir = opendir(path);
+    if (dir)
+        closedir(dir);
+    else if (make_tree(dirs, files) < 0)
+    {
+        printf("Failed making %d directories of %d files\n", dirs, files);
+        return -2;
+    }
+
+    double start = now();
+    int rc = dircache_enable();
+    struct dircache_info info;
+    dircache_get_info(&info);
+    if (rc < 0 || info.status != DIRCACHE_READY)
+    {
+        printf("Failed building the dircache (%d)\n", rc);
+        return -3;
+    }
+
+    printf("Cache of %d entries built in %.2f s\n", info.entry_count,
+           now() - start);
+
+    if (lookups("built", dirs, files, count) < 0)
+        ret = -4;
+
+    make_path(path, 0, files);
+    if (open(path, O_RDONLY) >= 0)
+    {
+        printf("Found %s, which doesn't exist\n", path);
+        ret = -5;
+    }
+
+    /* save it, change the disk behind its back and load it again */
+    rc = dircache_save();
+    dircache_disable();
+
+    if (rc < 0 || make_changes(files, false) < 0 || dircache_load() < 0)
+    {
+        printf("Failed reloading the dircache\n");
+        return -6;
+    }
+
+    if (lookups("loaded", dirs, files, count) < 0 ||
+        check_changes(files) < 0)
+        ret = -7;
+
+    if (dircache_enable() < 0 || lookups("verified", dirs, files, count) < 0 ||
+        check_changes(files) < 0)
+        ret = -8;
+
+    if (make_changes(files, true) < 0)
+        ret = -9;
+
+    dircache_disable();
+    disk_unmount_all();
+    ata_exit();
+
+    return ret;
+}
@@ -0,0 +1,119 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/* There are no threads here. A created thread is run to completion the next
+   time its creator sleeps or waits for it, which is all the dircache thread
+   needs: it works through its queue and exits. */
+#include "config.h"
+#include "system.h"
+#include "kernel.h"
+#include "thread.h"
+#include "audio.h"
+
+volatile long current_tick;
+
+static void (*pending)(void);
+
+unsigned int create_thread(void (*function)(void), void *stack,
+                           size_t stack_size, unsigned flags,
+                           const char *name IF_PRIO(, int priority)
+                           IF_COP(, unsigned int core))
+{
+    pending = function;
+    return 1;
+    (void)stack; (void)stack_size; (void)flags; (void)name;
+}
+
+static void run_pending(void)
+{
+    void (*function)(void) = pending;
+    pending = NULL;
+
+    if (function)
+        function();
+}
+
+void thread_wait(unsigned int thread_id)
+{
+    run_pending();
+    (void)thread_id;
+}
+
+unsigned sleep(unsigned ticks)
+{
+    run_pending();
+    current_tick += ticks;
+    return 0;
+}
+
+void yield(void)
+{
+}
+
+void queue_init(struct event_queue *q, bool register_queue)
+{
+    q->read = q->write = 0;
+    (void)register_queue;
+}
+
+void queue_post(struct event_queue *q, long id, intptr_t data)
+{
+    struct queue_event *ev = &q->events[q->write++ & QUEUE_LENGTH_MASK];
+    ev->id   = id;
+    ev->data = data;
+}
+
+void queue_wait_w_tmo(struct event_queue *q, struct queue_event *ev,
+                      int ticks)
+{
+    if (q->read == q->write)
+    {
+        ev->id = SYS_TIMEOUT;
+        ev->data = 0;
+        return;
+    }
+
+    *ev = q->events[q->read++ & QUEUE_LENGTH_MASK];
+    (void)ticks;
+}
+
+bool queue_peek_ex(struct event_queue *q, struct queue_event *ev,
+                   unsigned int flags, const long (*filters)[2])
+{
+    /* only what the dircache asks: is there anything in the given range */
+    for (unsigned int i = q->read; i != q->write; i++)
+    {
+        struct queue_event *e = &q->events[i & QUEUE_LENGTH_MASK];
+        if (filters && (e->id < (*filters)[0] || e->id > (*filters)[1]))
+            continue;
+
+        if (ev)
+            *ev = *e;
+
+        return true;
+    }
+
+    return false;
+    (void)flags;
+}
+
+size_t audio_buffer_available(void)
+{
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include "debug.h"
 
 static FILE* file;
+unsigned long sectors_read; /* for the seek timing */
 
 void panicf( const char *fmt, ... );
 
@@ -15,6 +16,7 @@ int storage_read_sectors(unsigned long start, int count, void* buf)
     else
         DEBUGF("[Reading block 0x%lx]\n", start); 
 
+    sectors_read += count;
     if(fseek(file,start*SECTOR_SIZE,SEEK_SET)) {
         perror("fseek");
         return -1;
@@ -0,0 +1,77 @@
+#!/bin/sh
+
+# Checks seeking in files whose cluster chains are laid out at random: fills
+# a small image with files of random sizes, deletes a random half of them
+# and writes a file that only fits by wrapping around into the holes. That
+# file mostly has more runs than an extent map holds, so seeks both inside
+# and past the map get checked. Pass a seed to repeat a run.
+
+IMAGE=disk.img
+RESULT=chains.txt
+FILES=200
+ROUNDS=4
+COUNT=2000
+SEED=${1:-`date +%s`}
+
+# just enough clusters for FAT32
+CLUSTERS=66000
+
+fail() {
+    echo "!! Test failed (seed $SEED). Look in $RESULT for test logs."
+    exit 1
+}
+
+try() {
+    echo COMMAND: fat $1 "$2" "$3" >> $RESULT
+    ./fat $1 "$2" "$3" 2>> $RESULT
+    RETVAL=$?
+    [ $RETVAL -ne 0 ] && fail
+}
+
+# prints $1 random numbers from 1 to $2
+random() {
+    awk -v n=$1 -v max=$2 -v seed=$SEED$round \
+        'BEGIN { srand(seed); for (i = 0; i < n; i++) print int(rand() * max) + 1 }'
+}
+
+# prints $1 random sizes adding up to about $2
+split() {
+    random $1 1000 | awk -v total=$2 \
+        '{ w[NR] = $1; sum += $1 } END { for (i = 1; i <= NR; i++) print int(w[i] * total / sum) + 1 }'
+}
+
+chaintest() {
+    kb=$((CLUSTERS * $1 / 2))
+    rm -f $IMAGE
+    dd if=/dev/zero of=$IMAGE bs=1024 count=0 seek=$kb 2> /dev/null
+    /sbin/mkdosfs -F 32 -s $1 $IMAGE > /dev/null
+
+    i=0
+    for size in `split $FILES $((kb * 19 / 20))`;
+    do
+        i=$((i + 1))
+        try mkfile "/frag.$i" $size
+    done
+    for i in `random $((FILES * 3 / 4)) $FILES | sort -un`;
+    do
+        try del "/frag.$i"
+    done
+
+    echo ---Test: round $round, $1 sectors/cluster
+    try mkfile /xhain.rock $((kb * 2 / 5))
+    try chkfile /xhain.rock
+    try seek /xhain.rock $COUNT
+    try trunc /xhain.rock $((`random 1 $((kb / 6))` * 1024))
+    try seek /xhain.rock $COUNT
+    try empty /xhain.rock
+    try seek /xhain.rock $COUNT
+}
+
+rm -f $RESULT
+echo Seed: $SEED
+for round in `seq 1 $ROUNDS`;
+do
+    chaintest `random 1 3 | awk '{ print 2 ^ ($1 - 1) }'`
+done
+
+echo "== Test completed successfully =="
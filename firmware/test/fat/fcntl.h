@@ -0,0 +1,3 @@
+/* The host's fcntl.h declares an open() that conflicts with the one of the
+   file code under test, so use the firmware's flags in its place */
+#include "../../libc/include/fcntl.h"
@@ -8,6 +8,7 @@
 #include "disk.h"
 #include "dir.h"
 #include "file.h"
+#include "file_internal.h"
 #include "ata.h"
 #include "storage.h"
 
@@ -15,10 +16,6 @@ void dbg_dump_sector(int sec);
 void dbg_dump_buffer(unsigned char *buf, int len, int offset);
 void dbg_console(void);
 
-void mutex_init(struct mutex* l) {}
-void mutex_lock(struct mutex* l) {}
-void mutex_unlock(struct mutex* l) {}
-
 void panicf( char *fmt, ...)
 {
     va_list ap;
@@ -94,7 +91,8 @@ void dbg_dir(char* currdir)
     if (dir)
     {
         while ( (entry = readdir(dir)) ) {
-            DEBUGF("%15s %lx\n", entry->d_name, entry->startcluster);
+            struct dirinfo info = dir_get_info(dir, entry);
+            DEBUGF("%15s %ld\n", entry->d_name, (long)info.size);
         }
         closedir(dir);
     }
@@ -505,6 +503,130 @@ int dbg_trunc(char* name, int size)
     return close(fd);
 }
 
+/* times random seeks in a file made by mkfile, checking the data found */
+int dbg_seek(char* name, int count)
+{
+    extern unsigned long sectors_read;
+    char text[CHUNKSIZE], tmp[CHUNKSIZE+1];
+    struct timespec start, end;
+    int i, size;
+    int fd = open(name,O_RDONLY);
+    if (fd<0) {
+        DEBUGF("Failed opening file\n");
+        return -1;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size < CHUNKSIZE) {
+        close(fd);
+        return -2;
+    }
+
+    sectors_read = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i=0; i<count; i++) {
+        int pos = ((int)rand() % size) & ~(CHUNKSIZE-1);
+
+        lseek(fd, pos, SEEK_SET);
+        if (read(fd, text, CHUNKSIZE) != CHUNKSIZE)
+            panicf("Failed reading data\n");
+
+        sprintf(tmp,"%c%06x,",name[1],pos / CHUNKSIZE);
+        if (strncmp(text,tmp,CHUNKSIZE)) {
+            DEBUGF("Mismatch at 0x%x. Expected %.8s found %.8s\n",
+                   pos, tmp, text);
+            return -3;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%d seeks in %d bytes: %.1f us per seek, %lu sectors read\n",
+           count, size,
+           ((end.tv_sec - start.tv_sec) * 1e6 +
+            (end.tv_nsec - start.tv_nsec) / 1e3) / count,
+           sectors_read);
+
+    return close(fd);
+}
+
+/* empties a file made by mkfile while another stream of it has its cluster
+   chain mapped, then writes the file again through that stream: garbage
+   first, then the real data backwards, so that every write seeks. The seeks
+   have to find the new chain, not what was mapped of the old one */
+int dbg_empty(char* name)
+{
+    char text[SECTOR_SIZE+1], tmp[SECTOR_SIZE+1];
+    int i, pos, len, size, fd, fd2;
+
+    fd = open(name,O_RDWR);
+    if (fd<0) {
+        DEBUGF("Failed opening file\n");
+        return -1;
+    }
+
+    /* reading the end maps the whole chain */
+    size = lseek(fd, 0, SEEK_END) & ~(CHUNKSIZE-1);
+    if (size < CHUNKSIZE) {
+        close(fd);
+        return -2;
+    }
+    lseek(fd, size - CHUNKSIZE, SEEK_SET);
+    read(fd, text, CHUNKSIZE);
+
+    fd2 = open(name,O_WRONLY|O_TRUNC);
+    if (fd2<0) {
+        close(fd);
+        return -3;
+    }
+    close(fd2);
+
+    memset(text, 'x', SECTOR_SIZE);
+    lseek(fd, 0, SEEK_SET);
+    for (pos=0; pos<size; pos+=len) {
+        len = size - pos > SECTOR_SIZE ? SECTOR_SIZE : size - pos;
+        if (write(fd, text, len) != len)
+            panicf("Failed writing data\n");
+    }
+
+    for (pos=(size-1) & ~(SECTOR_SIZE-1); pos>=0; pos-=SECTOR_SIZE) {
+        len = size - pos > SECTOR_SIZE ? SECTOR_SIZE : size - pos;
+        for (i=0; i<len/CHUNKSIZE; i++)
+            sprintf(text+i*CHUNKSIZE,"%c%06x,",name[1],
+                    pos/CHUNKSIZE + i);
+
+        lseek(fd, pos, SEEK_SET);
+        if (write(fd, text, len) != len)
+            panicf("Failed writing data\n");
+    }
+
+    if (close(fd) < 0)
+        return -4;
+
+    /* read it all back through a fresh stream */
+    fd = open(name,O_RDONLY);
+    if (fd<0)
+        return -5;
+
+    for (pos=0; pos<size; pos+=len) {
+        len = size - pos > SECTOR_SIZE ? SECTOR_SIZE : size - pos;
+        if (read(fd, text, len) != len)
+            panicf("Failed reading data\n");
+
+        for (i=0; i<len/CHUNKSIZE; i++)
+            sprintf(tmp+i*CHUNKSIZE,"%c%06x,",name[1],
+                    pos/CHUNKSIZE + i);
+
+        if (memcmp(text, tmp, len)) {
+            DEBUGF("Mismatch in sector at 0x%x\n", pos);
+            close(fd);
+            return -6;
+        }
+    }
+
+    return close(fd);
+}
+
 int dbg_mkdir(char* name)
 {
     int fd;
@@ -551,6 +673,8 @@ int dbg_cmd(int argc, char *argv[])
                " append <file>\n"
                " test <file>\n"
                " ren <file> <newname>\n"
+               " seek <file> <count>\n"
+               " empty <file>\n"
             );
         return -1;
     }
@@ -668,6 +792,22 @@ int dbg_cmd(int argc, char *argv[])
             return rename(arg1, arg2);
     }
 
+    if (!strcasecmp(cmd, "seek"))
+    {
+        if (arg1) {
+            if (arg2)
+                return dbg_seek(arg1, strtol(arg2, NULL, 0));
+            else
+                return dbg_seek(arg1, 1000);
+        }
+    }
+
+    if (!strcasecmp(cmd, "empty"))
+    {
+        if (arg1)
+            return dbg_empty(arg1);
+    }
+
     return 0;
 }
 
@@ -675,8 +815,7 @@ extern void ata_exit(void);
 
 int main(int argc, char *argv[])
 {
-    int rc,i;
-    struct partinfo* pinfo;
+    int rc;
 
     srand(clock());
 
@@ -684,36 +823,16 @@ int main(int argc, char *argv[])
         DEBUGF("*** Warning! The disk is uninitialized\n");
         return -1;
     }
-    pinfo = disk_init();
-    if (!pinfo) {
-        DEBUGF("*** Failed reading partitions\n");
-        return -1;
-    }
 
-    for ( i=0; i<4; i++ ) {
-        if ( pinfo[i].type == PARTITION_TYPE_FAT32 
-#ifdef HAVE_FAT16SUPPORT
-          || pinfo[i].type == PARTITION_TYPE_FAT16
-#endif
-        ) {
-            DEBUGF("*** Mounting at block %ld\n",pinfo[i].start);
-            rc = fat_mount(IF_MV(0,) IF_MD(0,) pinfo[i].start);
-            if(rc) {
-                DEBUGF("mount: %d",rc);
-                return -1;
-            }
-            break;
-        }
-    }
-    if ( i==4 ) {
-        if(fat_mount(IF_MV(0,) IF_MD(0,) 0)) {
-            DEBUGF("No FAT32 partition!");
-            return -1;
-        }
+    filesystem_init();
+    if (!disk_mount_all()) {
+        DEBUGF("*** No FAT partition!\n");
+        return -1;
     }
 
     rc = dbg_cmd(argc, argv);
 
+    disk_unmount_all();
     ata_exit();
 
     if (rc)
@@ -0,0 +1,54 @@
+#!/bin/sh
+
+# Times random seeks in a big file spread over the holes left by deleting
+# every other one of a number of smaller files. The image is only just big
+# enough for FAT32 and the small files fill it, so the big file has to go
+# into the holes instead of after them.
+
+IMAGE=disk.img
+RESULT=seek.txt
+HOLES=24
+COUNT=2000
+
+# just enough clusters for FAT32
+CLUSTERS=66000
+
+fail() {
+    echo "!! Test failed. Look in $RESULT for test logs."
+    exit 1
+}
+
+try() {
+    echo COMMAND: fat $1 "$2" "$3" >> $RESULT
+    ./fat $1 "$2" "$3" 2>> $RESULT
+    RETVAL=$?
+    [ $RETVAL -ne 0 ] && fail
+}
+
+seektest() {
+    rm -f $RESULT $IMAGE
+    kb=$((CLUSTERS * $1 / 2))
+    dd if=/dev/zero of=$IMAGE bs=1024 count=0 seek=$kb 2> /dev/null
+    /sbin/mkdosfs -F 32 -s $1 $IMAGE > /dev/null
+
+    for i in `seq 1 $((HOLES * 2))`;
+    do
+        try mkfile "/frag.$i" $((kb * 19 / 20 / (HOLES * 2)))
+    done
+    for i in `seq 1 2 $((HOLES * 2))`;
+    do
+        try del "/frag.$i"
+    done
+
+    echo ---Test: $HOLES fragments, $1 sectors/cluster
+    # mkfile numbers its data for up to 128 MB
+    size=$((kb / 2))
+    [ $size -gt 120000 ] && size=120000
+    try mkfile /xeek.rock $size
+    try seek /xeek.rock $COUNT
+}
+
+seektest 4
+seektest 8
+
+echo "== Test completed successfully =="
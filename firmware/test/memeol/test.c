@@ -0,0 +1,178 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/*
+ * Checks memeol() against a plain byte loop at every alignment and length,
+ * then times both finding the track lines of a large generated M3U the way
+ * add_indices_to_playlist() does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "memeol.h"
+
+#define M3U_TRACKS 50000
+#define M3U_RUNS   20
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *byte_eol(const void *src, size_t len)
+{
+    const unsigned char *s = src;
+
+    for (; len; s++, len--)
+    {
+        if (*s == '\r' || *s == '\n')
+            return (void *)s;
+    }
+
+    return NULL;
+}
+
+static int check(void)
+{
+    static unsigned char buf[256 + 16];
+    int fails = 0;
+
+    for (int round = 0; round < 2000; round++)
+    {
+        /* mostly bytes close to the ones looked for */
+        for (size_t i = 0; i < sizeof (buf); i++)
+        {
+            int r = rand() % 64;
+            buf[i] = r == 0 ? '\r' : r == 1 ? '\n' : r < 32 ? r + 0x80 : r;
+        }
+
+        for (size_t off = 0; off < 16; off++)
+        {
+            size_t len = rand() % (sizeof (buf) - off);
+
+            if (memeol(buf + off, len) != byte_eol(buf + off, len))
+            {
+                printf("mismatch at offset %zu, length %zu\n", off, len);
+                fails++;
+            }
+        }
+    }
+
+    return fails;
+}
+
+/* count the lines that add_indices_to_playlist() would store */
+static int scan_bytes(const char *buf, size_t len)
+{
+    int amount = 0;
+    int store_index = 1;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (buf[i] == '\n' || buf[i] == '\r')
+            store_index = 1;
+        else if (store_index)
+        {
+            store_index = 0;
+            if (buf[i] != '#')
+                amount++;
+        }
+    }
+
+    return amount;
+}
+
+static int scan_memeol(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    int amount = 0;
+    int store_index = 1;
+
+    while (p < end)
+    {
+        if (store_index)
+        {
+            if (*p == '\n' || *p == '\r')
+            {
+                p++;
+                continue;
+            }
+
+            store_index = 0;
+            if (*p != '#')
+                amount++;
+        }
+
+        p = memeol(p, end - p);
+        if (!p)
+            break;
+
+        store_index = 1;
+        p++;
+    }
+
+    return amount;
+}
+
+static void bench(void)
+{
+    size_t size = (size_t)M3U_TRACKS * 96;
+    char *m3u = malloc(size);
+    size_t len = 0;
+
+    if (!m3u)
+        return;
+
+    len += sprintf(m3u, "#EXTM3U\r\n");
+    for (int i = 0; i < M3U_TRACKS; i++)
+    {
+        len += sprintf(m3u + len,
+                       "/Music/Some Artist %d/Some Album/%02d - Track %d.mp3\r\n",
+                       i / 200, i % 20 + 1, i);
+    }
+
+    volatile int expect = 0, got = 0;
+    double t0 = now();
+    for (int i = 0; i < M3U_RUNS; i++)
+        expect = scan_bytes(m3u, len);
+    double t1 = now();
+    for (int i = 0; i < M3U_RUNS; i++)
+        got = scan_memeol(m3u, len);
+    double t2 = now();
+
+    printf("%d tracks, %zu bytes: bytes %.2f ms, memeol %.2f ms%s\n",
+           expect, len, (t1 - t0) * 1000 / M3U_RUNS,
+           (t2 - t1) * 1000 / M3U_RUNS, got == expect ? "" : " MISMATCH");
+
+    free(m3u);
+}
+
+int main(void)
+{
+    int fails = check();
+    bench();
+
+    if (fails)
+        printf("%d failures\n", fails);
+
+    return fails ? 1 : 0;
+}
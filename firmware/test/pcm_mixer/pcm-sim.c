@@ -0,0 +1,157 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+/*
+ * Stands in for the PCM driver underneath the mixer. The lock is a mutex
+ * rather than masking an interrupt, so a test may run the "interrupt" on a
+ * thread of its own.
+ */
+
+#include <pthread.h>
+#include "system.h"
+#include "pcm.h"
+#include "pcm-internal.h"
+#include "general.h"
+#include "pcm-sim.h"
+
+static pthread_mutex_t play_mutex;
+static pthread_once_t play_once = PTHREAD_ONCE_INIT;
+static pcm_play_callback_type play_get_more;
+static pcm_status_callback_type play_status_cb;
+static const void *play_start;
+static size_t play_size;
+static bool playing;
+static unsigned int frequency;
+
+static void play_mutex_init(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&play_mutex, &attr);
+}
+
+void pcm_play_lock(void)
+{
+    pthread_once(&play_once, play_mutex_init);
+    pthread_mutex_lock(&play_mutex);
+}
+
+void pcm_play_unlock(void)
+{
+    pthread_mutex_unlock(&play_mutex);
+}
+
+void pcm_play_data(pcm_play_callback_type get_more,
+                   pcm_status_callback_type status_cb,
+                   const void *start, size_t size)
+{
+    play_get_more = get_more;
+    play_status_cb = status_cb;
+    play_start = start;
+    play_size = size;
+    playing = true;
+}
+
+void pcm_play_stop(void)
+{
+    playing = false;
+}
+
+bool pcm_is_playing(void)
+{
+    return playing;
+}
+
+void pcm_set_frequency(unsigned int samplerate)
+{
+    frequency = samplerate;
+}
+
+unsigned int pcm_get_frequency(void)
+{
+    return frequency;
+}
+
+void pcm_do_peak_calculation(struct pcm_peaks *peaks, bool active,
+                             const void *addr, int count)
+{
+    (void)peaks; (void)active; (void)addr; (void)count;
+}
+
+bool pcm_sim_tick(const void **addr, size_t *size)
+{
+    bool ret = false;
+
+    pcm_play_lock();
+
+    if (playing && play_start)
+    {
+        /* The frame passed to pcm_play_data() */
+        *addr = play_start;
+        *size = play_size;
+        play_start = NULL;
+        ret = true;
+    }
+    else if (playing)
+    {
+        *size = 0;
+        play_get_more(addr, size);
+
+        if (*size)
+        {
+            play_status_cb(PCM_DMAST_STARTED);
+            ret = true;
+        }
+        else
+        {
+            playing = false;
+        }
+    }
+
+    pcm_play_unlock();
+
+    return ret;
+}
+
+/* From firmware/general.c, which doesn't build for the host */
+void ** find_array_ptr(void **arr, void *ptr)
+{
+    void *curr;
+    for (curr = *arr; curr != NULL && curr != ptr; curr = *(++arr));
+    return arr;
+}
+
+int remove_array_ptr(void **arr, void *ptr)
+{
+    void *curr;
+    arr = find_array_ptr(arr, ptr);
+
+    if (*arr == NULL)
+        return -1;
+
+    do
+    {
+        void **arr1 = arr + 1;
+        *arr++ = curr = *arr1;
+    }
+    while (curr != NULL);
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+
+/*
+ * Plays buffers queued to a mixer channel and checks that they come out in
+ * order and complete, that the channel stops when its queue runs dry, when
+ * the mixer is done with each buffer, and that moving the buffers while
+ * they're queued works.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "system.h"
+#include "pcm.h"
+#include "pcm_mixer.h"
+#include "pcm-sim.h"
+
+#define CHAN PCM_MIXER_CHAN_VOICE
+
+static uint32_t data[4*MIX_FRAME_SAMPLES];
+static uint32_t moved[4*MIX_FRAME_SAMPLES];
+static uint32_t out[1 << 16];
+
+/* Numbers the samples from 1 so they stand out from silence */
+static void fill(uint32_t *buf, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        buf[i] = i + 1;
+}
+
+/* Play until PCM stops and return the samples that weren't silence */
+static size_t drain(void)
+{
+    const void *addr;
+    size_t size, count = 0;
+
+    while (pcm_sim_tick(&addr, &size))
+    {
+        const uint32_t *src = addr;
+        for (size_t i = 0; i < size / 4; i++)
+            if (src[i] != 0)
+                out[count++] = src[i];
+    }
+
+    return count;
+}
+
+/* Whether out[] holds the first count samples, in order */
+static int check_out(size_t count, size_t expected)
+{
+    if (count != expected)
+        return 1;
+
+    for (size_t i = 0; i < count; i++)
+        if (out[i] != i + 1)
+            return 1;
+
+    return 0;
+}
+
+static int test_order(void)
+{
+    struct mixer_channel_stats stats;
+    unsigned int done = mixer_channel_queue_done(CHAN);
+    int ret = 0;
+
+    fill(data, 937);
+    ret |= !mixer_channel_queue_data(CHAN, &data[0], 100*4);
+    ret |= !mixer_channel_queue_data(CHAN, &data[100], 37*4);
+    ret |= !mixer_channel_queue_data(CHAN, &data[137], 800*4);
+
+    /* Nothing plays until it's started */
+    ret |= mixer_channel_status(CHAN) != CHANNEL_STOPPED;
+    ret |= pcm_is_playing();
+
+    mixer_channel_get_stats(CHAN, &stats);
+    ret |= stats.bytes_waiting != 937*4;
+
+    /* Starting mixes the first two frames; more than that is queued */
+    mixer_channel_play_queue(CHAN);
+    ret |= mixer_channel_status(CHAN) != CHANNEL_PLAYING;
+    ret |= check_out(drain(), 937);
+
+    /* Ran dry and stopped by itself */
+    ret |= mixer_channel_status(CHAN) != CHANNEL_STOPPED;
+    ret |= mixer_channel_queue_done(CHAN) - done != 3;
+
+    mixer_channel_get_stats(CHAN, &stats);
+    ret |= stats.underruns != 1;
+    ret |= stats.bytes_waiting != 0;
+
+    return ret;
+}
+
+static int test_full_and_stop(void)
+{
+    unsigned int done = mixer_channel_queue_done(CHAN);
+    int ret = 0;
+
+    fill(data, 8*16);
+
+    for (int i = 0; i < 8; i++)
+        ret |= !mixer_channel_queue_data(CHAN, &data[i*16], 16*4);
+
+    ret |= mixer_channel_queue_data(CHAN, data, 16*4);
+
+    /* Stopping drops the queue and gives every buffer back */
+    mixer_channel_play_queue(CHAN);
+    mixer_channel_stop(CHAN);
+    ret |= mixer_channel_queue_done(CHAN) - done != 8;
+    ret |= mixer_channel_status(CHAN) != CHANNEL_STOPPED;
+
+    mixer_channel_play_queue(CHAN);
+    ret |= mixer_channel_status(CHAN) != CHANNEL_STOPPED;
+
+    mixer_reset();
+    ret |= drain() != 0;
+
+    return ret;
+}
+
+static int test_done(void)
+{
+    unsigned int done = mixer_channel_queue_done(CHAN);
+    const void *addr;
+    size_t size;
+    int ret = 0;
+
+    /* Two frames each; starting mixes the first two frames */
+    fill(data, 4*MIX_FRAME_SAMPLES);
+    ret |= !mixer_channel_queue_data(CHAN, &data[0], 2*MIX_FRAME_SAMPLES*4);
+    ret |= !mixer_channel_queue_data(CHAN, &data[2*MIX_FRAME_SAMPLES],
+                                     2*MIX_FRAME_SAMPLES*4);
+    mixer_channel_play_queue(CHAN);
+
+    /* Mixed but not known to be finished until the next buffer is taken */
+    ret |= mixer_channel_queue_done(CHAN) - done != 0;
+    ret |= !pcm_sim_tick(&addr, &size);
+    ret |= mixer_channel_queue_done(CHAN) - done != 0;
+    ret |= !pcm_sim_tick(&addr, &size);
+    ret |= mixer_channel_queue_done(CHAN) - done != 1;
+
+    drain();
+    ret |= mixer_channel_queue_done(CHAN) - done != 2;
+
+    return ret;
+}
+
+static int test_move(void)
+{
+    int ret = 0;
+
+    fill(data, 3*MIX_FRAME_SAMPLES);
+    ret |= !mixer_channel_queue_data(CHAN, &data[0], MIX_FRAME_SAMPLES*4);
+    ret |= !mixer_channel_queue_data(CHAN, &data[MIX_FRAME_SAMPLES],
+                                     MIX_FRAME_SAMPLES*4);
+    ret |= !mixer_channel_queue_data(CHAN, &data[2*MIX_FRAME_SAMPLES],
+                                     MIX_FRAME_SAMPLES*4);
+    mixer_channel_play_queue(CHAN);
+
+    /* Move everything while one buffer is playing and one is queued */
+    memcpy(moved, data, sizeof (data));
+    mixer_adjust_channel_address(CHAN, (void *)moved - (void *)data);
+    memset(data, 0x55, sizeof (data));
+
+    ret |= check_out(drain(), 3*MIX_FRAME_SAMPLES);
+
+    return ret;
+}
+
+int main(void)
+{
+    int ret = 0;
+
+    mixer_channel_set_amplitude(CHAN, MIX_AMP_UNITY);
+
+    ret |= test_order();
+    ret |= test_full_and_stop();
+    ret |= test_done();
+    ret |= test_move();
+
+    printf("%s\n", ret ? "FAILED" : "OK");
+
+    return ret;
+}
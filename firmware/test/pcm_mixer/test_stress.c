@@ -0,0 +1,139 @@
+/***************************************************************************
+*             __________               __   ___.
+*   Open      \______   \ ____   ____ |  | _\_ |__   _______  ___
+*   Source     |       _//  _ \_/ ___\|  |/ /| __ \ /  _ \  \/  /
+*   Jukebox    |    |   (  <_> )  \___|    < | \_\ (  <_> > <  <
+*   Firmware   |____|_  /\____/ \___  >__|_ \|___  /\____/__/\_ \
+*                     \/            \/     \/    \/            \/
+* $Id$
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+* KIND, either express or implied.
+*
+****************************************************************************/
+
+
+/*
+ * Queues numbered samples from one thread while another one plays them, the
+ * way the voice thread feeds its channel. Buffers are reused as soon as the
+ * mixer is done with them, so handing one back too early or seeing a queue
+ * entry before it's complete shows up as samples out of order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "system.h"
+#include "pcm.h"
+#include "pcm_mixer.h"
+#include "pcm-sim.h"
+
+#define CHAN        PCM_MIXER_CHAN_VOICE
+#define NUM_BUFS    4
+#define BUF_SAMPLES 300
+#define NUM_SAMPLES 2000000
+
+static uint32_t bufs[NUM_BUFS][BUF_SAMPLES];
+static volatile bool finished;
+
+static void * producer(void *arg)
+{
+    unsigned int buf_in = mixer_channel_queue_done(CHAN);
+    uint32_t sample = 1;
+
+    while (sample <= NUM_SAMPLES)
+    {
+        if (buf_in - mixer_channel_queue_done(CHAN) >= NUM_BUFS)
+        {
+            /* All in use */
+            mixer_channel_play_queue(CHAN);
+            sched_yield();
+            continue;
+        }
+
+        uint32_t *buf = bufs[buf_in % NUM_BUFS];
+        size_t count = 1 + rand() % BUF_SAMPLES;
+
+        for (size_t i = 0; i < count; i++)
+            buf[i] = sample <= NUM_SAMPLES ? sample++ : 0;
+
+        if (!mixer_channel_queue_data(CHAN, buf, count*4))
+            return "queue full";
+
+        buf_in++;
+
+        /* Start with a little queued, sometimes let it run dry */
+        if (rand() % 2)
+            mixer_channel_play_queue(CHAN);
+    }
+
+    while (buf_in != mixer_channel_queue_done(CHAN))
+    {
+        mixer_channel_play_queue(CHAN);
+        sched_yield();
+    }
+
+    finished = true;
+    return NULL;
+    (void)arg;
+}
+
+int main(void)
+{
+    pthread_t thread;
+    void *error;
+    uint32_t expected = 1;
+    int ret = 0;
+
+    mixer_channel_set_amplitude(CHAN, MIX_AMP_UNITY);
+    srand(1);
+    pthread_create(&thread, NULL, producer, NULL);
+
+    while (!finished || pcm_is_playing())
+    {
+        const void *addr;
+        size_t size;
+
+        if (!pcm_sim_tick(&addr, &size))
+        {
+            sched_yield();
+            continue;
+        }
+
+        const uint32_t *src = addr;
+        for (size_t i = 0; i < size / 4; i++)
+        {
+            if (src[i] == 0)
+                continue;
+
+            if (src[i] != expected)
+                ret = 1;
+
+            expected = src[i] + 1;
+        }
+    }
+
+    pthread_join(thread, &error);
+
+    if (error)
+    {
+        printf("%s\n", (char *)error);
+        ret = 1;
+    }
+
+    if (expected != NUM_SAMPLES + 1)
+        ret = 1;
+
+    struct mixer_channel_stats stats;
+    mixer_channel_get_stats(CHAN, &stats);
+    printf("%u underruns\n", stats.underruns);
+    printf("%s\n", ret ? "FAILED" : "OK");
+
+    return ret;
+}
@@ -22,6 +22,7 @@
 #include "tag_table.h"
 
 #include <string.h>
+#include <stdbool.h>
 #define BAR_PARAMS "?[iP][iP][iP][iP]|s*"
 /* The tag definition table */
 static const struct tag_info legal_tags[] = 
@@ -253,40 +254,64 @@ static const struct tag_info legal_tags[] =
 /* A table of legal escapable characters */
 static const char legal_escape_characters[] = "%(,);#<|>";
 
+#define NUM_LEGAL_TAGS (sizeof(legal_tags)/sizeof(*legal_tags) - 1)
+
+/* Indices into legal_tags[] ordered by tag name, so lookups can use a
+ * binary search instead of walking the whole table for every tag the
+ * parser sees.  legal_tags[] itself stays grouped by feature; the index
+ * is built the first time a tag is looked up. */
+static unsigned char sorted_tags[NUM_LEGAL_TAGS];
+static bool sorted_tags_ready = false;
+
+typedef char sorted_tags_fit_in_a_byte[NUM_LEGAL_TAGS <= 256 ? 1 : -1];
+
+static void sort_tags(void)
+{
+    unsigned int i, j;
+
+    /* insertion sort, the table is small and this only runs once */
+    for (i = 0; i < NUM_LEGAL_TAGS; i++)
+    {
+        for (j = i; j > 0 &&
+             strcmp(legal_tags[sorted_tags[j-1]].name, legal_tags[i].name) > 0;
+             j--)
+        {
+            sorted_tags[j] = sorted_tags[j-1];
+        }
+        sorted_tags[j] = i;
+    }
+    sorted_tags_ready = true;
+}
+
 /*
- * Just does a straight search through the tag table to find one by
- * the given name
+ * Binary search of the tag table by name
  */
 const struct tag_info* find_tag(const char* name)
 {
-    
-    const struct tag_info* current = legal_tags;
-    
-    /* 
-     * Continue searching so long as we have a non-empty name string
-     * and the name of the current element doesn't match the name
-     * we're searching for
-     */
-    
-    while(strcmp(current->name, name) && current->name[0] != '\0')
-        current++;
+    unsigned int low = 0, high = NUM_LEGAL_TAGS;
 
-    if(current->name[0] == '\0')
-        return NULL;
-    else
-        return current;
+    if (!sorted_tags_ready)
+        sort_tags();
 
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        const struct tag_info* current = &legal_tags[sorted_tags[mid]];
+        int cmp = strcmp(name, current->name);
+
+        if (cmp == 0)
+            return current;
+        else if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    return NULL;
 }
 
 /* Searches through the legal escape characters string */
 int find_escape_character(char lookup)
 {
-    const char* current = legal_escape_characters;
-    while(*current != lookup && *current != '\0')
-        current++;
-
-    if(*current == lookup && *current)
-        return 1;
-    else
-        return 0;
+    return lookup != '\0' && strchr(legal_escape_characters, lookup) != NULL;
 }
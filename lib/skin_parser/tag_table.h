@@ -345,8 +345,8 @@ struct tag_info
 };
 
 /* 
- * Finds a tag by name and returns its parameter list, or an empty
- * string if the tag is not found in the table
+ * Finds a tag by name and returns its table entry, or NULL if the tag
+ * is not found in the table
  */
 const struct tag_info* find_tag(const char* name);
 
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "config.h"
 #include "checkwps.h"
 #include "resize.h"
@@ -255,6 +256,7 @@ int main(int argc, char **argv)
 {
     int res;
     int filearg = 1;
+    bool show_time = false;
 
     struct wps_data wps={0};
     enum screen_type screen = SCREEN_MAIN;
@@ -271,16 +273,19 @@ int main(int argc, char **argv)
         printf("\t-v\t\tverbose\n");
         printf("\t-vv\t\tmore verbose\n");
         printf("\t-vvv\t\tvery verbose\n");
+        printf("\t-t\t\tshow the parse time of each file\n");
         printf("\t-h,\t--help\tshow this message\n");
         return 1;
     }
 
     if (argv[1][0] == '-') {
         filearg++;
-        int i = 1;
-        while (argv[1][i] && argv[1][i] == 'v') {
-            i++;
-            wps_verbose_level++;
+        int i;
+        for (i = 1; argv[1][i]; i++) {
+            if (argv[1][i] == 'v')
+                wps_verbose_level++;
+            else if (argv[1][i] == 't')
+                show_time = true;
         }
     }
     skin_buffer = malloc(SKIN_BUFFER_SIZE);
@@ -298,6 +303,7 @@ int main(int argc, char **argv)
         const char* name = argv[filearg++];
         char *ext = strrchr(name, '.');
         struct skin_stats stats;
+        clock_t start;
         printf("Checking %s...\n", name);
         if (!ext)
         {
@@ -325,7 +331,11 @@ int main(int argc, char **argv)
         }
         wps_screen = &screens[screen];
 
+        start = clock();
         res = skin_data_load(screen, &wps, name, true, &stats);
+        if (show_time)
+            printf("Parse time: %.3f ms\n",
+                   (clock() - start) * 1000.0 / CLOCKS_PER_SEC);
 
         if (!res) {
             printf("WPS parsing failure\n");
@@ -1,33 +1,551 @@
-/* A _very_ skeleton file to demonstrate building tagcache db on host. */
+/* Host database builder. Metadata parsing is spread over a number of
+ * worker processes, the results are fed to the regular tagcache code which
+ * writes the db files exactly like the player would. */
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include "config.h"
 #include "tagcache.h"
+#include "metadata.h"
 #include "dir.h"
+#include "file.h"
 
 /* This is meant to be run on the root of the dap. it'll put the db files into
  * a .rockbox subdir */
 
+/* A file found while walking the tree, and its metadata once parsed. */
+struct dbfile {
+    char *path;
+    off_t size;
+    bool parsed;
+    bool ok;
+    int year, discnum, tracknum;
+    unsigned int bitrate;
+    unsigned long length;
+#define DBFILE_STRINGS 8
+    char *str[DBFILE_STRINGS];
+};
+
+static struct dbfile *files;
+static struct dbfile **sorted_files;
+static int file_count, file_alloc;
+static off_t total_size;
+
+/* Work queue shared with the worker processes. */
+struct workqueue {
+    volatile int next;  /* Next file to parse */
+    volatile int done;  /* Files parsed so far */
+};
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void add_file(const char *path, off_t size)
+{
+    if (file_count == file_alloc)
+    {
+        file_alloc = file_alloc ? file_alloc * 2 : 1024;
+        files = realloc(files, file_alloc * sizeof(struct dbfile));
+        if (!files)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    memset(&files[file_count], 0, sizeof(struct dbfile));
+    files[file_count].path = strdup(path);
+    files[file_count].size = size;
+    file_count++;
+    total_size += size;
+}
+
+static void free_files(void)
+{
+    int i, s;
+
+    for (i = 0; i < file_count; i++)
+    {
+        free(files[i].path);
+        for (s = 0; s < DBFILE_STRINGS; s++)
+            free(files[i].str[s]);
+    }
+
+    file_count = 0;
+    total_size = 0;
+}
+
+/* Whether the database already has the file as it is now; tagcache skips
+ * those without parsing them. */
+static bool in_database(const char *path, unsigned long mtime)
+{
+    struct tagcache_search tcs;
+    bool found = false;
+
+    if (tagcache_find_index(&tcs, path))
+    {
+        found = (unsigned long)tagcache_get_numeric(&tcs, tag_mtime) == mtime;
+        tagcache_search_finish(&tcs);
+    }
+
+    return found;
+}
+
+/* Collects the files below path that the tagcache scan will add, the same
+ * way check_dir() and add_tagcache() pick them: database.ignore and
+ * database.unignore are applied, linked directories aren't followed and
+ * files that are too long to store, of unknown format or, if new_only,
+ * already in the database are left out. */
+static void walk_dir(char *path, size_t size, bool add_files, bool new_only)
+{
+    DIR *dir;
+    struct dirent *entry;
+    size_t len = strlen(path);
+    char ignore[MAX_PATH];
+    bool ignored, unignored;
+
+    dir = opendir(len ? path : "/");
+    if (!dir)
+        return;
+
+    snprintf(ignore, sizeof(ignore), "%s/database.ignore", path);
+    ignored = file_exists(ignore);
+    snprintf(ignore, sizeof(ignore), "%s/database.unignore", path);
+    unignored = file_exists(ignore);
+
+    /* don't do anything if both ignore and unignore are there */
+    if (ignored != unignored)
+        add_files = unignored;
+
+    /* don't add an extra / for the root */
+    if (len <= 1)
+        len = 0;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct dirinfo info;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        info = dir_get_info(dir, entry);
+        snprintf(&path[len], size - len, "/%s", entry->d_name);
+
+        if (info.attribute & ATTR_DIRECTORY)
+        {
+            if (!(info.attribute & ATTR_LINK))
+                walk_dir(path, size, add_files, new_only);
+        }
+        else if (add_files && strlen(path) <= TAG_MAXLEN
+                 && probe_file_format(path) != AFMT_UNKNOWN
+                 && !(new_only && in_database(path, info.mtime)))
+        {
+            add_file(path, info.size);
+        }
+
+        path[len] = '\0';
+    }
+
+    closedir(dir);
+}
+
+#ifndef _WIN32
+static void write_string(FILE *out, const char *str)
+{
+    int len = str ? (int)strlen(str) : -1;
+
+    fwrite(&len, sizeof(len), 1, out);
+    if (len > 0)
+        fwrite(str, len, 1, out);
+}
+
+static char *read_string(FILE *in)
+{
+    int len;
+    char *str;
+
+    if (fread(&len, sizeof(len), 1, in) != 1 || len < 0)
+        return NULL;
+
+    str = malloc(len + 1);
+    if (!str || (len > 0 && fread(str, len, 1, in) != 1))
+    {
+        free(str);
+        return NULL;
+    }
+
+    str[len] = '\0';
+    return str;
+}
+
+/* Parses one file and appends the result to out. */
+static void parse_file(int i, FILE *out)
+{
+    struct mp3entry id3;
+    int ok = 0;
+    int fd;
+
+    memset(&id3, 0, sizeof(struct mp3entry));
+    fd = open(files[i].path, O_RDONLY);
+    if (fd >= 0)
+    {
+        ok = get_metadata(&id3, fd, files[i].path);
+        close(fd);
+    }
+
+    fwrite(&i, sizeof(i), 1, out);
+    fwrite(&ok, sizeof(ok), 1, out);
+    if (!ok)
+        return;
+
+    fwrite(&id3.year, sizeof(id3.year), 1, out);
+    fwrite(&id3.discnum, sizeof(id3.discnum), 1, out);
+    fwrite(&id3.tracknum, sizeof(id3.tracknum), 1, out);
+    fwrite(&id3.bitrate, sizeof(id3.bitrate), 1, out);
+    fwrite(&id3.length, sizeof(id3.length), 1, out);
+    write_string(out, id3.title);
+    write_string(out, id3.artist);
+    write_string(out, id3.album);
+    write_string(out, id3.genre_string);
+    write_string(out, id3.composer);
+    write_string(out, id3.comment);
+    write_string(out, id3.albumartist);
+    write_string(out, id3.grouping);
+}
+
+/* Reads back the results a worker left in its output file. */
+static void read_results(FILE *in)
+{
+    int i, ok, s;
+
+    rewind(in);
+    while (fread(&i, sizeof(i), 1, in) == 1 && fread(&ok, sizeof(ok), 1, in) == 1)
+    {
+        struct dbfile *f;
+
+        if (i < 0 || i >= file_count)
+            break;
+
+        f = &files[i];
+        f->parsed = true;
+        f->ok = ok;
+        if (!ok)
+            continue;
+
+        if (fread(&f->year, sizeof(f->year), 1, in) != 1
+            || fread(&f->discnum, sizeof(f->discnum), 1, in) != 1
+            || fread(&f->tracknum, sizeof(f->tracknum), 1, in) != 1
+            || fread(&f->bitrate, sizeof(f->bitrate), 1, in) != 1
+            || fread(&f->length, sizeof(f->length), 1, in) != 1)
+        {
+            f->parsed = false;
+            break;
+        }
+
+        for (s = 0; s < DBFILE_STRINGS; s++)
+            f->str[s] = read_string(in);
+    }
+}
+
+/**
+ * The metadata parsers keep per file state in static variables, so the
+ * pool uses processes instead of threads. Workers take files from a
+ * shared counter and write their results to a temporary file each.
+ */
+static void parse_all(int workers)
+{
+    struct workqueue *queue;
+    FILE **out;
+    pid_t *pids;
+    double start = now();
+    double elapsed;
+    int started = 0;
+    int i;
+
+    queue = mmap(NULL, sizeof(struct workqueue), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    out = calloc(workers, sizeof(FILE *));
+    pids = calloc(workers, sizeof(pid_t));
+    if (queue == MAP_FAILED || !out || !pids)
+    {
+        fprintf(stderr, "can't start workers, parsing while scanning\n");
+        return;
+    }
+
+    queue->next = 0;
+    queue->done = 0;
+    fflush(stdout);
+
+    for (i = 0; i < workers; i++)
+    {
+        out[i] = tmpfile();
+        if (!out[i])
+            break;
+
+        pids[i] = fork();
+        if (pids[i] < 0)
+        {
+            fclose(out[i]);
+            break;
+        }
+
+        if (pids[i] == 0)
+        {
+            int next;
+
+            while ((next = __sync_fetch_and_add(&queue->next, 1)) < file_count)
+            {
+                parse_file(next, out[i]);
+                __sync_fetch_and_add(&queue->done, 1);
+            }
+
+            fflush(out[i]);
+            _exit(0);
+        }
+
+        started++;
+    }
+
+    /* Report progress until all workers are done. */
+    for (i = 0; i < started; )
+    {
+        if (waitpid(pids[i], NULL, WNOHANG) == pids[i])
+        {
+            i++;
+            continue;
+        }
+
+        printf("\rParsing metadata: %d/%d", queue->done, file_count);
+        fflush(stdout);
+        usleep(200000);
+    }
+
+    elapsed = now() - start;
+    printf("\rParsed %d files (%.1f MB) in %.2f s with %d workers: "
+           "%.0f files/s, %.1f MB/s\n", queue->done, total_size / 1048576.0,
+           elapsed, started, queue->done / (elapsed > 0 ? elapsed : 1),
+           total_size / 1048576.0 / (elapsed > 0 ? elapsed : 1));
+
+    for (i = 0; i < started; i++)
+    {
+        read_results(out[i]);
+        fclose(out[i]);
+    }
+
+    free(out);
+    free(pids);
+    munmap(queue, sizeof(struct workqueue));
+}
+#endif /* !_WIN32 */
+
+static int compare_path(const void *p1, const void *p2)
+{
+    const struct dbfile *f1 = *(const struct dbfile **)p1;
+    const struct dbfile *f2 = *(const struct dbfile **)p2;
+
+    return strcmp(f1->path, f2->path);
+}
+
+/* Hands the parsed metadata over to tagcache. */
+static int prefetched_metadata(struct mp3entry *id3, const char *path)
+{
+    struct dbfile key, *keyp = &key, **found, *f;
+
+    key.path = (char *)path;
+    found = bsearch(&keyp, sorted_files, file_count, sizeof(struct dbfile *),
+                    compare_path);
+    if (!found || !(*found)->parsed)
+        return -1;
+
+    f = *found;
+    if (!f->ok)
+        return 0;
+
+    id3->year = f->year;
+    id3->discnum = f->discnum;
+    id3->tracknum = f->tracknum;
+    id3->bitrate = f->bitrate;
+    id3->length = f->length;
+    id3->title = f->str[0];
+    id3->artist = f->str[1];
+    id3->album = f->str[2];
+    id3->genre_string = f->str[3];
+    id3->composer = f->str[4];
+    id3->comment = f->str[5];
+    id3->albumartist = f->str[6];
+    id3->grouping = f->str[7];
+
+    return 1;
+}
+
+/* Times looking up every file by name in random order, through the
+ * filename hash index and with the linear scan of the filename tag file
+ * the lookups fall back to without one. */
+static void bench_lookups(void)
+{
+    struct tagcache_search tcs;
+    char path[MAX_PATH];
+    int *order;
+    int pass, found, i;
+
+    /* everything in the database, not just what this run added */
+    free_files();
+    path[0] = '\0';
+    walk_dir(path, sizeof(path), true, false);
+
+    order = malloc(file_count * sizeof(int));
+    if (!order)
+        return;
+
+    srand(1);
+    for (i = 0; i < file_count; i++)
+    {
+        int j = rand() % (i + 1);
+        order[i] = order[j];
+        order[j] = i;
+    }
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        double start;
+
+        /* without the index file lookups have to scan */
+        if (pass == 1 && rename(TAGCACHE_FILE_FILEHASH,
+                                TAGCACHE_FILE_FILEHASH ".bench") < 0)
+            break;
+
+        start = now();
+        for (found = 0, i = 0; i < file_count; i++)
+        {
+            if (tagcache_find_index(&tcs, files[order[i]].path))
+            {
+                found++;
+                tagcache_search_finish(&tcs);
+            }
+        }
+
+        printf("Lookup (%s): %d/%d found, %.1f us per file\n",
+               pass ? "scan" : "hash", found, file_count,
+               (now() - start) * 1000000.0 / (file_count ? file_count : 1));
+    }
+
+    if (pass == 2)
+        rename(TAGCACHE_FILE_FILEHASH ".bench", TAGCACHE_FILE_FILEHASH);
+
+    free(order);
+}
+
+static void usage(void)
+{
+    printf("usage: database [-j workers] [-b]\n"
+           "\n"
+           "Builds or updates the database of the current directory, which\n"
+           "should be the root of the player. The files are written to the\n"
+           ROCKBOX_DIR " subdirectory.\n"
+           "\n"
+           "  -j workers  Number of processes parsing metadata (default: one\n"
+           "              per CPU, 1 parses while scanning)\n"
+           "  -b          Time looking up every file by name afterwards\n");
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    char path[MAX_PATH];
+    double start;
+    int workers = 1;
+    bool bench = false;
+    int i;
+
+#ifndef _WIN32
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (!strncmp(argv[i], "-j", 2) && argv[i][2])
+            workers = atoi(&argv[i][2]);
+        else if (!strcmp(argv[i], "-b"))
+            bench = true;
+        else
+            usage();
+    }
+
+    if (workers < 1)
+        workers = 1;
 
     errno = 0;
     if (mkdir(ROCKBOX_DIR) == -1 && errno != EEXIST)
         return 1;
 
+    start = now();
+
+    /* the walk needs to know what's in the database already */
+    tagcache_init();
+
+#ifndef _WIN32
+    if (workers > 1)
+    {
+        path[0] = '\0';
+        walk_dir(path, sizeof(path), true, true);
+        printf("Found %d new or changed files in %.2f s\n", file_count,
+               now() - start);
+
+        if (file_count > 0)
+        {
+            parse_all(workers);
+
+            sorted_files = malloc(file_count * sizeof(struct dbfile *));
+            if (sorted_files)
+            {
+                for (i = 0; i < file_count; i++)
+                    sorted_files[i] = &files[i];
+                qsort(sorted_files, file_count, sizeof(struct dbfile *),
+                      compare_path);
+                tagcache_set_metadata_hook(prefetched_metadata);
+            }
+        }
+    }
+#else
+    (void)path;
+#endif
+
     /* / is actually ., will get translated in io.c
      * (with the help of sim_root_dir below */
     const char *paths[] = { "/", NULL };
-    tagcache_init();
     do_tagcache_build(paths);
     tagcache_reverse_scan();
-    
+
+    struct tagcache_stat *stat = tagcache_get_stat();
+    printf("Database built in %.2f s\n", now() - start);
+    printf("Commit: %ld ms (tags %ld, numeric %ld, hash %ld ms), "
+           "%d tag files merged\n",
+           stat->commit_ticks * 1000 / HZ,
+           stat->commit_index_ticks * 1000 / HZ,
+           stat->commit_numeric_ticks * 1000 / HZ,
+           stat->commit_hash_ticks * 1000 / HZ,
+           stat->commit_merged);
+
+    if (bench)
+        bench_lookups();
+
     return 0;
 }
 